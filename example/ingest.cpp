@@ -0,0 +1,43 @@
+#include <drogon/utils/coroutine.h>
+#include <tllf/embedder.hpp>
+#include <tllf/ingest.hpp>
+#include <tllf/tllf.hpp>
+#include <tllf/vector_index.hpp>
+#include <drogon/HttpAppFramework.h>
+#include <iostream>
+
+// Embed every file given on the command line into a FlatIndex
+// Usage: ingest <file>...
+
+using namespace drogon;
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> paths(argv + 1, argv + argc);
+    auto embedder = std::make_shared<tllf::BatchingTextEmbedder>(
+        std::make_shared<tllf::DeepinfraTextEmbedder>("BAAI/bge-large-en-v1.5", "https://api.deepinfra.com", tllf::internal::env("DEEPINFRA_API_KEY")));
+
+    tllf::FlatIndex index;
+    std::vector<tllf::Chunk> chunks;
+    tllf::IngestionPipeline pipeline(embedder, [&](std::vector<tllf::Chunk>& batch, const tllf::EmbeddingMatrix& embeddings) {
+        std::vector<uint64_t> ids;
+        for(auto& chunk : batch) {
+            ids.push_back(chunk.id);
+            chunks.push_back(std::move(chunk));
+        }
+        index.add(ids, embeddings);
+    }, tllf::TextChunker(1000, 200));
+
+    app().getLoop()->queueInLoop(async_func([&]() -> Task<> {
+        try {
+            auto stats = co_await pipeline.run(paths);
+            std::cout << stats.toString() << "\n";
+            std::cout << "Index holds " << index.size() << " chunks\n";
+        }
+        catch(const std::exception& e) {
+            std::cerr << "Ingestion failed: " << e.what() << "\n";
+        }
+        app().quit();
+    }));
+    app().run();
+}
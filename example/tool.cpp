@@ -3,7 +3,6 @@
 #include <drogon/drogon.h>
 #include <glaze/json/write.hpp>
 #include <iostream>
-#include <nlohmann/json.hpp>
 
 using namespace tllf;
 using namespace drogon;
@@ -31,11 +30,10 @@ Task<> func()
     auto tool = co_await toolize(foo);
     // auto tool2 = co_await toolize(bar);
     std::cout << glz::write_json(tool.makeOpenAIToolObject()).value() << std::endl;
-    nlohmann::json json = {
-        {"str", "Hello"},
-        {"num", 42}
-    };
-    auto result = co_await tool(json.dump());
+    glz::generic json;
+    json["str"] = "Hello";
+    json["num"] = 42;
+    auto result = co_await tool(glz::write_json(json).value());
     std::cout << result << std::endl;
 }
 
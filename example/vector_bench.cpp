@@ -0,0 +1,89 @@
+#include <tllf/quantization.hpp>
+#include <tllf/vector_index.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <unordered_set>
+
+// Recall and queries per second of HnswIndex and QuantizedIndex against exact FlatIndex search on random data.
+// Usage: vector_bench [num_vectors] [dim] [num_queries]
+
+using namespace tllf;
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    size_t n = argc > 1 ? std::atoll(argv[1]) : 100000;
+    size_t dim = argc > 2 ? std::atoll(argv[2]) : 128;
+    size_t num_queries = argc > 3 ? std::atoll(argv[3]) : 1000;
+    const size_t k = 10;
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist;
+    EmbeddingMatrix data(n, dim), queries(num_queries, dim);
+    for(size_t i = 0; i < n * dim; i++)
+        data.data()[i] = dist(rng);
+    for(size_t i = 0; i < num_queries * dim; i++)
+        queries.data()[i] = dist(rng);
+    std::vector<uint64_t> ids(n);
+    for(size_t i = 0; i < n; i++)
+        ids[i] = i;
+
+    FlatIndex flat(dim);
+    flat.add(ids, data);
+    auto start = std::chrono::steady_clock::now();
+    auto exact = flat.search(queries, k);
+    std::cout << "flat:  " << num_queries / seconds(start) << " QPS\n";
+
+    HnswIndex hnsw(dim, n);
+    start = std::chrono::steady_clock::now();
+    hnsw.add(ids, data);
+    std::cout << "hnsw build: " << seconds(start) << "s\n";
+
+    auto recall = [&](const std::vector<std::vector<SearchResult>>& res) {
+        size_t hits = 0;
+        for(size_t i = 0; i < num_queries; i++) {
+            std::unordered_set<uint64_t> truth;
+            for(const auto& r : exact[i])
+                truth.insert(r.id);
+            for(const auto& r : res[i])
+                hits += truth.count(r.id);
+        }
+        return double(hits) / (num_queries * k);
+    };
+
+    for(size_t ef : {16, 32, 64, 128, 256, 512}) {
+        start = std::chrono::steady_clock::now();
+        auto res = hnsw.search(queries, k, ef);
+        double qps = num_queries / seconds(start);
+        std::cout << "hnsw ef=" << ef << ": recall@" << k << " " << recall(res) << ", " << qps << " QPS\n";
+    }
+
+    for(auto quantization : {Quantization::Int8, Quantization::Binary}) {
+        const char* name = quantization == Quantization::Int8 ? "int8" : "binary";
+        for(bool rerank : {false, true}) {
+            QuantizedIndex index(dim, quantization, rerank ? "vector_bench.f32" : "");
+            index.add(ids, data);
+            start = std::chrono::steady_clock::now();
+            auto res = index.search(queries, k);
+            double qps = num_queries / seconds(start);
+            std::cout << name << (rerank ? " + rerank" : "") << ": recall@" << k << " " << recall(res) << ", " << qps
+                << " QPS, " << index.memoryUsage() / double(n * dim * sizeof(float)) << "x the float32 size\n";
+        }
+    }
+    std::remove("vector_bench.f32");
+
+    const std::string path = "vector_bench.hnsw";
+    hnsw.save(path);
+    start = std::chrono::steady_clock::now();
+    HnswIndex mapped(path);
+    std::cout << "mapped open: " << seconds(start) * 1000 << "ms\n";
+    std::remove(path.c_str());
+}
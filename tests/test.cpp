@@ -1,9 +1,30 @@
 #include <drogon/drogon_test.h>
 #include <drogon/utils/coroutine.h>
+#include <drogon/utils/Utilities.h>
+#include <trantor/net/EventLoopThread.h>
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
 #include <functional>
+#include "tllf/base64.hpp"
+#include "tllf/bm25.hpp"
+#include "tllf/cascade.hpp"
+#include "tllf/embedder.hpp"
+#include "tllf/http_stream.hpp"
+#include "tllf/ingest.hpp"
+#include "tllf/load_balancer.hpp"
+#include "tllf/partial_json.hpp"
+#include "tllf/prompt_library.hpp"
+#include "tllf/quantization.hpp"
+#include "tllf/semantic_cache.hpp"
+#include "tllf/stop_matcher.hpp"
 #include "tllf/tllf.hpp"
 #include "tllf/tool.hpp"
+#include "tllf/url_parser.hpp"
+#include "tllf/vector_index.hpp"
 #include <optional>
+#include <set>
 
 using namespace tllf;
 
@@ -34,6 +55,1059 @@ DROGON_TEST(PromptTemplate)
     REQUIRE_THROWS(prompt.render());
 }
 
+DROGON_TEST(CompiledPrompt)
+{
+    CompiledPrompt prompt("Hello {name}. {greeting}", {{"greeting", "Nice to meet you, {name}"}});
+    REQUIRE(prompt.variables() == std::vector<std::string>{"name"});
+    REQUIRE(prompt.render({{"name", "Tom"}}) == PromptTemplate("Hello {name}. {greeting}", {{"name", "Tom"}, {"greeting", "Nice to meet you, {name}"}}).render());
+    REQUIRE_THROWS(prompt.render());
+
+    std::vector<std::string> names = {"Tom", "Amy", "{not_a_var}"};
+    auto batch = prompt.renderBatch({{"name", names}});
+    REQUIRE(batch.size() == 3);
+    REQUIRE(batch[1] == "Hello Amy. Nice to meet you, Amy");
+    REQUIRE(batch[2] == "Hello {not_a_var}. Nice to meet you, {not_a_var}");
+
+    std::vector<std::string> short_column = {"a"};
+    REQUIRE_THROWS(prompt.renderBatch({{"name", names}, {"other", short_column}}));
+    REQUIRE_THROWS(CompiledPrompt("{var}", {{"var", "{var2}"}, {"var2", "{var}"}}));
+}
+
+DROGON_TEST(PromptLibrary)
+{
+    auto path = std::filesystem::temp_directory_path() / "tllf_test_prompts.yaml";
+    auto write = [&](const std::string& yaml) {
+        std::ofstream(path) << yaml;
+    };
+    write("greet:\n  template: \"Hello {name}, I am {bot}\"\n  defaults:\n    bot: Lacia\nbye: \"Bye {name}\"\n"
+        "sign:\n  template: \"{body}\\n{signature}\"\n  defaults:\n    signature: \"{sender} from {team}\"\n    team: Lab\n");
+
+    PromptLibrary library({path.string()});
+    REQUIRE(library.names().size() == 3);
+    CHECK(library.render("greet", {{"name", "Tom"}}) == "Hello Tom, I am Lacia");
+    CHECK(library.render("greet", {{"name", "Tom"}, {"bot", "Kouhei"}}) == "Hello Tom, I am Kouhei");
+    // Variables inside defaults are expanded, and overriding a nested default still reaches it
+    CHECK(library.render("sign", {{"body", "Hi"}, {"sender", "Amy"}}) == "Hi\nAmy from Lab");
+    CHECK(library.render("sign", {{"body", "Hi"}, {"sender", "Amy"}, {"team", "Ops"}}) == "Hi\nAmy from Ops");
+    CHECK(library.render("sign", {{"body", "Hi"}, {"signature", "{sender}"}}) == "Hi\n{sender}");
+    CHECK(library.get("sign")->prompt.variables() == std::vector<std::string>{"body", "sender"});
+    CHECK(library.get("missing") == nullptr);
+    CHECK_THROWS(library.render("missing"));
+    CHECK(!library.reload());
+
+    // Nothing changed on disk yet. Push the modification time forward so the rewrite is noticed
+    auto mtime = std::filesystem::last_write_time(path);
+    write("greet: \"Hi {name}\"\n");
+    std::filesystem::last_write_time(path, mtime + std::chrono::seconds(1));
+    auto old = library.get("greet");
+    CHECK(library.reload());
+    CHECK(library.render("greet", {{"name", "Tom"}}) == "Hi Tom");
+    CHECK(library.get("bye") == nullptr);
+    // Entries already handed out stay usable
+    CHECK(old->render({{"name", "Tom"}}) == "Hello Tom, I am Lacia");
+
+    // A broken file keeps the last good snapshot
+    write("greet: [\"unclosed\n");
+    CHECK_THROWS(library.reload(true));
+    write("greet:\n  template: \"{a}\"\n  defaults:\n    a: \"{b}\"\n    b: \"{a}\"\n");
+    CHECK_THROWS(library.reload(true));
+    CHECK(library.render("greet", {{"name", "Tom"}}) == "Hi Tom");
+    std::filesystem::remove(path);
+}
+
+DROGON_TEST(base64)
+{
+    REQUIRE(tllf::utils::base64Encode("") == "");
+    REQUIRE(tllf::utils::base64Encode("f") == "Zg==");
+    REQUIRE(tllf::utils::base64Encode("foobar") == "Zm9vYmFy");
+
+    // Cover the SIMD body and every tail length
+    std::string data;
+    for(size_t i = 0; i < 200; i++) {
+        REQUIRE(tllf::utils::base64Encode(data) == drogon::utils::base64Encode(data));
+        REQUIRE(tllf::utils::base64Decode(tllf::utils::base64Encode(data)) == data);
+        data += char(i * 37 + 11);
+    }
+    REQUIRE(tllf::utils::base64Decode("Zg") == "f");
+    REQUIRE_THROWS(tllf::utils::base64Decode("Zm9v$mFy"));
+}
+
+DROGON_TEST(MediaUrl)
+{
+    auto raw = MediaUrl::fromBytes("foobar", "image/png");
+    auto encoded = MediaUrl::fromBase64(std::make_shared<const std::string>("Zm9vYmFy"), "image/png");
+    MediaUrl plain("https://example.com/cat.png");
+    const std::string data_url = "data:image/png;base64,Zm9vYmFy";
+
+    for(const auto& url : {raw, encoded}) {
+        REQUIRE(url.size() == data_url.size());
+        std::string out(url.size() + 4, '#');
+        CHECK(url.write(out.data()) == data_url.size());
+        CHECK(out == data_url + "####");
+        CHECK(url.str() == data_url);
+    }
+    // The MIME type ends up in JSON unescaped
+    CHECK_THROWS(MediaUrl::fromBytes("foobar", "image/png\",\"x"));
+    CHECK_THROWS(MediaUrl::fromBase64(std::make_shared<const std::string>("Zm9vYmFy"), "image/png;base64"));
+    CHECK(MediaUrl::fromBytes("foobar", "image/svg+xml").mime() == "image/svg+xml");
+    CHECK(raw.encoding() == MediaUrl::Encoding::Raw);
+    CHECK(encoded.encoding() == MediaUrl::Encoding::Base64);
+    CHECK(plain.encoding() == MediaUrl::Encoding::Url);
+    CHECK(plain.size() == plain.str().size());
+    CHECK(plain.str() == "https://example.com/cat.png");
+
+    Chatlog log;
+    log.push_back(ChatEntry::Parts{"What is this?", ImageByUrl{.image_url = {.url = raw}}, ImageByUrl{.image_url = {.url = encoded}},
+        ImageByUrl{.image_url = {.url = plain}}}, "user");
+    std::string json = internal::writeChatJson(log);
+    // The data URLs are written out in full, straight into the JSON
+    size_t first = json.find("\"" + data_url + "\"");
+    REQUIRE(first != std::string::npos);
+    CHECK(json.find("\"" + data_url + "\"", first + 1) != std::string::npos);
+    CHECK(json.find("\"https://example.com/cat.png\"") != std::string::npos);
+    CHECK(json.find("What is this?") != std::string::npos);
+
+    // Large images are encoded while the request is sent. The pieces must join into the same JSON, even around text
+    // holding the control characters a marker could have used
+    std::string big;
+    for(size_t i = 0; i < 1536 * 1024 + 1; i++)
+        big += char(i * 131 + i / 7);
+    Chatlog large;
+    large.push_back(ChatEntry::Parts{"\x01" "0\x01 \"quoted\"", ImageByUrl{.image_url = {.url = MediaUrl::fromBytes(big, "image/png")}},
+        ImageByUrl{.image_url = {.url = MediaUrl::fromBase64(std::make_shared<const std::string>(tllf::utils::base64Encode(big)), "image/jpeg")}},
+        "after"}, "user");
+    auto body = internal::writeChatBody(large);
+    REQUIRE(body.writer);
+    std::string joined, chunk;
+    while(true) {
+        chunk.clear();
+        bool more = body.writer(chunk);
+        joined += chunk;
+        if(!more)
+            break;
+    }
+    CHECK(joined == internal::writeChatJson(large));
+}
+
+DROGON_TEST(EmbeddingMatrix)
+{
+    EmbeddingMatrix mat;
+    internal::parseJsonMatrix("[[1, 2.5e-1, -3], [4,5,6]]", mat);
+    REQUIRE(mat.rows() == 2);
+    REQUIRE(mat.dim() == 3);
+    REQUIRE(mat[0][1] == 0.25f);
+    REQUIRE(mat[1][2] == 6.f);
+    REQUIRE(reinterpret_cast<uintptr_t>(mat.data()) % 64 == 0);
+    REQUIRE(mat.toVectors() == std::vector<std::vector<float>>{{1, 0.25f, -3}, {4, 5, 6}});
+
+    REQUIRE_THROWS(internal::parseJsonMatrix("[[1, 2], [3]]", mat));
+    REQUIRE_THROWS(internal::parseJsonMatrix("[[1, 2], [3, 4, 5]]", mat));
+}
+
+DROGON_TEST(EmbeddingResponse)
+{
+    std::vector<float> first = {1.5f, -2.f};
+    std::string b64 = tllf::utils::base64Encode(std::string_view(reinterpret_cast<const char*>(first.data()), first.size() * sizeof(float)));
+    // Out of order, one base64 and one plain array
+    std::string body = R"({"object":"list","data":[{"embedding":[3, 4.25],"index":1},{"embedding":")" + b64 + R"(","index":0}]})";
+    auto res = internal::parseEmbeddingResponse(body, 2);
+    REQUIRE(res.rows() == 2);
+    REQUIRE(res.dim() == 2);
+    CHECK(res.toVectors() == std::vector<std::vector<float>>{{1.5f, -2.f}, {3.f, 4.25f}});
+    CHECK(internal::parseEmbeddingResponse(R"({"data":[]})", 0).empty());
+
+    // JSON allows escaping '/', which base64 uses
+    std::vector<float> slashed = {-25.f, 7.875f};
+    std::string slashed_b64 = tllf::utils::base64Encode(std::string_view(reinterpret_cast<const char*>(slashed.data()), slashed.size() * sizeof(float)));
+    REQUIRE(slashed_b64.find('/') != std::string::npos);
+    auto escaped = internal::parseEmbeddingResponse(R"({"data":[{"embedding":")" + tllf::utils::replaceAll(slashed_b64, "/", "\\/") + R"(","index":0}]})", 1);
+    REQUIRE(escaped.dim() == 2);
+    CHECK(escaped.toVectors()[0] == slashed);
+
+    CHECK_THROWS(internal::parseEmbeddingResponse(body, 3));
+    CHECK_THROWS(internal::parseEmbeddingResponse(R"({"data":[{"embedding":[1, 2],"index":0},{"embedding":[3, 4],"index":0}]})", 2));
+    CHECK_THROWS(internal::parseEmbeddingResponse(R"({"data":[{"embedding":[1, 2],"index":0},{"embedding":[3],"index":1}]})", 2));
+    CHECK_THROWS(internal::parseEmbeddingResponse(R"({"data":[{"embedding":[1, 2],"index":2}]})", 1));
+}
+
+DROGON_TEST(UrlView)
+{
+    for(std::string str : {"https://api.openai.com/v1", "HTTP://Example.com:8080/a/../b?x=1#top", "//cdn.example.com/lib.js",
+        "http://example.com", "HTTP://example.com", "http://example.com:", "http://example.com:99999/", "ftp://.example.com/", "no url"}) {
+        UrlView view(str);
+        Url url(str);
+        REQUIRE(view.good() == url.good());
+        if(!view.good())
+            continue;
+        CHECK(view.url().str() == url.str());
+        CHECK(view.normalizedPath() == url.path());
+        CHECK(view.param() == url.param());
+        CHECK(view.fragment() == url.fragment());
+        CHECK(view.port() == url.port());
+    }
+    CHECK(Url("HTTP://example.com").port() == 80);
+
+    UrlView view("https://Api.example.com:8443/v1?key=1");
+    CHECK(view.origin() == "https://Api.example.com:8443");
+    CHECK(view.path() == "/v1");
+
+    auto id = internal::endpointId(std::string_view("https://api.example.com/v1"));
+    CHECK(internal::endpointId(std::string_view("HTTPS://API.example.com:443/v2?x#y")) == id);
+    CHECK(internal::endpointId(std::string_view("https://api.example.com:8443/v1")) != id);
+    CHECK(internal::endpointString(id) == "https://api.example.com");
+}
+
+DROGON_TEST(FlatIndex)
+{
+    FlatIndex index;
+    CHECK(index.search(std::vector<float>{1, 0, 0}, 2).empty());
+    index.add(1, std::vector<float>{1, 0, 0});
+    index.add(2, std::vector<float>{0, 2, 0});
+    index.add(3, std::vector<float>{1, 1, 0});
+    REQUIRE(index.dim() == 3);
+    REQUIRE_THROWS(index.add(4, std::vector<float>{1, 0}));
+
+    auto res = index.search(std::vector<float>{0, 1, 0}, 2);
+    REQUIRE(res.size() == 2);
+    CHECK(res[0].id == 2);
+    CHECK(res[1].id == 3);
+    CHECK(std::abs(res[0].score - 1.f) < 1e-5f);
+}
+
+DROGON_TEST(HnswIndex)
+{
+    HnswIndex index(2, 100);
+    for(uint64_t i = 0; i < 100; i++) {
+        float angle = i * 0.06f;
+        index.add(i, std::vector<float>{std::cos(angle), std::sin(angle)});
+    }
+    REQUIRE(index.size() == 100);
+    REQUIRE_THROWS(index.add(100, std::vector<float>{1, 0}));
+
+    std::vector<float> query = {std::cos(3.f), std::sin(3.f)};
+    auto res = index.search(query, 3);
+    REQUIRE(res.size() == 3);
+    CHECK(res[0].id == 50);
+
+    auto odd = index.search(query, 3, 0, [](uint64_t id) { return id % 2 == 1; });
+    REQUIRE(odd.size() == 3);
+    CHECK(odd[0].id % 2 == 1);
+
+    REQUIRE_THROWS(HnswIndex(2, 10, Metric::Cosine, HnswParams{.ef_construction = 0}));
+    HnswIndex no_ef(2, 10, Metric::Cosine, HnswParams{.ef_search = 0});
+    no_ef.add(1, std::vector<float>{1, 0});
+    no_ef.add(2, std::vector<float>{0, 1});
+    CHECK(no_ef.search(std::vector<float>{1, 0}, 2).size() == 2);
+
+    auto path = std::filesystem::temp_directory_path() / "tllf_test.hnsw";
+    index.save(path.string());
+    {
+        HnswIndex mapped(path.string());
+        CHECK(mapped.size() == 100);
+        auto mres = mapped.search(query, 3);
+        REQUIRE(mres.size() == 3);
+        CHECK(mres[0].id == res[0].id);
+        CHECK_THROWS(mapped.add(100, query));
+    }
+
+    // A damaged file is refused when opened, before a search can follow a bad link
+    auto corrupt = [&](size_t offset, uint32_t value) {
+        auto damaged = std::filesystem::temp_directory_path() / "tllf_test_damaged.hnsw";
+        std::filesystem::copy_file(path, damaged, std::filesystem::copy_options::overwrite_existing);
+        {
+            std::fstream file(damaged, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekp(offset);
+            file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+        bool refused = false;
+        try {
+            HnswIndex mapped(damaged.string());
+        }
+        catch(const std::runtime_error&) {
+            refused = true;
+        }
+        std::filesystem::remove(damaged);
+        return refused;
+    };
+    CHECK(!corrupt(0, 0x464c4c54)); // Rewrites the magic as it was
+    CHECK(corrupt(12, 7));          // Metric
+    CHECK(corrupt(32, 1));          // M
+    // Link count of node 0 at level 0, past the vectors, ids and levels of 100 two-dimensional vectors
+    CHECK(corrupt(128 + 832 + 832 + 128, 2 * 16 + 1));
+    CHECK(corrupt(128 + 832 + 832 + 128 + 4, 100)); // Its first link
+    std::filesystem::remove(path);
+}
+
+DROGON_TEST(QuantizedIndex)
+{
+    std::vector<int8_t> codes(3);
+    float scale = internal::quantizeInt8(std::vector<float>{0.5f, -1.f, 0.25f}, codes.data());
+    CHECK(codes == std::vector<int8_t>{64, -127, 32});
+    CHECK(std::abs(scale * 127 - 1.f) < 1e-6f);
+
+    uint64_t bits = 0;
+    internal::quantizeBinary(std::vector<float>{1, -1, 0, 2}, &bits);
+    CHECK(bits == 0b1001);
+
+    auto vec = [](uint64_t i) {
+        std::vector<float> v(16);
+        for(size_t j = 0; j < v.size(); j++)
+            v[j] = std::sin(i * 0.7f + j * 1.3f + i * j * 0.11f);
+        return v;
+    };
+    auto path = std::filesystem::temp_directory_path() / "tllf_test.f32";
+    for(auto quantization : {Quantization::Int8, Quantization::Binary}) {
+        QuantizedIndex index(16, quantization, path.string());
+        for(uint64_t i = 0; i < 100; i++)
+            index.add(i, vec(i));
+        auto res = index.search(vec(50), 2);
+        REQUIRE(res.size() == 2);
+        CHECK(res[0].id == 50);
+        CHECK(std::abs(res[0].score - 1.f) < 1e-5f);
+    }
+    std::filesystem::remove(path);
+}
+
+DROGON_TEST(Bm25Index)
+{
+    CHECK(Bm25Index::tokenize("Error E_1234: foo-bar.Baz") == std::vector<std::string>{"error", "e_1234", "foo", "bar", "baz"});
+
+    Bm25Index index;
+    // Enough filler to seal a few compressed blocks
+    for(uint64_t i = 0; i < 500; i++)
+        index.add(i, "the quick brown fox " + std::to_string(i));
+    index.add(1000, "error ERR_4021 while loading the model");
+    index.add(1001, "model loaded");
+
+    auto res = index.search("ERR_4021", 5);
+    REQUIRE(res.size() == 1);
+    CHECK(res[0].id == 1000);
+
+    res = index.search("the model", 2);
+    REQUIRE(res.size() == 2);
+    CHECK(res[0].id == 1001);
+    CHECK(res[1].id == 1000);
+
+    res = index.search("fox 123", 1);
+    REQUIRE(res.size() == 1);
+    CHECK(res[0].id == 123);
+    CHECK(index.search("missing", 3).empty());
+
+    // Pruning must not change the result. Compare with scoring every document, on corpora ending in a partial block,
+    // exactly on a block boundary and spanning several blocks. A small vocabulary and repeated documents make ties
+    uint32_t seed = 1;
+    auto next = [&seed]() { return (seed = seed * 1664525 + 1013904223) >> 8; };
+    const std::vector<std::string> words = {"alpha", "beta", "gamma", "delta", "eps", "zeta", "eta", "theta", "iota", "kappa"};
+    for(size_t n : {1, 50, 128, 129, 300, 1000}) {
+        Bm25Index corpus;
+        std::vector<std::vector<std::string>> docs;
+        for(size_t d = 0; d < n; d++) {
+            std::string text;
+            if(d % 7 == 3)
+                text = "beta beta gamma";
+            else {
+                // Rare words in few documents, common ones in many
+                for(size_t len = 1 + next() % 8; len != 0; len--)
+                    text += words[std::min(next() % words.size(), next() % words.size())] + " ";
+            }
+            corpus.add(d * 3 + 7, text);
+            docs.push_back(Bm25Index::tokenize(text));
+        }
+        double avg_len = 0;
+        for(const auto& doc : docs)
+            avg_len += doc.size();
+        avg_len /= n;
+
+        for(std::string query : {"alpha", "beta gamma", "kappa iota", "beta beta delta", "gamma eta theta kappa"}) {
+            std::vector<SearchResult> brute;
+            for(size_t d = 0; d < n; d++) {
+                double score = 0;
+                bool matched = false;
+                for(const auto& term : Bm25Index::tokenize(query)) {
+                    double df = std::count_if(docs.begin(), docs.end(), [&](const auto& doc) { return std::count(doc.begin(), doc.end(), term) != 0; });
+                    double tf = std::count(docs[d].begin(), docs[d].end(), term);
+                    if(tf == 0)
+                        continue;
+                    matched = true;
+                    double idf = std::log(1 + (n - df + 0.5) / (df + 0.5));
+                    score += idf * tf * 2.2 / (tf + 1.2 * (0.25 + 0.75 * docs[d].size() / avg_len));
+                }
+                if(matched)
+                    brute.push_back({d * 3 + 7, float(score)});
+            }
+            std::sort(brute.begin(), brute.end(), [](const auto& a, const auto& b) { return a.score > b.score; });
+
+            for(size_t k : {1, 5, 20}) {
+                auto res = corpus.search(query, k);
+                REQUIRE(res.size() == std::min(k, brute.size()));
+                std::set<uint64_t> seen;
+                for(size_t i = 0; i < res.size(); i++) {
+                    // Among tied documents any may be returned, so compare scores by rank and check each id's own score
+                    CHECK(std::abs(res[i].score - brute[i].score) <= 1e-4f * std::max(1.f, brute[i].score));
+                    auto own = std::find_if(brute.begin(), brute.end(), [&](const auto& r) { return r.id == res[i].id; });
+                    REQUIRE(own != brute.end());
+                    CHECK(std::abs(res[i].score - own->score) <= 1e-4f * std::max(1.f, own->score));
+                    CHECK(seen.insert(res[i].id).second);
+                }
+            }
+        }
+    }
+
+    auto fused = reciprocalRankFusion({{{1, 0.9f}, {2, 0.8f}, {3, 0.7f}}, {{3, 10}, {1, 5}}}, 2);
+    REQUIRE(fused.size() == 2);
+    CHECK(fused[0].id == 1);
+    CHECK(fused[1].id == 3);
+}
+
+DROGON_TEST(TextChunker)
+{
+    std::string text;
+    for(int i = 0; i < 50; i++)
+        text += "Sentence number " + std::to_string(i) + " is here. ";
+
+    TextChunker chunker(100, 30);
+    auto chunks = chunker.split(text);
+    REQUIRE(chunks.size() > 1);
+    CHECK(chunks[0] == "Sentence number 0 is here. Sentence number 1 is here. Sentence number 2 is here.");
+    CHECK(chunks[1].starts_with("Sentence number 2 is here."));
+    for(const auto& chunk : chunks)
+        CHECK(chunk.size() <= 100);
+
+    // Feeding the text in small pieces gives the same chunks
+    std::vector<std::string> streamed;
+    std::string buffer;
+    for(size_t pos = 0; pos < text.size(); pos += 7) {
+        buffer += text.substr(pos, 7);
+        std::vector<std::pair<size_t, size_t>> spans;
+        size_t consumed = chunker.splitPrefix(buffer, pos + 7 >= text.size(), spans);
+        for(auto [offset, size] : spans)
+            streamed.push_back(buffer.substr(offset, size));
+        buffer.erase(0, consumed);
+    }
+    CHECK(streamed == chunks);
+
+    // A word longer than a chunk is cut at the maximum size
+    std::vector<std::string> cut = {"a", std::string(100, 'x'), std::string(100, 'x'), std::string(50, 'x') + " b"};
+    CHECK(chunker.split("a " + std::string(250, 'x') + " b") == cut);
+}
+
+DROGON_TEST(SemanticCache)
+{
+    SemanticCache cache(0.9f, 3600, 8);
+    cache.insert("a", std::vector<float>{1, 0, 0}, "x");
+    cache.insert("a", std::vector<float>{0, 1, 0}, "y");
+    CHECK(cache.find("a", std::vector<float>{0.99f, 0.05f, 0}) == "x");
+    CHECK(cache.find("a", std::vector<float>{0.5f, 0.5f, 0}) == std::nullopt);
+    CHECK(cache.find("b", std::vector<float>{1, 0, 0}) == std::nullopt);
+    CHECK(cache.hits() == 1);
+    CHECK(cache.misses() == 2);
+
+    for(int i = 0; i < 20; i++)
+        cache.insert("a", std::vector<float>{1, float(i), 0}, std::to_string(i));
+    CHECK(cache.size("a") <= 8);
+    CHECK(cache.find("a", std::vector<float>{1, 19, 0}) == "19");
+}
+
+DROGON_TEST(yaml2json)
+{
+    auto node = YAML::Load(R"(
+name: search
+retries: 3
+ratio: 0.25
+enabled: true
+quoted: "42"
+version: 1.2.3
+missing: ~
+tags: [a, 1, false]
+)");
+    CHECK(internal::yaml2jsonString(node) == R"({"name":"search","retries":3,"ratio":0.25,"enabled":true,"quoted":"42","version":"1.2.3","missing":null,"tags":["a",1,false]})");
+
+    auto json = internal::yaml2json(node);
+    CHECK(json["retries"].get_number() == 3);
+    CHECK(json["quoted"].get_string() == "42");
+    CHECK(json["missing"].is_null());
+    CHECK(internal::json2yaml(json)["tags"][2].as<bool>() == false);
+    CHECK(internal::json2yaml(std::string_view(R"({"a":[1,"b"]})"))["a"][1].as<std::string>() == "b");
+
+    CHECK(std::holds_alternative<int64_t>(internal::classifyYamlScalar("-17")));
+    CHECK(std::holds_alternative<double>(internal::classifyYamlScalar("1e-3")));
+    CHECK(std::holds_alternative<std::monostate>(internal::classifyYamlScalar("12abc")));
+    CHECK(std::holds_alternative<std::monostate>(internal::classifyYamlScalar("nan")));
+}
+
+struct ScriptedLLM : public LLM
+{
+    ScriptedLLM(std::vector<std::string> replies) : replies(std::move(replies)) {}
+
+    std::vector<std::string> replies;
+    std::vector<TextGenerationConfig> configs;
+    bool streams = false;   // Hands each reply to on_text
+
+protected:
+    drogon::Task<std::string> generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools = {}) override
+    {
+        auto reply = replies.at(configs.size());
+        if(streams && config.on_text)
+            config.on_text(reply);
+        configs.push_back(std::move(config));
+        history.push_back(reply, "assistant");
+        co_return reply;
+    }
+};
+
+// Embeds a text as {length, first byte, 1}. Records the size of every batch it is asked for
+struct FakeEmbedder : public TextEmbedder
+{
+    std::vector<size_t> batches;
+    bool fail = false;
+
+    static std::vector<float> vectorOf(const std::string& text)
+    {
+        return {float(text.size()), text.empty() ? 0.f : float((unsigned char)text[0]), 1.f};
+    }
+
+    using TextEmbedder::embed;
+    drogon::Task<std::vector<float>> embed(std::string text) override
+    {
+        co_return (co_await embed(std::vector<std::string>{std::move(text)}))[0];
+    }
+
+    drogon::Task<std::vector<std::vector<float>>> embed(std::vector<std::string> texts) override
+    {
+        batches.push_back(texts.size());
+        if(fail)
+            throw std::runtime_error("Embedding failed");
+        std::vector<std::vector<float>> res;
+        for(const auto& text : texts)
+            res.push_back(vectorOf(text));
+        co_return res;
+    }
+};
+
+DROGON_TEST(SemanticCachingLLM)
+{
+    auto t = [TEST_CTX]() -> drogon::AsyncTask {
+        auto llm = std::make_shared<ScriptedLLM>(std::vector<std::string>{"Paris"});
+        SemanticCachingLLM cached(llm, std::make_shared<FakeEmbedder>(), std::make_shared<SemanticCache>(0.9f, 3600, 8));
+        Chatlog first;
+        first.push_back("Capital of France?", "user");
+        CO_REQUIRE(co_await cached.generate(first) == "Paris");
+
+        // A hit is handed to on_text like a generated reply would be
+        Chatlog second;
+        second.push_back("Capital of France?", "user");
+        std::string streamed;
+        TextGenerationConfig config;
+        config.on_text = [&](std::string_view text) { streamed += text; };
+        CO_REQUIRE(co_await cached.generate(second, config) == "Paris");
+        CO_REQUIRE(streamed == "Paris");
+        CO_REQUIRE(llm->configs.size() == 1);
+        CO_REQUIRE(second.size() == 2);
+    };
+    t();
+}
+
+DROGON_TEST(BatchingTextEmbedder)
+{
+    auto t = [TEST_CTX]() -> drogon::AsyncTask {
+        auto fake = std::make_shared<FakeEmbedder>();
+        BatchingTextEmbedder batching(fake, 3, 8, 2);
+        std::vector<std::string> texts = {"a", "bb", "c", "dddddd", "ee", "f", "g"};
+        auto res = co_await batching.embed(texts);
+        // Split by item count (a bb c) and by characters (dddddd ee), put back together in input order
+        CO_REQUIRE(res.size() == texts.size());
+        for(size_t i = 0; i < texts.size(); i++)
+            CO_REQUIRE(res[i] == FakeEmbedder::vectorOf(texts[i]));
+        std::sort(fake->batches.begin(), fake->batches.end());
+        CO_REQUIRE(fake->batches == std::vector<size_t>{2, 2, 3});
+
+        auto matrix = co_await batching.embedMatrix(texts);
+        CO_REQUIRE(matrix.rows() == texts.size());
+        CO_REQUIRE(matrix.dim() == 3);
+        CO_REQUIRE(matrix[3][0] == 6.f);
+        CO_REQUIRE(matrix[6][1] == float('g'));
+    };
+    t();
+}
+
+DROGON_TEST(MicroBatchingTextEmbedder)
+{
+    // Only hosts the flush timer. Every batch here is flushed before it fires
+    trantor::EventLoopThread timer_thread;
+    timer_thread.run();
+    auto t = [TEST_CTX, loop = timer_thread.getLoop()]() -> drogon::AsyncTask {
+        auto fake = std::make_shared<FakeEmbedder>();
+        MicroBatchingTextEmbedder micro(fake, 3, 10.0, loop);
+
+        // A full queue is sent as one batch and each caller gets its own result
+        std::vector<drogon::Task<std::vector<float>>> calls;
+        for(std::string text : {"a", "bb", "ccc"})
+            calls.push_back(micro.embed(text));
+        auto res = co_await drogon::when_all(std::move(calls));
+        CO_REQUIRE(fake->batches == std::vector<size_t>{3});
+        CO_REQUIRE(res[0] == FakeEmbedder::vectorOf("a"));
+        CO_REQUIRE(res[2] == FakeEmbedder::vectorOf("ccc"));
+
+        // flush() sends a partial batch
+        auto flush = [&]() -> drogon::Task<std::vector<float>> {
+            micro.flush();
+            co_return std::vector<float>();
+        };
+        calls.clear();
+        calls.push_back(micro.embed(std::string("dd")));
+        calls.push_back(flush());
+        res = co_await drogon::when_all(std::move(calls));
+        CO_REQUIRE(fake->batches == std::vector<size_t>{3, 1});
+        CO_REQUIRE(res[0] == FakeEmbedder::vectorOf("dd"));
+
+        // A failed batch fails every caller in it
+        fake->fail = true;
+        auto failed = [&](std::string text) -> drogon::Task<std::vector<float>> {
+            try {
+                co_await micro.embed(std::move(text));
+            }
+            catch(const std::runtime_error&) {
+                co_return std::vector<float>();
+            }
+            co_return std::vector<float>{1.f};
+        };
+        calls.clear();
+        calls.push_back(failed("a"));
+        calls.push_back(failed("b"));
+        calls.push_back(failed("c"));
+        res = co_await drogon::when_all(std::move(calls));
+        CO_REQUIRE(fake->batches.size() == 3);
+        for(const auto& r : res)
+            CO_REQUIRE(r.empty());
+    };
+    t();
+}
+
+DROGON_TEST(EmbeddingStore)
+{
+    auto path = std::filesystem::temp_directory_path() / "tllf_test_embeddings.bin";
+    std::filesystem::remove(path);
+    auto key = [](const std::string& text) { return EmbeddingStore::makeKey("fake", text); };
+    std::vector<float> a = {1, 2, 3};
+    std::vector<float> b = {4, 5, 6};
+    std::vector<float> c = {7, 8, 9};
+    std::vector<float> out;
+    {
+        EmbeddingStore store(path.string());
+        store.append({{key("a"), &a}, {key("b"), &b}});
+        REQUIRE(store.find(key("a"), out));
+        CHECK(out == a);
+        CHECK(!store.find(key("c"), out));
+        std::vector<float> wrong = {1};
+        CHECK_THROWS(store.append({{key("c"), &wrong}}));
+    }
+
+    // A writer that crashed mid-record leaves a torn record at the end
+    std::ofstream(path, std::ios::binary | std::ios::app) << std::string(20, 'x');
+    {
+        EmbeddingStore store(path.string());
+        CHECK(store.size() == 2);
+        REQUIRE(store.find(key("b"), out));
+        CHECK(out == b);
+        store.append({{key("c"), &c}});
+    }
+    {
+        // The next append overwrote the torn record
+        EmbeddingStore store(path.string());
+        CHECK(store.size() == 3);
+        REQUIRE(store.find(key("c"), out));
+        CHECK(out == c);
+        REQUIRE(store.find(key("a"), out));
+        CHECK(out == a);
+    }
+
+    // A store written by a newer format version is refused rather than misread
+    {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        uint32_t version = 2;
+        file.seekp(8);
+        file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    }
+    CHECK_THROWS(EmbeddingStore(path.string()));
+    std::filesystem::remove(path);
+}
+
+DROGON_TEST(IngestionPipeline)
+{
+    std::vector<std::string> paths;
+    for(int f = 0; f < 2; f++) {
+        auto path = std::filesystem::temp_directory_path() / ("tllf_test_ingest_" + std::to_string(f) + ".txt");
+        std::ofstream out(path);
+        for(int i = 0; i < 40; i++)
+            out << "File " << f << " sentence " << i << " is here. ";
+        paths.push_back(path.string());
+    }
+    // Without any whitespace the file must still be chunked as it is read, not buffered whole
+    auto unbroken = std::filesystem::temp_directory_path() / "tllf_test_ingest_unbroken.txt";
+    std::ofstream(unbroken) << std::string(64 * 1024, 'y');
+
+    // Embedding runs on this loop. The test body returns while the pipeline runs, so the coroutine gets everything
+    // it uses as parameters rather than captures, which would go away with the lambda
+    auto loop_thread = std::make_shared<trantor::EventLoopThread>();
+    loop_thread->run();
+    auto t = [](auto TEST_CTX, std::vector<std::string> paths, std::string unbroken, std::shared_ptr<trantor::EventLoopThread> loop_thread) -> drogon::AsyncTask {
+        auto fake = std::make_shared<FakeEmbedder>();
+        std::vector<uint64_t> ids;
+        size_t bad_rows = 0;
+        IngestionPipeline pipeline(fake, [&](std::vector<Chunk>& chunks, const EmbeddingMatrix& embeddings) {
+            for(size_t i = 0; i < chunks.size(); i++) {
+                ids.push_back(chunks[i].id);
+                if(std::vector<float>(embeddings[i].begin(), embeddings[i].end()) != FakeEmbedder::vectorOf(chunks[i].text))
+                    bad_rows++;
+            }
+        }, TextChunker(100, 20), IngestionOptions{.batch_size = 4, .max_concurrency = 2, .loops = {loop_thread->getLoop()}});
+
+        auto stats = co_await pipeline.run(paths);
+        CO_REQUIRE(stats.docs == 2);
+        CO_REQUIRE(stats.chunks > 4);
+        CO_REQUIRE(stats.indexed == stats.chunks);
+        // Every chunk is indexed exactly once, next to its own embedding
+        std::sort(ids.begin(), ids.end());
+        CO_REQUIRE(ids.size() == stats.chunks);
+        CO_REQUIRE(std::adjacent_find(ids.begin(), ids.end()) == ids.end());
+        CO_REQUIRE(bad_rows == 0);
+
+        // A second run counts only its own files and keeps the ids unique
+        auto again = co_await pipeline.run(paths);
+        CO_REQUIRE(again.docs == 2);
+        CO_REQUIRE(again.chunks == stats.chunks);
+        std::sort(ids.begin(), ids.end());
+        CO_REQUIRE(ids.size() == 2 * stats.chunks);
+        CO_REQUIRE(std::adjacent_find(ids.begin(), ids.end()) == ids.end());
+
+        size_t longest = 0, total = 0;
+        IngestionPipeline small_reads(fake, [&](std::vector<Chunk>& chunks, const EmbeddingMatrix&) {
+            for(const auto& chunk : chunks) {
+                longest = std::max(longest, chunk.text.size());
+                total += chunk.text.size();
+            }
+        }, TextChunker(100, 20), IngestionOptions{.batch_size = 16, .read_block_size = 4096, .loops = {loop_thread->getLoop()}});
+        auto unbroken_stats = co_await small_reads.run({unbroken});
+        CO_REQUIRE(unbroken_stats.chunks == 656);
+        CO_REQUIRE(longest == 100);
+        CO_REQUIRE(total == 64 * 1024);
+
+        fake->fail = true;
+        bool failed = false;
+        try {
+            co_await pipeline.run(paths);
+        }
+        catch(const std::runtime_error&) {
+            failed = true;
+        }
+        CO_REQUIRE(failed);
+
+        for(const auto& path : paths)
+            std::filesystem::remove(path);
+        std::filesystem::remove(unbroken);
+    };
+    t(TEST_CTX, paths, unbroken.string(), loop_thread);
+}
+
+struct Person
+{
+    std::string name;
+    int age;
+    std::optional<std::string> email;
+};
+
+DROGON_TEST(StructuredOutput)
+{
+    CHECK(repairJson(R"({"name": "Ann", "tags": ["a", "b)") == R"({"name": "Ann", "tags": ["a", "b"]})");
+    CHECK(repairJson(R"({"a": 1, "b": tr)") == R"({"a": 1, "b": true})");
+    CHECK(repairJson(R"({"a": [1, 2,], "b")") == R"({"a": [1, 2]})");
+    CHECK(repairJson(R"({"a": 1, "b": )") == R"({"a": 1})");
+    CHECK(repairJson(R"({"a": "x, {y"})") == R"({"a": "x, {y"})");
+    CHECK(extractJson("```json\n{\"a\": 1}\n```") == R"({"a": 1})");
+    CHECK(extractJson("{\"a\":1}\nHope this helps!") == R"({"a":1})");
+    CHECK(extractJson(R"(Here: {"a": "}", "b": [1]} and {"c": 2})") == R"({"a": "}", "b": [1]})");
+    CHECK(extractJson(R"(Here: {"a": [1, 2)") == R"({"a": [1, 2)");
+
+    auto t = [TEST_CTX]() -> drogon::AsyncTask {
+        ScriptedLLM llm({"```json\n{\"name\": \"Ann\", \"age\": 41", R"({"name": "Bob"})", R"({"name": "Bob", "age": 7})"});
+        Chatlog history;
+        history.push_back("Who?", "user");
+        auto ann = co_await llm.generate<Person>(history);
+        CO_REQUIRE(ann.name == "Ann");
+        CO_REQUIRE(ann.age == 41);
+        CO_REQUIRE(!ann.email.has_value());
+        CO_REQUIRE(llm.configs[0].response_format.has_value());
+        CO_REQUIRE(history.size() == 2);
+
+        // A missing field is sent back to the model once
+        auto bob = co_await llm.generate<Person>(history);
+        CO_REQUIRE(bob.age == 7);
+        CO_REQUIRE(llm.configs.size() == 3);
+        CO_REQUIRE(history.size() == 3);
+        CO_REQUIRE(std::get<std::string>(history.back().content) == R"({"name": "Bob", "age": 7})");
+    };
+    t();
+}
+
+DROGON_TEST(SampleSelection)
+{
+    auto t = [TEST_CTX]() -> drogon::AsyncTask {
+        ScriptedLLM llm({"4", "5", "4"});
+        Chatlog history;
+        history.push_back("2 + 2?", "user");
+        // Self-consistency: keep the most common answer
+        auto vote = [](const std::vector<std::string>& samples) {
+            size_t best = 0;
+            for(size_t i = 0; i < samples.size(); i++) {
+                if(std::count(samples.begin(), samples.end(), samples[i]) > std::count(samples.begin(), samples.end(), samples[best]))
+                    best = i;
+            }
+            return best;
+        };
+        auto answer = co_await llm.generateBest(history, 3, vote);
+        CO_REQUIRE(answer == "4");
+        CO_REQUIRE(llm.configs.size() == 3);
+        CO_REQUIRE(history.size() == 2);
+        CO_REQUIRE(std::get<std::string>(history.back().content) == "4");
+    };
+    t();
+}
+
+struct FailingLLM : public LLM
+{
+    size_t calls = 0;
+    bool streams = false;   // Hands part of a reply to on_text before failing
+
+protected:
+    drogon::Task<std::string> generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools = {}) override
+    {
+        calls++;
+        if(streams && config.on_text)
+            config.on_text("half");
+        history.push_back("half done", "assistant");
+        throw std::runtime_error("Backend down");
+        co_return "";
+    }
+};
+
+DROGON_TEST(CascadeLLM)
+{
+    auto t = [TEST_CTX]() -> drogon::AsyncTask {
+        auto small = std::make_shared<ScriptedLLM>(std::vector<std::string>{"Sure! Here it is", "{\"a\": 2}"});
+        auto large = std::make_shared<ScriptedLLM>(std::vector<std::string>{"{\"a\": 1}"});
+        CascadeLLM cascade({small, large}, [](const Chatlog&, std::string_view reply) {
+            return reply.starts_with("{");
+        });
+        small->streams = large->streams = true;
+        std::string seen;
+        TextGenerationConfig config;
+        config.on_text = [&seen](std::string_view delta) { seen += delta; };
+
+        Chatlog history;
+        history.push_back("Give me JSON", "user");
+        CO_REQUIRE(co_await cascade.generate(history, config) == "{\"a\": 1}");
+        // The rejected reply does not stay in the history, and was never streamed
+        CO_REQUIRE(history.size() == 2);
+        CO_REQUIRE(seen == "{\"a\": 1}");
+        seen.clear();
+        CO_REQUIRE(co_await cascade.generate(history, config) == "{\"a\": 2}");
+        CO_REQUIRE(seen == "{\"a\": 2}");
+        CO_REQUIRE(large->configs.size() == 1);
+
+        auto stats = cascade.stats();
+        CO_REQUIRE(stats[0].attempts == 2);
+        CO_REQUIRE(stats[0].accepted == 1);
+        CO_REQUIRE(stats[1].successRate() == 1.0);
+    };
+    t();
+
+    // A tier that always throws is skipped like one whose replies are always rejected
+    auto failing = [TEST_CTX]() -> drogon::AsyncTask {
+        auto down = std::make_shared<FailingLLM>();
+        auto large = std::make_shared<ScriptedLLM>(std::vector<std::string>{"a", "b", "c"});
+        CascadeLLM cascade({down, large}, nullptr);
+        cascade.min_success_rate = 0.5;
+        cascade.min_attempts = 2;
+        cascade.skip_probe = 100;
+
+        Chatlog history;
+        history.push_back("Hi", "user");
+        for(int i = 0; i < 3; i++)
+            co_await cascade.generate(history);
+        CO_REQUIRE(down->calls == 2);
+        CO_REQUIRE(large->configs.size() == 3);
+
+        auto stats = cascade.stats();
+        CO_REQUIRE(stats[0].attempts == 2);
+        CO_REQUIRE(stats[0].errors == 2);
+        CO_REQUIRE(stats[0].successRate() == 0.0);
+    };
+    failing();
+}
+
+DROGON_TEST(BalancedLLM)
+{
+    auto t = [TEST_CTX]() -> drogon::AsyncTask {
+        auto down = std::make_shared<FailingLLM>();
+        auto up = std::make_shared<ScriptedLLM>(std::vector<std::string>{"a", "b", "c"});
+        BalancedLLM balancer({down, up});
+        balancer.max_failures = 1;
+
+        Chatlog history;
+        history.push_back("Hi", "user");
+        CO_REQUIRE(co_await balancer.generate(history) == "a");
+        CO_REQUIRE(history.size() == 2);
+        // The failed backend is drained and gets no more requests
+        CO_REQUIRE(co_await balancer.generate(history) == "b");
+        CO_REQUIRE(co_await balancer.generate(history) == "c");
+        CO_REQUIRE(down->calls == 1);
+
+        auto stats = balancer.stats();
+        CO_REQUIRE(!stats[0].available);
+        CO_REQUIRE(stats[0].failures == 1);
+        CO_REQUIRE(stats[1].requests == 3);
+        CO_REQUIRE(stats[1].outstanding == 0);
+    };
+    t();
+
+    // Once part of a reply was streamed, another backend must not start over
+    auto streamed = [TEST_CTX]() -> drogon::AsyncTask {
+        auto down = std::make_shared<FailingLLM>();
+        down->streams = true;
+        auto up = std::make_shared<ScriptedLLM>(std::vector<std::string>{"a"});
+        BalancedLLM balancer({down, up});
+
+        Chatlog history;
+        history.push_back("Hi", "user");
+        std::string text;
+        TextGenerationConfig config;
+        config.on_text = [&](std::string_view delta) { text += delta; };
+        bool failed = false;
+        try {
+            co_await balancer.generate(history, config);
+        }
+        catch(const std::runtime_error&) {
+            failed = true;
+        }
+        CO_REQUIRE(failed);
+        CO_REQUIRE(text == "half");
+        CO_REQUIRE(up->configs.empty());
+        CO_REQUIRE(down->calls == 1);
+
+        // generate() does not retry a reply that already went out either
+        FailingLLM single;
+        single.streams = true;
+        text.clear();
+        failed = false;
+        try {
+            co_await single.generate(history, config);
+        }
+        catch(const std::runtime_error&) {
+            failed = true;
+        }
+        CO_REQUIRE(failed);
+        CO_REQUIRE(text == "half");
+        CO_REQUIRE(single.calls == 1);
+    };
+    streamed();
+}
+
+DROGON_TEST(Cancellation)
+{
+    CancellationToken none;
+    CHECK(!none.cancelled());
+    CHECK(none.onCancel([]() {}) == 0);
+
+    auto token = CancellationToken::create();
+    auto copy = token;
+    int fired = 0;
+    copy.onCancel([&]() { fired++; });
+    token.removeCallback(token.onCancel([&]() { fired += 10; }));
+    token.cancel();
+    token.cancel();
+    CHECK(copy.cancelled());
+    CHECK(fired == 1);
+    // Too late to wait for it, runs right away
+    token.onCancel([&]() { fired++; });
+    CHECK(fired == 2);
+    CHECK_THROWS_AS(token.throwIfCancelled(), CancelledError);
+
+    auto t = [TEST_CTX, token]() -> drogon::AsyncTask {
+        ScriptedLLM llm({"never"});
+        Chatlog history;
+        history.push_back("Hi", "user");
+        TextGenerationConfig config;
+        config.cancel = token;
+        bool cancelled = false;
+        try {
+            co_await llm.generate(history, config);
+        }
+        catch(const CancelledError&) {
+            cancelled = true;
+        }
+        // Not retried and the model is never asked
+        CO_REQUIRE(cancelled);
+        CO_REQUIRE(llm.configs.empty());
+        CO_REQUIRE(history.size() == 1);
+    };
+    t();
+}
+
+DROGON_TEST(PartialJsonParser)
+{
+    std::string doc = "```json\n{\"name\": \"Ann \\\"A\\\"\", \"age\": 41, \"tags\": [\"x\", \"y\"]}\n```";
+    PartialJsonParser parser;
+    std::vector<std::string> names;
+    size_t tags = 0;
+    parser.on<std::string>("/name", [&](std::string name) { names.push_back(name); });
+    parser.on("/tags/*", [&](const JsonEvent& event) { tags++; CHECK(event.kind == JsonEvent::Kind::String); });
+
+    // Byte by byte, so every state is split at least once
+    for(size_t i = 0; i < doc.size(); i++) {
+        parser.feed(doc.substr(i, 1));
+        if(i == doc.find("age")) {
+            REQUIRE(names.size() == 1);
+            CHECK(names[0] == "Ann \"A\"");
+            Person person;
+            CHECK(parser.partial(person));
+            CHECK(person.name == "Ann \"A\"");
+        }
+    }
+    CHECK(parser.done());
+    CHECK(tags == 2);
+    auto whole = parser.partial();
+    REQUIRE(whole.has_value());
+    CHECK(whole->at("age").get_number() == 41);
+}
+
+DROGON_TEST(StopMatcher)
+{
+    StopMatcher matcher({"\nUser:", "STOP", "TOP SECRET", "SECRET", "1", "2"});
+    CHECK(matcher.feed("Hello, I am\nUs") == std::nullopt);
+    // "\nUs" may be the start of a stop string
+    CHECK(matcher.pending() == 3);
+    CHECK(matcher.feed("er: hi") == 11);
+
+    // Among matches ending at the same place, the one starting first wins
+    matcher.reset();
+    CHECK(matcher.feed("A TOP S") == std::nullopt);
+    CHECK(matcher.feed("ECRET") == 2);
+    CHECK(StopMatcher().feed("STOP") == std::nullopt);
+
+    // Server-sent events split at arbitrary places
+    internal::SseParser sse;
+    std::vector<std::string> events;
+    auto collect = [&](std::string_view data) { events.emplace_back(data); return true; };
+    CHECK(sse.feed(": ping\r\ndata: {\"a\"", collect));
+    CHECK(sse.feed(":1}\r\n\r\ndata: x\ndata: y\n", collect));
+    CHECK(events.size() == 1);
+    CHECK(sse.feed("\ndata: [DONE]\n\n", [&](std::string_view data) { events.emplace_back(data); return data != "[DONE]"; }) == false);
+    REQUIRE(events.size() == 3);
+    CHECK(events[0] == "{\"a\":1}");
+    CHECK(events[1] == "x\ny");
+    CHECK(events[2] == "[DONE]");
+}
+
 tllf::ToolResult noop_tool(std::string s)
 {
     TLLF_DOC("noop")
@@ -62,9 +1136,9 @@ DROGON_TEST(tool)
         CO_REQUIRE(doc.params[0].first == "s");
         CO_REQUIRE(doc.params[0].second.desc == "The string to be returned");
 
-        nlohmann::json invoke_data;
+        glz::generic invoke_data;
         invoke_data["s"] = "Hello!";
-        auto res = co_await f(invoke_data.dump());
+        auto res = co_await f(glz::write_json(invoke_data).value());
         CO_REQUIRE(res == "Hello!");
 
         // Make sure these also compiles
@@ -80,11 +1154,11 @@ DROGON_TEST(tool)
         auto f = co_await toolize(optional_tool);
         auto doc = co_await getToolDoc(optional_tool);
 
-        auto res = co_await f(nlohmann::json().dump());
+        auto res = co_await f("null");
         CO_REQUIRE(res == "The string is not given");
         res = co_await f("Hello");
         CO_REQUIRE(res == "Hello");
-        res = co_await f(nlohmann::json({{"s", "Hello"}}).dump());
+        res = co_await f(R"({"s":"Hello"})");
         CO_REQUIRE(res == "Hello");
     };
 }
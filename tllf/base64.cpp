@@ -0,0 +1,187 @@
+#include "base64.hpp"
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TLLF_BASE64_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define TLLF_BASE64_NEON
+#endif
+
+namespace tllf::utils
+{
+static constexpr char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t base64EncodeScalar(const uint8_t* in, size_t n, char* out)
+{
+    char* begin = out;
+    size_t i = 0;
+    for(; i + 3 <= n; i += 3) {
+        uint32_t v = (uint32_t(in[i]) << 16) | (uint32_t(in[i+1]) << 8) | in[i+2];
+        *out++ = base64_alphabet[(v >> 18) & 0x3f];
+        *out++ = base64_alphabet[(v >> 12) & 0x3f];
+        *out++ = base64_alphabet[(v >> 6) & 0x3f];
+        *out++ = base64_alphabet[v & 0x3f];
+    }
+    if(n - i == 1) {
+        uint32_t v = uint32_t(in[i]) << 16;
+        *out++ = base64_alphabet[(v >> 18) & 0x3f];
+        *out++ = base64_alphabet[(v >> 12) & 0x3f];
+        *out++ = '=';
+        *out++ = '=';
+    }
+    else if(n - i == 2) {
+        uint32_t v = (uint32_t(in[i]) << 16) | (uint32_t(in[i+1]) << 8);
+        *out++ = base64_alphabet[(v >> 18) & 0x3f];
+        *out++ = base64_alphabet[(v >> 12) & 0x3f];
+        *out++ = base64_alphabet[(v >> 6) & 0x3f];
+        *out++ = '=';
+    }
+    return out - begin;
+}
+
+#ifdef TLLF_BASE64_AVX2
+// Wojciech Muła's vectorized base64. Each iteration turns 24 input bytes into 32 output characters
+__attribute__((target("avx2")))
+static size_t base64EncodeAVX2(const uint8_t* in, size_t n, char* out)
+{
+    const __m256i shuffle = _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i offsets = _mm256_setr_epi8(
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+
+    size_t i = 0;
+    // Each lane loads 16 bytes but only uses 12. Stop early enough to never read past the end
+    for(; i + 28 <= n; i += 24, out += 32) {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12)), 1);
+        v = _mm256_shuffle_epi8(v, shuffle);
+
+        // Split every 3 bytes into 4 6-bit indices
+        __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(t1, t3);
+
+        // Map the indices to ASCII by adding a per-range offset
+        __m256i lut_idx = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i is_lower = _mm256_cmpgt_epi8(indices, _mm256_set1_epi8(25));
+        lut_idx = _mm256_sub_epi8(lut_idx, is_lower);
+        __m256i chars = _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, lut_idx));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), chars);
+    }
+    return i;
+}
+#endif
+
+#ifdef TLLF_BASE64_NEON
+// Each iteration turns 48 input bytes into 64 output characters
+static size_t base64EncodeNEON(const uint8_t* in, size_t n, char* out)
+{
+    const uint8x16x4_t table = vld1q_u8_x4(reinterpret_cast<const uint8_t*>(base64_alphabet));
+    size_t i = 0;
+    for(; i + 48 <= n; i += 48, out += 64) {
+        uint8x16x3_t v = vld3q_u8(in + i);
+        uint8x16x4_t indices;
+        indices.val[0] = vshrq_n_u8(v.val[0], 2);
+        indices.val[1] = vorrq_u8(vshlq_n_u8(vandq_u8(v.val[0], vdupq_n_u8(0x03)), 4), vshrq_n_u8(v.val[1], 4));
+        indices.val[2] = vorrq_u8(vshlq_n_u8(vandq_u8(v.val[1], vdupq_n_u8(0x0f)), 2), vshrq_n_u8(v.val[2], 6));
+        indices.val[3] = vandq_u8(v.val[2], vdupq_n_u8(0x3f));
+
+        uint8x16x4_t chars;
+        for(int j = 0; j < 4; j++)
+            chars.val[j] = vqtbl4q_u8(table, indices.val[j]);
+        vst4q_u8(reinterpret_cast<uint8_t*>(out), chars);
+    }
+    return i;
+}
+#endif
+
+size_t base64Encode(const void* data, size_t n, char* out)
+{
+    auto in = static_cast<const uint8_t*>(data);
+    size_t done = 0;
+#if defined(TLLF_BASE64_AVX2)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if(has_avx2)
+        done = base64EncodeAVX2(in, n, out);
+#elif defined(TLLF_BASE64_NEON)
+    done = base64EncodeNEON(in, n, out);
+#endif
+    // SIMD paths consume whole 3 byte groups. The scalar code finishes the tail and the padding
+    size_t written = done / 3 * 4;
+    return written + base64EncodeScalar(in + done, n - done, out + written);
+}
+
+std::string base64Encode(std::string_view data)
+{
+    std::string res;
+    base64EncodeAppend(res, data);
+    return res;
+}
+
+void base64EncodeAppend(std::string& out, std::string_view data)
+{
+    size_t pos = out.size();
+    out.resize(pos + base64EncodedSize(data.size()));
+    base64Encode(data.data(), data.size(), out.data() + pos);
+}
+
+static constexpr std::array<uint8_t, 256> base64_reverse = []() {
+    std::array<uint8_t, 256> table;
+    table.fill(0xff);
+    for(size_t i = 0; i < 64; i++)
+        table[static_cast<uint8_t>(base64_alphabet[i])] = i;
+    return table;
+}();
+
+size_t base64Decode(std::string_view data, void* out)
+{
+    while(!data.empty() && data.back() == '=')
+        data.remove_suffix(1);
+    auto in = reinterpret_cast<const uint8_t*>(data.data());
+    auto ptr = static_cast<uint8_t*>(out);
+    const size_t n = data.size();
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        uint32_t a = base64_reverse[in[i]], b = base64_reverse[in[i+1]], c = base64_reverse[in[i+2]], d = base64_reverse[in[i+3]];
+        if((a | b | c | d) & 0x80)
+            throw std::runtime_error("Invalid base64 character");
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+        *ptr++ = v >> 16;
+        *ptr++ = v >> 8;
+        *ptr++ = v;
+    }
+
+    size_t rest = n - i;
+    if(rest == 1)
+        throw std::runtime_error("Truncated base64 data");
+    else if(rest != 0) {
+        uint32_t v = 0;
+        for(size_t j = 0; j < rest; j++) {
+            uint32_t x = base64_reverse[in[i+j]];
+            if(x & 0x80)
+                throw std::runtime_error("Invalid base64 character");
+            v |= x << (18 - 6 * j);
+        }
+        *ptr++ = v >> 16;
+        if(rest == 3)
+            *ptr++ = v >> 8;
+    }
+    return ptr - static_cast<uint8_t*>(out);
+}
+
+std::string base64Decode(std::string_view data)
+{
+    std::string res(base64DecodedSize(data.size()), '\0');
+    res.resize(base64Decode(data, res.data()));
+    return res;
+}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace tllf::utils
+{
+constexpr size_t base64EncodedSize(size_t n) { return (n + 2) / 3 * 4; }
+
+/**
+ * Base64 encode n bytes into out. Uses AVX2 or NEON when available.
+ * @param out Must hold at least base64EncodedSize(n) bytes
+ * @return Number of bytes written
+*/
+size_t base64Encode(const void* data, size_t n, char* out);
+std::string base64Encode(std::string_view data);
+
+/**
+ * Append the base64 encoding of data to out. Saves a copy when building larger strings.
+*/
+void base64EncodeAppend(std::string& out, std::string_view data);
+
+/**
+ * Upper bound of the decoded size of n base64 characters.
+*/
+constexpr size_t base64DecodedSize(size_t n) { return n / 4 * 3 + 3; }
+
+/**
+ * Decode base64 (with or without padding) into out.
+ * @param out Must hold at least base64DecodedSize(data.size()) bytes
+ * @return Number of bytes written
+ * @throws std::runtime_error on characters outside the base64 alphabet
+*/
+size_t base64Decode(std::string_view data, void* out);
+std::string base64Decode(std::string_view data);
+}
@@ -0,0 +1,298 @@
+#include "bm25.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+
+using namespace tllf;
+
+static constexpr uint32_t end_doc = std::numeric_limits<uint32_t>::max();
+
+static void writeVarint(std::vector<uint8_t>& out, uint32_t v)
+{
+    while(v >= 0x80) {
+        out.push_back(uint8_t(v) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(uint8_t(v));
+}
+
+static uint32_t readVarint(const uint8_t*& ptr)
+{
+    uint32_t v = 0;
+    for(int shift = 0;; shift += 7) {
+        uint8_t byte = *ptr++;
+        v |= uint32_t(byte & 0x7f) << shift;
+        if((byte & 0x80) == 0)
+            return v;
+    }
+}
+
+std::vector<std::string> Bm25Index::tokenize(std::string_view text)
+{
+    std::vector<std::string> tokens;
+    std::string token;
+    for(char ch : text) {
+        unsigned char c = ch;
+        if((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c >= 0x80)
+            token.push_back(ch);
+        else if(c >= 'A' && c <= 'Z')
+            token.push_back(ch - 'A' + 'a');
+        else if(!token.empty())
+            tokens.push_back(std::move(token)), token.clear();
+    }
+    if(!token.empty())
+        tokens.push_back(std::move(token));
+    return tokens;
+}
+
+void Bm25Index::PostingList::push(uint32_t doc, uint32_t tf, uint32_t len)
+{
+    tail_docs.push_back(doc);
+    tail_tfs.push_back(tf);
+    tail.last_doc = doc;
+    tail.max_tf = std::max(tail.max_tf, tf);
+    tail.min_len = std::min(tail.min_len, len);
+    max_tf = std::max(max_tf, tf);
+    min_len = std::min(min_len, len);
+    df++;
+    if(tail_docs.size() < block_size)
+        return;
+
+    // Seal the block: doc ids as gaps from the previous one, then the term frequency, both as varints
+    uint32_t prev = blocks.empty() ? 0 : blocks.back().last_doc;
+    tail.offset = bytes.size();
+    for(size_t i = 0; i < tail_docs.size(); i++) {
+        writeVarint(bytes, tail_docs[i] - prev);
+        writeVarint(bytes, tail_tfs[i]);
+        prev = tail_docs[i];
+    }
+    blocks.push_back(tail);
+    tail = {0, 0, UINT32_MAX, 0};
+    tail_docs.clear();
+    tail_tfs.clear();
+}
+
+void Bm25Index::add(uint64_t id, std::string_view text)
+{
+    if(ids_.size() >= end_doc)
+        throw std::runtime_error("Bm25Index is full");
+    auto tokens = tokenize(text);
+    std::unordered_map<std::string_view, uint32_t> counts;
+    for(const auto& token : tokens)
+        counts[token]++;
+
+    const uint32_t doc = ids_.size();
+    const uint32_t len = tokens.size();
+    for(const auto& [term, tf] : counts)
+        postings_[std::string(term)].push(doc, tf, len);
+    ids_.push_back(id);
+    doc_lens_.push_back(len);
+    total_len_ += len;
+}
+
+size_t Bm25Index::memoryUsage() const
+{
+    size_t bytes = 0;
+    for(const auto& [term, list] : postings_)
+        bytes += list.bytes.size() + list.blocks.size() * sizeof(Block) + list.tail_docs.size() * 2 * sizeof(uint32_t);
+    return bytes + ids_.size() * sizeof(uint64_t) + doc_lens_.size() * sizeof(uint32_t);
+}
+
+float Bm25Index::score(float idf, uint32_t tf, uint32_t len) const
+{
+    float avg_len = ids_.empty() ? 1.f : float(total_len_) / ids_.size();
+    return idf * tf * (k1_ + 1) / (tf + k1_ * (1 - b_ + b_ * len / avg_len));
+}
+
+/**
+ * Walks one posting list, decoding a block at a time.
+*/
+struct Bm25Index::Cursor
+{
+    Cursor(const Bm25Index& index, const PostingList& list, float weight)
+        : index(&index), list(&list), weight(weight), max_score(index.score(weight, list.max_tf, list.min_len))
+    {
+        load();
+    }
+
+    size_t numBlocks() const { return list->blocks.size() + (list->tail_docs.empty() ? 0 : 1); }
+    const Block& header(size_t i) const { return i < list->blocks.size() ? list->blocks[i] : list->tail; }
+
+    void load()
+    {
+        pos = 0;
+        if(block >= numBlocks()) {
+            doc = end_doc;
+            return;
+        }
+        if(block < list->blocks.size()) {
+            const uint8_t* ptr = list->bytes.data() + list->blocks[block].offset;
+            uint32_t prev = block == 0 ? 0 : list->blocks[block - 1].last_doc;
+            n = block_size;
+            for(size_t i = 0; i < n; i++) {
+                prev += readVarint(ptr);
+                docs[i] = prev;
+                tfs[i] = readVarint(ptr);
+            }
+        }
+        else {
+            n = list->tail_docs.size();
+            std::copy(list->tail_docs.begin(), list->tail_docs.end(), docs);
+            std::copy(list->tail_tfs.begin(), list->tail_tfs.end(), tfs);
+        }
+        doc = docs[0];
+    }
+
+    void next()
+    {
+        if(++pos < n) {
+            doc = docs[pos];
+            return;
+        }
+        block++;
+        load();
+    }
+
+    void seek(uint32_t target)
+    {
+        if(doc >= target)
+            return;
+        // Skip whole blocks by their headers before decoding anything
+        if(header(block).last_doc < target) {
+            do {
+                block++;
+            } while(block < numBlocks() && header(block).last_doc < target);
+            load();
+        }
+        while(doc < target)
+            next();
+    }
+
+    // The block that would hold target, found from the headers alone
+    size_t blockFor(uint32_t target) const
+    {
+        size_t i = block;
+        while(i < numBlocks() && header(i).last_doc < target)
+            i++;
+        return i;
+    }
+
+    float blockMax(size_t i) const
+    {
+        return i < numBlocks() ? index->score(weight, header(i).max_tf, header(i).min_len) : 0.f;
+    }
+
+    float current() const
+    {
+        return index->score(weight, tfs[pos], index->doc_lens_[doc]);
+    }
+
+    const Bm25Index* index;
+    const PostingList* list;
+    float weight;       // idf times the number of times the term is in the query
+    float max_score;    // Upper bound over the whole list
+    size_t block = 0;
+    size_t pos = 0;
+    size_t n = 0;
+    uint32_t doc = end_doc;
+    uint32_t docs[block_size];
+    uint32_t tfs[block_size];
+};
+
+std::vector<SearchResult> Bm25Index::search(std::string_view query, size_t k) const
+{
+    std::unordered_map<std::string, uint32_t> query_terms;
+    for(auto& token : tokenize(query))
+        query_terms[std::move(token)]++;
+
+    const float n = ids_.size();
+    std::vector<std::unique_ptr<Cursor>> cursors;
+    for(const auto& [term, count] : query_terms) {
+        auto it = postings_.find(term);
+        if(it == postings_.end())
+            continue;
+        float df = it->second.df;
+        float idf = std::log(1 + (n - df + 0.5f) / (df + 0.5f));
+        cursors.push_back(std::make_unique<Cursor>(*this, it->second, idf * count));
+    }
+
+    // Block-max WAND. Documents are visited in id order and only scored when the upper bounds of the lists
+    // containing them, first per list and then per block, could beat the current k-th best score
+    internal::TopK topk(k);
+    auto threshold = [&]() { return topk.heap.size() == k ? topk.heap.front().score : 0.f; };
+    const size_t m = cursors.size();
+    while(k != 0) {
+        std::sort(cursors.begin(), cursors.end(), [](const auto& a, const auto& b) { return a->doc < b->doc; });
+
+        float bound = 0;
+        size_t p = 0;
+        for(; p < m && cursors[p]->doc != end_doc; p++) {
+            bound += cursors[p]->max_score;
+            if(bound > threshold())
+                break;
+        }
+        if(p == m || cursors[p]->doc == end_doc)
+            break;
+        const uint32_t pivot = cursors[p]->doc;
+        while(p + 1 < m && cursors[p + 1]->doc == pivot)
+            p++;
+
+        float block_bound = 0;
+        uint32_t skip_to = end_doc;
+        for(size_t i = 0; i <= p; i++) {
+            size_t block = cursors[i]->blockFor(pivot);
+            block_bound += cursors[i]->blockMax(block);
+            if(block < cursors[i]->numBlocks())
+                skip_to = std::min(skip_to, cursors[i]->header(block).last_doc + 1);
+        }
+        if(block_bound <= threshold()) {
+            // Nothing before the end of the earliest block can win. Lists after p only start at or after their doc
+            if(p + 1 < m)
+                skip_to = std::min(skip_to, cursors[p + 1]->doc);
+            for(size_t i = 0; i <= p; i++)
+                cursors[i]->seek(skip_to);
+            continue;
+        }
+
+        if(cursors[0]->doc == pivot) {
+            float s = 0;
+            for(size_t i = 0; i <= p; i++)
+                s += cursors[i]->current();
+            topk.push(pivot, s);
+            for(size_t i = 0; i <= p; i++)
+                cursors[i]->next();
+        }
+        else {
+            for(size_t i = 0; i < p && cursors[i]->doc < pivot; i++)
+                cursors[i]->seek(pivot);
+        }
+    }
+
+    auto res = std::move(topk).sorted();
+    for(auto& r : res)
+        r.id = ids_[r.id];
+    return res;
+}
+
+std::vector<SearchResult> tllf::reciprocalRankFusion(const std::vector<std::vector<SearchResult>>& lists, size_t k, float c)
+{
+    std::unordered_map<uint64_t, float> scores;
+    for(const auto& list : lists) {
+        for(size_t rank = 0; rank < list.size(); rank++)
+            scores[list[rank].id] += 1.f / (c + rank + 1);
+    }
+
+    std::vector<SearchResult> res;
+    res.reserve(scores.size());
+    for(const auto& [id, score] : scores)
+        res.push_back({id, score});
+    k = std::min(k, res.size());
+    std::partial_sort(res.begin(), res.begin() + k, res.end(), [](const SearchResult& a, const SearchResult& b) {
+        return a.score > b.score || (a.score == b.score && a.id < b.id);
+    });
+    res.resize(k);
+    return res;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <tllf/vector_index.hpp>
+
+namespace tllf
+{
+
+/**
+ * In-memory BM25 full text index. Catches the exact identifiers, error codes and names that embeddings blur.
+ *
+ * Posting lists are delta and varint compressed in blocks of 128 documents. Each block records the highest term
+ * frequency and shortest document it holds, so top-k queries use block-max WAND and skip blocks that cannot beat
+ * the current k-th best score.
+*/
+struct Bm25Index
+{
+    Bm25Index(float k1 = 1.2f, float b = 0.75f) : k1_(k1), b_(b) {}
+
+    void add(uint64_t id, std::string_view text);
+
+    /**
+     * @return The k best matches, best first. Documents sharing no term with the query are never returned
+    */
+    std::vector<SearchResult> search(std::string_view query, size_t k) const;
+
+    /**
+     * Lowercased runs of letters, digits and underscores. Bytes above 0x7f count as letters so UTF-8 words stay whole.
+    */
+    static std::vector<std::string> tokenize(std::string_view text);
+
+    size_t size() const { return ids_.size(); }
+    size_t terms() const { return postings_.size(); }
+    /**
+     * Bytes used by the posting lists, excluding the term dictionary.
+    */
+    size_t memoryUsage() const;
+
+    static constexpr size_t block_size = 128;
+
+protected:
+    struct Block
+    {
+        uint32_t last_doc;
+        uint32_t max_tf;
+        uint32_t min_len;
+        uint32_t offset; // Into PostingList::bytes
+    };
+
+    struct PostingList
+    {
+        std::vector<Block> blocks;
+        std::vector<uint8_t> bytes;
+        // Postings not yet filling a block are kept raw
+        std::vector<uint32_t> tail_docs;
+        std::vector<uint32_t> tail_tfs;
+        Block tail = {0, 0, UINT32_MAX, 0};
+        size_t df = 0;
+        uint32_t max_tf = 0;
+        uint32_t min_len = UINT32_MAX;
+
+        void push(uint32_t doc, uint32_t tf, uint32_t len);
+    };
+    struct Cursor;
+
+    float score(float idf, uint32_t tf, uint32_t len) const;
+
+    float k1_;
+    float b_;
+    std::unordered_map<std::string, PostingList> postings_;
+    std::vector<uint64_t> ids_;
+    std::vector<uint32_t> doc_lens_;
+    uint64_t total_len_ = 0;
+};
+
+/**
+ * Merge ranked lists from different retrievers, e.g. Bm25Index and FlatIndex, with reciprocal rank fusion.
+ * An id scores the sum of 1 / (c + rank) over the lists it appears in, so no score normalization is needed.
+ * @param c Dampens the weight of the top ranks. 60 is the value from the original paper
+ * @return The k best ids by fused score
+*/
+std::vector<SearchResult> reciprocalRankFusion(const std::vector<std::vector<SearchResult>>& lists, size_t k, float c = 60);
+
+}
@@ -0,0 +1,92 @@
+#include "cancellation.hpp"
+
+#include <algorithm>
+
+using namespace tllf;
+
+CancellationToken CancellationToken::create()
+{
+    CancellationToken token;
+    token.state_ = std::make_shared<State>();
+    return token;
+}
+
+CancellationToken CancellationToken::fromTimeout(double seconds, trantor::EventLoop* loop)
+{
+    auto token = create();
+    token.state_->deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    if(loop == nullptr)
+        loop = drogon::app().getLoop();
+    // The timer must not keep the token alive. Nobody can wait on it any more once it is gone
+    std::weak_ptr<State> weak = token.state_;
+    loop->runAfter(std::max(seconds, 0.0), [weak]() {
+        CancellationToken token;
+        token.state_ = weak.lock();
+        if(token.state_)
+            token.cancel();
+    });
+    return token;
+}
+
+void CancellationToken::cancel() const
+{
+    if(!state_)
+        return;
+    std::vector<std::pair<size_t, std::function<void()>>> callbacks;
+    {
+        std::lock_guard lock(state_->mtx);
+        if(state_->cancelled.exchange(true))
+            return;
+        callbacks.swap(state_->callbacks);
+    }
+    for(auto& [id, callback] : callbacks)
+        callback();
+}
+
+bool CancellationToken::cancelled() const
+{
+    if(!state_)
+        return false;
+    if(state_->cancelled)
+        return true;
+    // The timer may not have fired yet on a busy loop
+    return state_->deadline.has_value() && Clock::now() >= *state_->deadline;
+}
+
+std::optional<CancellationToken::Clock::time_point> CancellationToken::deadline() const
+{
+    if(!state_)
+        return std::nullopt;
+    return state_->deadline;
+}
+
+std::optional<double> CancellationToken::remaining() const
+{
+    if(!state_ || !state_->deadline.has_value())
+        return std::nullopt;
+    return std::max(std::chrono::duration<double>(*state_->deadline - Clock::now()).count(), 0.0);
+}
+
+size_t CancellationToken::onCancel(std::function<void()> callback) const
+{
+    if(!state_)
+        return 0;
+    {
+        std::lock_guard lock(state_->mtx);
+        if(!state_->cancelled) {
+            size_t id = state_->next_id++;
+            state_->callbacks.emplace_back(id, std::move(callback));
+            return id;
+        }
+    }
+    callback();
+    return 0;
+}
+
+void CancellationToken::removeCallback(size_t id) const
+{
+    if(!state_ || id == 0)
+        return;
+    std::lock_guard lock(state_->mtx);
+    std::erase_if(state_->callbacks, [id](const auto& entry) { return entry.first == id; });
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+#include <drogon/HttpAppFramework.h>
+#include <drogon/utils/coroutine.h>
+#include <trantor/net/EventLoop.h>
+
+namespace tllf
+{
+
+/**
+ * Thrown when work is given up because its CancellationToken was cancelled or its deadline passed.
+ * @note Not a std::runtime_error, so it is never retried
+*/
+struct CancelledError : public std::exception
+{
+    const char* what() const noexcept override { return "Operation cancelled"; }
+};
+
+/**
+ * Cooperative cancellation shared by everything working on one request. Copies refer to the same state, so the
+ * token can be handed down to HTTP requests, retries and tools while the caller keeps a copy to cancel with.
+ *
+ * A default constructed token is never cancelled and costs nothing. Use create() or fromTimeout() for a real one.
+ * @note Thread safe. Callbacks run on the thread that cancels, or on the token's event loop when the deadline passes
+*/
+struct CancellationToken
+{
+    using Clock = std::chrono::steady_clock;
+
+    CancellationToken() = default;
+
+    static CancellationToken create();
+    /**
+     * A token that cancels itself after seconds. It can still be cancelled before that.
+     * @param loop Runs the deadline timer. The main loop if null
+    */
+    static CancellationToken fromTimeout(double seconds, trantor::EventLoop* loop = nullptr);
+
+    void cancel() const;
+    bool cancelled() const;
+    void throwIfCancelled() const
+    {
+        if(cancelled())
+            throw CancelledError();
+    }
+
+    bool cancellable() const { return state_ != nullptr; }
+    std::optional<Clock::time_point> deadline() const;
+    /**
+     * Seconds until the deadline, at least 0. Empty if there is no deadline.
+    */
+    std::optional<double> remaining() const;
+
+    /**
+     * Run callback once when the token is cancelled. Right away if it already is.
+     * @return Id for removeCallback(). 0 if the callback will never run or already has
+    */
+    size_t onCancel(std::function<void()> callback) const;
+    void removeCallback(size_t id) const;
+
+protected:
+    struct State
+    {
+        std::mutex mtx;
+        std::atomic<bool> cancelled = false;
+        std::optional<Clock::time_point> deadline;
+        std::vector<std::pair<size_t, std::function<void()>>> callbacks;
+        size_t next_id = 1;
+    };
+    std::shared_ptr<State> state_;
+};
+
+namespace internal
+{
+template <typename T>
+struct CancellableAwaiter : public drogon::CallbackAwaiter<T>
+{
+    CancellableAwaiter(drogon::Task<T> task, CancellationToken cancel) : task_(std::move(task)), cancel_(std::move(cancel)) {}
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        auto loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+        if(loop == nullptr)
+            loop = drogon::app().getLoop();
+        // Whoever settles first, the task or the token, resumes the waiter. The other one must not touch it
+        auto settled = std::make_shared<std::atomic<bool>>(false);
+        auto resume = [loop, handle]() { loop->queueInLoop([handle]() { handle.resume(); }); };
+
+        callback_ = cancel_.onCancel([this, settled, resume]() {
+            if(settled->exchange(true))
+                return;
+            this->setException(std::make_exception_ptr(CancelledError()));
+            resume();
+        });
+        [](drogon::Task<T> task, CancellableAwaiter* self, std::shared_ptr<std::atomic<bool>> settled, auto resume) -> drogon::AsyncTask {
+            try {
+                if constexpr(std::is_void_v<T>) {
+                    co_await std::move(task);
+                    if(!settled->exchange(true))
+                        resume();
+                }
+                else {
+                    auto value = co_await std::move(task);
+                    if(!settled->exchange(true)) {
+                        self->setValue(std::move(value));
+                        resume();
+                    }
+                }
+            }
+            catch(...) {
+                if(!settled->exchange(true)) {
+                    self->setException(std::current_exception());
+                    resume();
+                }
+            }
+        }(std::move(task_), this, settled, resume);
+    }
+
+    decltype(auto) await_resume()
+    {
+        cancel_.removeCallback(callback_);
+        return drogon::CallbackAwaiter<T>::await_resume();
+    }
+
+protected:
+    drogon::Task<T> task_;
+    CancellationToken cancel_;
+    size_t callback_ = 0;
+};
+}
+
+/**
+ * Await task, but give up on it as soon as cancel is cancelled and throw CancelledError.
+ *
+ * The task keeps running in the background until it finishes and its result is dropped. Only wrap tasks that
+ * own everything they use, like an HTTP request or a sleep.
+*/
+template <typename T>
+drogon::Task<T> withCancellation(drogon::Task<T> task, CancellationToken cancel)
+{
+    if(!cancel.cancellable())
+        co_return co_await std::move(task);
+    cancel.throwIfCancelled();
+    co_return co_await internal::CancellableAwaiter<T>(std::move(task), std::move(cancel));
+}
+
+}
@@ -0,0 +1,84 @@
+#include "cascade.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+#include <trantor/utils/Logger.h>
+
+using namespace tllf;
+using namespace drogon;
+
+CascadeLLM::CascadeLLM(std::vector<std::shared_ptr<LLM>> tiers, Validator validate)
+    : tiers(std::move(tiers)), validate(std::move(validate)), counters_(this->tiers.size())
+{
+    if(this->tiers.empty())
+        throw std::runtime_error("CascadeLLM needs at least one tier");
+}
+
+std::vector<CascadeLLM::TierStats> CascadeLLM::stats() const
+{
+    std::vector<TierStats> res(counters_.size());
+    for(size_t i = 0; i < counters_.size(); i++) {
+        res[i].attempts = counters_[i].attempts;
+        res[i].accepted = counters_[i].accepted;
+        res[i].errors = counters_[i].errors;
+    }
+    return res;
+}
+
+bool CascadeLLM::skip(size_t tier)
+{
+    auto& c = counters_[tier];
+    if(tier + 1 == tiers.size() || min_success_rate <= 0 || c.attempts < min_attempts)
+        return false;
+    if(double(c.accepted) / c.attempts >= min_success_rate)
+        return false;
+    // Let a request through now and then, or the tier could never recover
+    return ++c.skipped % std::max<size_t>(skip_probe, 1) != 0;
+}
+
+Task<std::string> CascadeLLM::generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools)
+{
+    for(size_t i = 0; i < tiers.size(); i++) {
+        const bool last = i + 1 == tiers.size();
+        if(skip(i))
+            continue;
+
+        Chatlog attempt = history;
+        // Text from a tier that may still be rejected is held back. Only the last tier streams as it goes
+        TextGenerationConfig tier_config = config;
+        std::string held;
+        if(config.on_text && !last)
+            tier_config.on_text = [&held](std::string_view delta) { held += delta; };
+        std::string reply;
+        try {
+            reply = co_await generateWith(*tiers[i], attempt, tier_config, tools);
+        }
+        catch(const CancelledError&) {
+            throw;
+        }
+        catch(const std::exception& e) {
+            // A tier that keeps failing is as useless as one whose replies keep being rejected
+            counters_[i].attempts++;
+            counters_[i].errors++;
+            if(last)
+                throw;
+            LOG_DEBUG << "Cascade tier " << i << " failed: " << e.what();
+            continue;
+        }
+
+        counters_[i].attempts++;
+        bool ok = !validate || validate(attempt, reply);
+        if(ok)
+            counters_[i].accepted++;
+        if(ok || last) {
+            if(!held.empty())
+                config.on_text(held);
+            history.insert(history.end(), std::make_move_iterator(attempt.begin() + history.size()), std::make_move_iterator(attempt.end()));
+            co_return reply;
+        }
+    }
+    // Only reachable if the last tier is skipped, which skip() never does
+    throw std::runtime_error("No cascade tier produced a reply");
+}
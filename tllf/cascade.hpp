@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include <drogon/utils/coroutine.h>
+
+#include <tllf/tllf.hpp>
+
+namespace tllf
+{
+
+/**
+ * Routes each request through a list of models ordered from cheapest to most capable. A tier's reply is kept if
+ * validate accepts it, otherwise the request is escalated to the next tier, starting again from the original
+ * history.
+ *
+ * Every tier counts its attempts, accepted replies and errors, so it shows how much traffic the small models
+ * actually serve. With min_success_rate set, a tier that keeps failing is skipped until the rate recovers.
+ * @param tiers Cheapest first
+ * @param validate Judges a reply, e.g. that it parses or calls tools correctly. history ends with the reply
+ * @note The reply of the last tier is returned even when validate rejects it. Tools run again on every tier that
+ * is tried. on_text only sees the accepted reply: the last tier streams it, earlier ones pass it on in one piece
+ * once validate accepts it
+*/
+struct CascadeLLM : public LLM
+{
+    using Validator = std::function<bool(const Chatlog& history, std::string_view reply)>;
+
+    struct TierStats
+    {
+        size_t attempts = 0;
+        size_t accepted = 0;
+        size_t errors = 0;      // Attempts that threw. They count as not accepted
+
+        double successRate() const { return attempts == 0 ? 1.0 : double(accepted) / attempts; }
+    };
+
+    CascadeLLM(std::vector<std::shared_ptr<LLM>> tiers, Validator validate);
+
+    std::vector<TierStats> stats() const;
+
+    std::vector<std::shared_ptr<LLM>> tiers;
+    Validator validate;
+    // Tiers, except the last, below this success rate are skipped. Exploring them again every skip_probe requests
+    double min_success_rate = 0.0;
+    size_t min_attempts = 20;   // Before a tier can be skipped
+    size_t skip_probe = 50;
+
+protected:
+    drogon::Task<std::string> generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools = {}) override;
+
+    bool skip(size_t tier);
+
+    struct Counters
+    {
+        std::atomic<size_t> attempts = 0;
+        std::atomic<size_t> accepted = 0;
+        std::atomic<size_t> errors = 0;
+        std::atomic<size_t> skipped = 0;
+    };
+    std::vector<Counters> counters_;
+};
+
+}
@@ -0,0 +1,516 @@
+#include "embedder.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <drogon/HttpAppFramework.h>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define TLLF_HAS_MMAP
+#endif
+
+using namespace tllf;
+using namespace drogon;
+
+Task<std::vector<float>> BatchingTextEmbedder::embed(std::string text)
+{
+    co_return co_await embedder->embed(std::move(text));
+}
+
+static size_t numEmbeddings(const std::vector<std::vector<float>>& res) { return res.size(); }
+static size_t numEmbeddings(const EmbeddingMatrix& res) { return res.rows(); }
+
+/**
+ * Split texts into batches and run embed_batch on them with at most max_concurrency batches in flight.
+ * @return One result per batch, in input order
+*/
+template <typename Result, typename Func>
+static Task<std::vector<Result>> dispatchBatches(const BatchingTextEmbedder& self, std::vector<std::string> texts, Func embed_batch)
+{
+    // Greedily pack consecutive texts so the results can be concatenated back in order
+    std::vector<std::vector<std::string>> batches;
+    size_t batch_chars = 0;
+    for(auto& text : texts) {
+        if(batches.empty() || batches.back().size() >= self.max_batch_items || batch_chars + text.size() > self.max_batch_chars) {
+            batches.emplace_back();
+            batch_chars = 0;
+        }
+        batch_chars += text.size();
+        batches.back().push_back(std::move(text));
+    }
+
+    std::vector<Result> results(batches.size());
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() -> Task<size_t> {
+        size_t done = 0;
+        for(size_t i = next++; i < batches.size(); i = next++) {
+            size_t n = batches[i].size();
+            results[i] = co_await embed_batch(std::move(batches[i]));
+            if(numEmbeddings(results[i]) != n)
+                throw std::runtime_error("Embedder returned " + std::to_string(numEmbeddings(results[i])) + " embeddings for " + std::to_string(n) + " texts");
+            done++;
+        }
+        co_return done;
+    };
+
+    std::vector<Task<size_t>> workers;
+    size_t n_workers = std::min(std::max<size_t>(self.max_concurrency, 1), batches.size());
+    workers.reserve(n_workers);
+    for(size_t i = 0; i < n_workers; i++)
+        workers.push_back(worker());
+    co_await when_all(std::move(workers));
+    co_return results;
+}
+
+Task<std::vector<std::vector<float>>> BatchingTextEmbedder::embed(std::vector<std::string> texts)
+{
+    size_t n = texts.size();
+    auto results = co_await dispatchBatches<std::vector<std::vector<float>>>(*this, std::move(texts), [this](std::vector<std::string> batch) {
+        return embedder->embed(std::move(batch));
+    });
+
+    std::vector<std::vector<float>> res;
+    res.reserve(n);
+    for(auto& batch : results) {
+        for(auto& vec : batch)
+            res.push_back(std::move(vec));
+    }
+    co_return res;
+}
+
+Task<EmbeddingMatrix> BatchingTextEmbedder::embedMatrix(std::vector<std::string> texts)
+{
+    size_t n = texts.size();
+    auto results = co_await dispatchBatches<EmbeddingMatrix>(*this, std::move(texts), [this](std::vector<std::string> batch) {
+        return embedder->embedMatrix(std::move(batch));
+    });
+
+    EmbeddingMatrix res;
+    if(!results.empty()) {
+        res = std::move(results[0]);
+        res.reserve(n);
+    }
+    for(size_t i = 1; i < results.size(); i++)
+        res.append(results[i]);
+    co_return res;
+}
+
+MicroBatchingTextEmbedder::MicroBatchingTextEmbedder(std::shared_ptr<TextEmbedder> embedder, size_t max_batch_items, double max_delay, trantor::EventLoop* loop)
+    : embedder(std::move(embedder)), max_batch_items(std::max<size_t>(max_batch_items, 1)), max_delay(max_delay)
+    , queue_(std::make_shared<Queue>())
+{
+    queue_->loop = loop == nullptr ? drogon::app().getLoop() : loop;
+    queue_->max_batch_items = this->max_batch_items;
+    queue_->max_delay = max_delay;
+}
+
+MicroBatchingTextEmbedder::~MicroBatchingTextEmbedder()
+{
+    std::vector<Awaiter*> orphans;
+    {
+        std::lock_guard lock(queue_->mtx);
+        queue_->closed = true;
+        // The timer only holds a weak reference. Should it fire anyway, it finds the queue gone
+        if(queue_->timer.has_value()) {
+            queue_->loop->invalidateTimer(*queue_->timer);
+            queue_->timer.reset();
+        }
+        orphans.swap(queue_->pending);
+    }
+    // Batches already sent finish on their own. Texts still waiting would never be sent
+    auto error = std::make_exception_ptr(std::runtime_error("MicroBatchingTextEmbedder destroyed before the text was embedded"));
+    for(auto awaiter : orphans) {
+        awaiter->fail(error);
+        awaiter->resume();
+    }
+}
+
+void MicroBatchingTextEmbedder::Awaiter::await_suspend(std::coroutine_handle<> h)
+{
+    handle = h;
+    caller_loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+    // The batch may complete and resume us before enqueue returns. Don't touch this afterwards
+    auto q = queue;
+    q->enqueue(this);
+}
+
+void MicroBatchingTextEmbedder::Awaiter::resume()
+{
+    auto h = handle;
+    auto loop = caller_loop;
+    if(loop != nullptr && !loop->isInLoopThread())
+        loop->queueInLoop([h]() { h.resume(); });
+    else
+        h.resume();
+}
+
+void MicroBatchingTextEmbedder::Queue::enqueue(Awaiter* awaiter)
+{
+    bool full = false;
+    bool closed_now = false;
+    {
+        std::lock_guard lock(mtx);
+        closed_now = closed;
+        if(!closed) {
+            pending.push_back(awaiter);
+            embedder = awaiter->embedder;
+            full = pending.size() >= max_batch_items;
+            if(!full && !timer.has_value()) {
+                std::weak_ptr<Queue> weak = shared_from_this();
+                timer = loop->runAfter(max_delay, [weak]() {
+                    if(auto queue = weak.lock())
+                        queue->flush();
+                });
+            }
+        }
+    }
+    if(closed_now) {
+        awaiter->fail(std::make_exception_ptr(std::runtime_error("MicroBatchingTextEmbedder destroyed before the text was embedded")));
+        awaiter->resume();
+    }
+    else if(full)
+        flush();
+}
+
+void MicroBatchingTextEmbedder::flush()
+{
+    queue_->flush();
+}
+
+void MicroBatchingTextEmbedder::Queue::flush()
+{
+    std::vector<Awaiter*> batch;
+    std::shared_ptr<TextEmbedder> inner;
+    {
+        std::lock_guard lock(mtx);
+        batch.swap(pending);
+        inner = embedder;
+        if(timer.has_value()) {
+            loop->invalidateTimer(*timer);
+            timer.reset();
+        }
+    }
+    if(batch.empty())
+        return;
+
+    // The batch owns references to the queue and the inner embedder, so it can outlive the adapter
+    async_run([self = shared_from_this(), inner = std::move(inner), batch = std::move(batch)]() -> Task<> {
+        std::vector<std::string> texts;
+        texts.reserve(batch.size());
+        for(auto awaiter : batch)
+            texts.push_back(std::move(awaiter->text));
+
+        std::exception_ptr error;
+        try {
+            auto res = co_await inner->embed(std::move(texts));
+            if(res.size() != batch.size())
+                throw std::runtime_error("Embedder returned " + std::to_string(res.size()) + " embeddings for " + std::to_string(batch.size()) + " texts");
+            for(size_t i = 0; i < batch.size(); i++)
+                batch[i]->complete(std::move(res[i]));
+        }
+        catch(...) {
+            error = std::current_exception();
+        }
+
+        for(auto awaiter : batch) {
+            if(error)
+                awaiter->fail(error);
+            awaiter->resume();
+        }
+    });
+}
+
+Task<std::vector<float>> MicroBatchingTextEmbedder::embed(std::string text)
+{
+    co_return co_await Awaiter(queue_, embedder, std::move(text));
+}
+
+Task<std::vector<std::vector<float>>> MicroBatchingTextEmbedder::embed(std::vector<std::string> texts)
+{
+    co_return co_await embedder->embed(std::move(texts));
+}
+
+static uint64_t mix64(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+#else
+    // The same 128-bit product from 32-bit halves. Keys are stored on disk, so every build must agree
+    uint64_t a_lo = static_cast<uint32_t>(a), a_hi = a >> 32;
+    uint64_t b_lo = static_cast<uint32_t>(b), b_hi = b >> 32;
+    uint64_t ll = a_lo * b_lo, lh = a_lo * b_hi, hl = a_hi * b_lo, hh = a_hi * b_hi;
+    uint64_t mid = (ll >> 32) + static_cast<uint32_t>(lh) + static_cast<uint32_t>(hl);
+    uint64_t lo = (mid << 32) | static_cast<uint32_t>(ll);
+    uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    return lo ^ hi;
+#endif
+}
+
+static uint64_t hash64(std::string_view str, uint64_t seed)
+{
+    uint64_t h = seed ^ mix64(str.size() ^ 0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull);
+    size_t i = 0;
+    for(; i + 8 <= str.size(); i += 8) {
+        uint64_t v;
+        std::memcpy(&v, str.data() + i, 8);
+        h = mix64(v ^ 0xa0761d6478bd642full, h ^ 0xe7037ed1a0b428dbull);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, str.data() + i, str.size() - i);
+    h = mix64(tail ^ 0x4b33a62ed433d4a3ull, h ^ 0x8ebc6af09c88c6e3ull);
+    return mix64(h, 0x589965cc75374cc3ull ^ seed);
+}
+
+EmbeddingStore::Key EmbeddingStore::makeKey(std::string_view model_name, std::string_view text)
+{
+    return {hash64(text, hash64(model_name, 0x1d8e4e27c47d124full)), hash64(text, hash64(model_name, 0x9e3779b97f4a7c15ull))};
+}
+
+static constexpr char store_magic[8] = {'T', 'L', 'L', 'F', 'E', 'M', 'B', '\0'};
+static constexpr uint32_t store_version = 1;
+static constexpr size_t store_header_size = 16;
+
+#ifdef TLLF_HAS_MMAP
+EmbeddingStore::EmbeddingStore(const std::string& path)
+{
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if(fd_ < 0)
+        throw std::runtime_error("Failed to open embedding store: " + path);
+
+    // Whoever comes first writes the header. The dimension is filled in with the first record
+    if(::flock(fd_, LOCK_EX) != 0) {
+        ::close(fd_);
+        throw std::runtime_error("Failed to lock embedding store: " + path);
+    }
+    struct stat st;
+    if(::fstat(fd_, &st) != 0) {
+        ::flock(fd_, LOCK_UN);
+        ::close(fd_);
+        throw std::runtime_error("Failed to stat embedding store: " + path);
+    }
+    if(st.st_size < static_cast<off_t>(store_header_size)) {
+        char header[store_header_size] = {};
+        std::memcpy(header, store_magic, sizeof(store_magic));
+        std::memcpy(header + 8, &store_version, sizeof(store_version));
+        if(::pwrite(fd_, header, sizeof(header), 0) != sizeof(header)) {
+            ::flock(fd_, LOCK_UN);
+            ::close(fd_);
+            throw std::runtime_error("Failed to write embedding store header: " + path);
+        }
+    }
+    ::flock(fd_, LOCK_UN);
+
+    try {
+        refresh();
+        if(std::memcmp(map_, store_magic, sizeof(store_magic)) != 0)
+            throw std::runtime_error("Not an embedding store: " + path);
+        uint32_t version;
+        std::memcpy(&version, map_ + 8, sizeof(version));
+        if(version != store_version)
+            throw std::runtime_error("Unsupported embedding store version " + std::to_string(version) + ": " + path);
+    }
+    catch(...) {
+        close();
+        throw;
+    }
+}
+
+EmbeddingStore::~EmbeddingStore()
+{
+    close();
+}
+
+void EmbeddingStore::close()
+{
+    if(map_ != nullptr)
+        ::munmap(const_cast<char*>(map_), map_size_);
+    if(fd_ >= 0)
+        ::close(fd_);
+    map_ = nullptr;
+    fd_ = -1;
+}
+
+void EmbeddingStore::refresh()
+{
+    struct stat st;
+    if(::fstat(fd_, &st) != 0)
+        throw std::runtime_error("Failed to stat embedding store");
+    size_t size = st.st_size;
+    if(size > map_size_) {
+        void* ptr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, 0);
+        if(ptr == MAP_FAILED)
+            throw std::runtime_error("Failed to map embedding store");
+        if(map_ != nullptr)
+            ::munmap(const_cast<char*>(map_), map_size_);
+        map_ = static_cast<const char*>(ptr);
+        map_size_ = size;
+    }
+
+    if(dim_ == 0) {
+        std::memcpy(&dim_, map_ + 12, sizeof(dim_));
+        if(dim_ == 0)
+            return;
+        scanned_ = store_header_size;
+    }
+    // Index records appended since the last refresh, possibly by other processes. A torn record at the end is ignored
+    for(size_t rec = recordSize(); scanned_ + rec <= map_size_; scanned_ += rec) {
+        Key key;
+        std::memcpy(key.data(), map_ + scanned_, sizeof(Key));
+        index_.emplace(key, scanned_);
+    }
+}
+
+bool EmbeddingStore::find(const Key& key, std::vector<float>& out)
+{
+    auto it = index_.find(key);
+    if(it == index_.end()) {
+        refresh();
+        it = index_.find(key);
+        if(it == index_.end())
+            return false;
+    }
+    out.resize(dim_);
+    std::memcpy(out.data(), map_ + it->second + sizeof(Key), dim_ * sizeof(float));
+    return true;
+}
+
+void EmbeddingStore::append(const std::vector<std::pair<Key, const std::vector<float>*>>& records)
+{
+    if(records.empty())
+        return;
+
+    if(::flock(fd_, LOCK_EX) != 0)
+        throw std::runtime_error("Failed to lock embedding store");
+    try {
+        refresh();
+        if(dim_ == 0) {
+            uint32_t dim = static_cast<uint32_t>(records[0].second->size());
+            if(::pwrite(fd_, &dim, sizeof(dim), 12) != sizeof(dim))
+                throw std::runtime_error("Failed to write embedding store header");
+            dim_ = dim;
+            scanned_ = store_header_size;
+        }
+
+        std::string buffer;
+        for(const auto& [key, vec] : records) {
+            if(vec->size() != dim_)
+                throw std::runtime_error("Embedding has dimension " + std::to_string(vec->size()) + " but the store uses " + std::to_string(dim_));
+            if(index_.contains(key))
+                continue;
+            buffer.append(reinterpret_cast<const char*>(key.data()), sizeof(Key));
+            buffer.append(reinterpret_cast<const char*>(vec->data()), vec->size() * sizeof(float));
+        }
+        // Write after the last complete record. That overwrites whatever a crashed writer left behind
+        if(!buffer.empty() && ::pwrite(fd_, buffer.data(), buffer.size(), scanned_) != static_cast<ssize_t>(buffer.size()))
+            throw std::runtime_error("Failed to write to embedding store");
+        refresh();
+    }
+    catch(...) {
+        ::flock(fd_, LOCK_UN);
+        throw;
+    }
+    ::flock(fd_, LOCK_UN);
+}
+#else
+EmbeddingStore::EmbeddingStore(const std::string& path)
+{
+    throw std::runtime_error("Embedding stores are not supported on this platform");
+}
+
+EmbeddingStore::~EmbeddingStore() = default;
+void EmbeddingStore::close() {}
+void EmbeddingStore::refresh() {}
+bool EmbeddingStore::find(const Key&, std::vector<float>&) { return false; }
+void EmbeddingStore::append(const std::vector<std::pair<Key, const std::vector<float>*>>&) {}
+#endif
+
+CachingTextEmbedder::CachingTextEmbedder(std::shared_ptr<TextEmbedder> embedder, std::string model_name, const std::string& path, size_t max_memory_items)
+    : embedder(std::move(embedder)), model_name(std::move(model_name)), max_memory_items(max_memory_items)
+{
+    if(!path.empty())
+        store_ = std::make_unique<EmbeddingStore>(path);
+}
+
+bool CachingTextEmbedder::lookup(const EmbeddingStore::Key& key, std::vector<float>& out)
+{
+    if(auto it = lru_index_.find(key); it != lru_index_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        out = it->second->second;
+        return true;
+    }
+    if(store_ != nullptr && store_->find(key, out)) {
+        remember(key, out);
+        return true;
+    }
+    return false;
+}
+
+void CachingTextEmbedder::remember(const EmbeddingStore::Key& key, const std::vector<float>& vec)
+{
+    if(max_memory_items == 0 || lru_index_.contains(key))
+        return;
+    lru_.emplace_front(key, vec);
+    lru_index_[key] = lru_.begin();
+    while(lru_.size() > max_memory_items) {
+        lru_index_.erase(lru_.back().first);
+        lru_.pop_back();
+    }
+}
+
+Task<std::vector<float>> CachingTextEmbedder::embed(std::string text)
+{
+    std::vector<std::string> texts = {std::move(text)};
+    co_return (co_await embed(std::move(texts)))[0];
+}
+
+Task<std::vector<std::vector<float>>> CachingTextEmbedder::embed(std::vector<std::string> texts)
+{
+    std::vector<std::vector<float>> res(texts.size());
+    std::vector<EmbeddingStore::Key> keys;
+    keys.reserve(texts.size());
+    // Index of the first text with the same key. Duplicates in one call are only sent once
+    std::unordered_map<EmbeddingStore::Key, size_t, EmbeddingStore::KeyHash> missing;
+    std::vector<std::string> miss_texts;
+    std::vector<size_t> miss_idx;
+    {
+        std::lock_guard lock(mtx_);
+        for(size_t i = 0; i < texts.size(); i++) {
+            keys.push_back(EmbeddingStore::makeKey(model_name, texts[i]));
+            if(lookup(keys[i], res[i]) || !missing.emplace(keys[i], i).second)
+                continue;
+            miss_texts.push_back(std::move(texts[i]));
+            miss_idx.push_back(i);
+        }
+    }
+    if(miss_texts.empty())
+        co_return res;
+
+    auto embeddings = co_await embedder->embed(std::move(miss_texts));
+    if(embeddings.size() != miss_idx.size())
+        throw std::runtime_error("Embedder returned " + std::to_string(embeddings.size()) + " embeddings for " + std::to_string(miss_idx.size()) + " texts");
+
+    std::vector<std::pair<EmbeddingStore::Key, const std::vector<float>*>> records;
+    records.reserve(miss_idx.size());
+    for(size_t i = 0; i < miss_idx.size(); i++) {
+        res[miss_idx[i]] = std::move(embeddings[i]);
+        records.push_back({keys[miss_idx[i]], &res[miss_idx[i]]});
+    }
+    for(size_t i = 0; i < texts.size(); i++) {
+        if(res[i].empty())
+            res[i] = res[missing.at(keys[i])];
+    }
+
+    std::lock_guard lock(mtx_);
+    for(auto& [key, vec] : records)
+        remember(key, *vec);
+    if(store_ != nullptr)
+        store_->append(records);
+    co_return res;
+}
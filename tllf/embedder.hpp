@@ -0,0 +1,192 @@
+#pragma once
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <drogon/utils/coroutine.h>
+#include <trantor/net/EventLoop.h>
+
+#include <tllf/tllf.hpp>
+
+namespace tllf
+{
+
+/**
+ * Embedder adapter that splits large inputs into batches the provider accepts and sends them concurrently.
+ *
+ * @param embedder The embedder doing the actual work
+ * @param max_batch_items Maximum number of texts per request
+ * @param max_batch_chars Maximum total characters per request. A single longer text is still sent on its own
+ * @param max_concurrency Maximum number of requests in flight
+*/
+struct BatchingTextEmbedder : public TextEmbedder
+{
+    BatchingTextEmbedder(std::shared_ptr<TextEmbedder> embedder, size_t max_batch_items = 64, size_t max_batch_chars = 64 * 1024, size_t max_concurrency = 4)
+        : embedder(std::move(embedder)), max_batch_items(max_batch_items), max_batch_chars(max_batch_chars), max_concurrency(max_concurrency)
+    {
+    }
+
+    using TextEmbedder::embed;
+    using TextEmbedder::embedMatrix;
+    drogon::Task<std::vector<float>> embed(std::string text) override;
+    drogon::Task<std::vector<std::vector<float>>> embed(std::vector<std::string> texts) override;
+    drogon::Task<EmbeddingMatrix> embedMatrix(std::vector<std::string> texts) override;
+
+    std::shared_ptr<TextEmbedder> embedder;
+    size_t max_batch_items;
+    size_t max_batch_chars;
+    size_t max_concurrency;
+};
+
+/**
+ * Embedder adapter that coalesces concurrent single text embed() calls into batched requests.
+ *
+ * A call waits until max_batch_items texts are queued or max_delay seconds have passed since the first one,
+ * whichever comes first. Then the queued texts are sent as one request and each caller gets its own result.
+ * @param embedder The embedder doing the actual work
+ * @param max_batch_items Flush as soon as this many texts are queued
+ * @param max_delay Maximum time in seconds a text waits for others
+ * @param loop Event loop running the flush timer. Defaults to drogon's main loop
+ * @note Batch calls (embed(std::vector<std::string>)) are forwarded as-is.
+*/
+struct MicroBatchingTextEmbedder : public TextEmbedder
+{
+    MicroBatchingTextEmbedder(std::shared_ptr<TextEmbedder> embedder, size_t max_batch_items = 32, double max_delay = 0.005, trantor::EventLoop* loop = nullptr);
+    ~MicroBatchingTextEmbedder();
+
+    using TextEmbedder::embed;
+    drogon::Task<std::vector<float>> embed(std::string text) override;
+    drogon::Task<std::vector<std::vector<float>>> embed(std::vector<std::string> texts) override;
+
+    /**
+     * Send the queued texts now.
+    */
+    void flush();
+
+    std::shared_ptr<TextEmbedder> embedder;
+    size_t max_batch_items;
+    double max_delay;
+
+protected:
+    struct Queue;
+
+    struct Awaiter : public drogon::CallbackAwaiter<std::vector<float>>
+    {
+        Awaiter(std::shared_ptr<Queue> queue, std::shared_ptr<TextEmbedder> embedder, std::string text)
+            : queue(std::move(queue)), embedder(std::move(embedder)), text(std::move(text)) {}
+        void await_suspend(std::coroutine_handle<> handle);
+        void complete(std::vector<float> res) { setValue(std::move(res)); }
+        void fail(std::exception_ptr e) { setException(e); }
+        // Resume the waiting coroutine on its own loop. The awaiter may be gone afterwards
+        void resume();
+
+        std::shared_ptr<Queue> queue;
+        std::shared_ptr<TextEmbedder> embedder;
+        std::string text;
+        std::coroutine_handle<> handle;
+        trantor::EventLoop* caller_loop = nullptr;
+    };
+
+    /**
+     * State shared with the flush timer and the batches in flight, so neither depends on the embedder still
+     * existing.
+    */
+    struct Queue : public std::enable_shared_from_this<Queue>
+    {
+        void enqueue(Awaiter* awaiter);
+        void flush();
+
+        trantor::EventLoop* loop;
+        size_t max_batch_items;
+        double max_delay;
+        std::mutex mtx;
+        std::shared_ptr<TextEmbedder> embedder;  // Of the latest enqueued text
+        std::vector<Awaiter*> pending;
+        std::optional<trantor::TimerId> timer;
+        bool closed = false;
+    };
+
+    std::shared_ptr<Queue> queue_;
+};
+
+/**
+ * Append-only file of embeddings keyed by a 128-bit content hash. The file is memory mapped for reads and can be
+ * shared by several processes. Writers take an exclusive file lock and readers pick up new records on lookup.
+ *
+ * Layout: a 16 byte header ("TLLFEMB" + version + dimension) followed by records of key + dimension floats.
+ * Floats are stored in native byte order.
+*/
+struct EmbeddingStore
+{
+    using Key = std::array<uint64_t, 2>;
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const { return key[0]; }
+    };
+
+    EmbeddingStore(const std::string& path);
+    ~EmbeddingStore();
+    EmbeddingStore(const EmbeddingStore&) = delete;
+    EmbeddingStore& operator=(const EmbeddingStore&) = delete;
+
+    bool find(const Key& key, std::vector<float>& out);
+    void append(const std::vector<std::pair<Key, const std::vector<float>*>>& records);
+    size_t size() const { return index_.size(); }
+    static Key makeKey(std::string_view model_name, std::string_view text);
+
+protected:
+    void refresh();
+    void close();
+    size_t recordSize() const { return sizeof(Key) + dim_ * sizeof(float); }
+
+    int fd_ = -1;
+    const char* map_ = nullptr;
+    size_t map_size_ = 0;
+    size_t scanned_ = 0; // End of the last record added to the index
+    uint32_t dim_ = 0;
+    std::unordered_map<Key, size_t, KeyHash> index_;
+};
+
+/**
+ * Embedder adapter that remembers embeddings by (model name, text).
+ *
+ * Lookups go through an in-memory LRU, then the optional EmbeddingStore file. Only misses are forwarded to the
+ * wrapped embedder, as a single batch.
+ * @param embedder The embedder doing the actual work
+ * @param model_name Part of the key. Use a different name whenever the embedder's output changes
+ * @param path File to persist embeddings to. Memory only if empty
+ * @param max_memory_items Capacity of the in-memory LRU
+*/
+struct CachingTextEmbedder : public TextEmbedder
+{
+    CachingTextEmbedder(std::shared_ptr<TextEmbedder> embedder, std::string model_name, const std::string& path = "", size_t max_memory_items = 100000);
+
+    using TextEmbedder::embed;
+    drogon::Task<std::vector<float>> embed(std::string text) override;
+    drogon::Task<std::vector<std::vector<float>>> embed(std::vector<std::string> texts) override;
+
+    std::shared_ptr<TextEmbedder> embedder;
+    std::string model_name;
+    size_t max_memory_items;
+
+protected:
+    bool lookup(const EmbeddingStore::Key& key, std::vector<float>& out);
+    void remember(const EmbeddingStore::Key& key, const std::vector<float>& vec);
+
+    std::mutex mtx_;
+    std::unique_ptr<EmbeddingStore> store_;
+    std::list<std::pair<EmbeddingStore::Key, std::vector<float>>> lru_;
+    std::unordered_map<EmbeddingStore::Key, decltype(lru_)::iterator, EmbeddingStore::KeyHash> lru_index_;
+};
+
+}
@@ -0,0 +1,383 @@
+#include "http_stream.hpp"
+
+#include <charconv>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+
+#include <drogon/HttpAppFramework.h>
+#include <trantor/net/InetAddress.h>
+#include <trantor/net/Resolver.h>
+#include <trantor/net/TcpClient.h>
+
+#include <tllf/tllf.hpp>
+#include <tllf/url_parser.hpp>
+
+using namespace tllf;
+using namespace tllf::internal;
+using namespace drogon;
+
+static bool equalsIgnoreCase(std::string_view a, std::string_view b)
+{
+    if(a.size() != b.size())
+        return false;
+    for(size_t i = 0; i < a.size(); i++) {
+        if(::tolower((unsigned char)a[i]) != ::tolower((unsigned char)b[i]))
+            return false;
+    }
+    return true;
+}
+
+bool SseParser::feed(std::string_view bytes, const std::function<bool(std::string_view)>& on_event)
+{
+    for(char c : bytes) {
+        if(c != '\n') {
+            line_.push_back(c);
+            continue;
+        }
+        std::string_view line = line_;
+        if(!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+
+        if(line.empty()) {
+            // A blank line ends the event
+            bool go_on = !has_data_ || on_event(data_);
+            data_.clear();
+            has_data_ = false;
+            line_.clear();
+            if(!go_on)
+                return false;
+            continue;
+        }
+        if(line.starts_with("data:")) {
+            line.remove_prefix(5);
+            if(line.starts_with(' '))
+                line.remove_prefix(1);
+            if(has_data_)
+                data_.push_back('\n');
+            data_ += line;
+            has_data_ = true;
+        }
+        // Comments, event names, ids and retry hints are not used
+        line_.clear();
+    }
+    return true;
+}
+
+namespace
+{
+struct StreamState
+{
+    enum class Body { Headers, ChunkSize, ChunkData, ChunkEnd, Length, UntilClose, Done };
+
+    // Parse whatever is buffered. Returns once more bytes are needed or the response is over
+    void parse()
+    {
+        while(!finished) {
+            if(body_state == Body::Headers) {
+                size_t end = buffer.find("\r\n\r\n");
+                if(end == std::string::npos)
+                    return;
+                parseHeaders(std::string_view(buffer).substr(0, end));
+                buffer.erase(0, end + 4);
+                continue;
+            }
+            if(body_state == Body::ChunkSize) {
+                size_t eol = buffer.find("\r\n");
+                if(eol == std::string::npos)
+                    return;
+                size_t size = 0;
+                auto [ptr, ec] = std::from_chars(buffer.data(), buffer.data() + eol, size, 16);
+                if(ec != std::errc())
+                    return fail("Bad chunk size in streamed response");
+                buffer.erase(0, eol + 2);
+                // The trailer after the last chunk is not needed
+                if(size == 0)
+                    return finish();
+                remaining = size;
+                body_state = Body::ChunkData;
+                continue;
+            }
+            if(body_state == Body::ChunkEnd) {
+                if(buffer.size() < 2)
+                    return;
+                buffer.erase(0, 2);
+                body_state = Body::ChunkSize;
+                continue;
+            }
+            if(buffer.empty())
+                return;
+            size_t n = body_state == Body::UntilClose ? buffer.size() : std::min(remaining, buffer.size());
+            if(!deliver(std::string_view(buffer).substr(0, n)))
+                return;
+            buffer.erase(0, n);
+            remaining -= body_state == Body::UntilClose ? 0 : n;
+            if(body_state == Body::ChunkData && remaining == 0)
+                body_state = Body::ChunkEnd;
+            else if(body_state == Body::Length && remaining == 0)
+                return finish();
+        }
+    }
+
+    void parseHeaders(std::string_view head)
+    {
+        size_t eol = head.find("\r\n");
+        std::string_view status_line = head.substr(0, eol);
+        // HTTP/1.1 200 OK
+        size_t space = status_line.find(' ');
+        if(space != std::string_view::npos)
+            std::from_chars(status_line.data() + space + 1, status_line.data() + status_line.size(), result.status);
+
+        bool chunked = false;
+        std::optional<size_t> length;
+        while(eol != std::string_view::npos) {
+            head = head.substr(eol + 2);
+            eol = head.find("\r\n");
+            std::string_view line = head.substr(0, eol);
+            size_t colon = line.find(':');
+            if(colon == std::string_view::npos)
+                continue;
+            std::string_view name = line.substr(0, colon);
+            std::string_view value = line.substr(colon + 1);
+            while(!value.empty() && value.front() == ' ')
+                value.remove_prefix(1);
+            if(equalsIgnoreCase(name, "Transfer-Encoding"))
+                chunked = value.find("chunked") != std::string_view::npos;
+            else if(equalsIgnoreCase(name, "Content-Length")) {
+                size_t n = 0;
+                std::from_chars(value.data(), value.data() + value.size(), n);
+                length = n;
+            }
+            else if(equalsIgnoreCase(name, "Retry-After") || (equalsIgnoreCase(name, "X-RateLimit-Reset") && result.retry_after.empty()))
+                result.retry_after = value;
+        }
+
+        if(chunked)
+            body_state = Body::ChunkSize;
+        else if(length.has_value()) {
+            body_state = Body::Length;
+            remaining = *length;
+            if(remaining == 0)
+                finish();
+        }
+        else
+            body_state = Body::UntilClose;
+    }
+
+    bool deliver(std::string_view data)
+    {
+        if(result.status != 200) {
+            result.body += data;
+            return true;
+        }
+        if(on_data(data))
+            return true;
+        result.cancelled = true;
+        finish();
+        return false;
+    }
+
+    // Send the next piece of a chunked body. Called again each time the connection has written everything
+    void pump(const trantor::TcpConnectionPtr& conn)
+    {
+        if(!writer || finished)
+            return;
+        std::string chunk;
+        bool more = true;
+        try {
+            while(chunk.empty() && more)
+                more = writer(chunk);
+        }
+        catch(const std::exception& e) {
+            return fail(std::string("Failed to produce request body: ") + e.what());
+        }
+        if(!chunk.empty()) {
+            char size[32];
+            auto [end, ec] = std::to_chars(size, size + sizeof(size), chunk.size(), 16);
+            std::string framed;
+            framed.reserve(chunk.size() + 32);
+            framed.append(size, end);
+            framed += "\r\n";
+            framed += chunk;
+            framed += "\r\n";
+            conn->send(std::move(framed));
+        }
+        if(!more) {
+            writer = nullptr;
+            conn->send(std::string("0\r\n\r\n"));
+        }
+    }
+
+    void fail(std::string message)
+    {
+        error = std::make_exception_ptr(std::runtime_error(std::move(message)));
+        finish();
+    }
+
+    void finish()
+    {
+        if(finished)
+            return;
+        finished = true;
+        body_state = Body::Done;
+        cancel.removeCallback(cancel_callback);
+        if(auto conn = client ? client->connection() : nullptr)
+            conn->forceClose();
+        // The client may be the one calling us. Let it unwind before it is destroyed
+        loop->queueInLoop([client = std::move(client)]() {});
+        if(done)
+            done();
+    }
+
+    trantor::EventLoop* loop = nullptr;
+    std::shared_ptr<trantor::TcpClient> client;
+    std::string request;
+    std::function<bool(std::string_view)> on_data;
+    std::function<void()> done;
+    BodyWriter writer;
+    CancellationToken cancel;
+    size_t cancel_callback = 0;
+
+    std::string buffer;
+    Body body_state = Body::Headers;
+    size_t remaining = 0;
+    HttpStreamResult result;
+    std::exception_ptr error;
+    bool finished = false;
+};
+
+struct StreamAwaiter : public CallbackAwaiter<HttpStreamResult>
+{
+    StreamAwaiter(std::shared_ptr<StreamState> state, std::string host, uint16_t port, bool tls)
+        : state(std::move(state)), host(std::move(host)), port(port), tls(tls)
+    {
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        state->done = [this, handle]() {
+            if(state->error)
+                setException(state->error);
+            else
+                setValue(std::move(state->result));
+            state->loop->queueInLoop([handle]() { handle.resume(); });
+        };
+        state->loop->runInLoop([this]() { start(); });
+    }
+
+    // Cancelling closes the connection right away, so the server stops generating too
+    void watchCancel()
+    {
+        std::weak_ptr<StreamState> weak = state;
+        auto loop = state->loop;
+        state->cancel_callback = state->cancel.onCancel([weak, loop]() {
+            loop->runInLoop([weak]() {
+                if(auto state = weak.lock()) {
+                    state->error = std::make_exception_ptr(CancelledError());
+                    state->finish();
+                }
+            });
+        });
+    }
+
+    void start()
+    {
+        watchCancel();
+        if(state->finished)
+            return;
+        std::weak_ptr<StreamState> weak = state;
+        auto resolver = trantor::Resolver::newResolver(state->loop);
+        resolver->resolve(host, [weak, resolver, port = port, tls = tls, host = host](const trantor::InetAddress& addr) {
+            auto state = weak.lock();
+            if(!state || state->finished)
+                return;
+            if(addr.isUnspecified())
+                return state->fail("Failed to resolve " + host);
+
+            trantor::InetAddress server(addr.toIp(), port, addr.isIpV6());
+            state->client = std::make_shared<trantor::TcpClient>(state->loop, server, "tllf-stream");
+            if(tls)
+                state->client->enableSSL(false, true, host);
+            state->client->setConnectionCallback([weak](const trantor::TcpConnectionPtr& conn) {
+                auto state = weak.lock();
+                if(!state || state->finished)
+                    return;
+                if(conn->connected()) {
+                    conn->send(std::move(state->request));
+                    state->pump(conn);
+                    return;
+                }
+                // A response without a length ends with the connection
+                if(state->body_state == StreamState::Body::UntilClose) {
+                    state->parse();
+                    state->finish();
+                }
+                else
+                    state->fail("Connection closed before the response ended");
+            });
+            state->client->setConnectionErrorCallback([weak, host]() {
+                if(auto state = weak.lock())
+                    state->fail("Failed to connect to " + host);
+            });
+            state->client->setWriteCompleteCallback([weak](const trantor::TcpConnectionPtr& conn) {
+                if(auto state = weak.lock())
+                    state->pump(conn);
+            });
+            state->client->setMessageCallback([weak](const trantor::TcpConnectionPtr&, trantor::MsgBuffer* buf) {
+                auto state = weak.lock();
+                if(!state || state->finished) {
+                    buf->retrieveAll();
+                    return;
+                }
+                state->buffer.append(buf->peek(), buf->readableBytes());
+                buf->retrieveAll();
+                state->parse();
+            });
+            state->client->connect();
+        });
+    }
+
+    std::shared_ptr<StreamState> state;
+    std::string host;
+    uint16_t port;
+    bool tls;
+};
+}
+
+Task<HttpStreamResult> tllf::internal::streamRequest(uint32_t endpoint, std::string method, std::string path,
+    std::vector<std::pair<std::string, std::string>> headers, HttpStreamBody body,
+    std::function<bool(std::string_view)> on_data, trantor::EventLoop* loop, CancellationToken cancel)
+{
+    cancel.throwIfCancelled();
+    std::string origin = endpointString(endpoint);
+    UrlView url(origin);
+    if(!url.good())
+        throw std::runtime_error("Cannot stream from " + origin);
+    bool tls = url.protocol() == "https";
+    std::string host(url.host());
+    int port = url.port(url.defaultPort());
+
+    auto state = std::make_shared<StreamState>();
+    state->loop = loop != nullptr ? loop : trantor::EventLoop::getEventLoopOfCurrentThread();
+    if(state->loop == nullptr)
+        state->loop = app().getLoop();
+    state->on_data = std::move(on_data);
+    state->cancel = std::move(cancel);
+
+    std::string& request = state->request;
+    request.reserve(body.text.size() + 512);
+    request += method + " " + path + " HTTP/1.1\r\n";
+    request += "Host: " + host + (port != url.defaultPort() ? ":" + std::to_string(port) : "") + "\r\n";
+    for(const auto& [name, value] : headers)
+        request += name + ": " + value + "\r\n";
+    if(body.writer) {
+        request += "Transfer-Encoding: chunked\r\n";
+        state->writer = std::move(body.writer);
+    }
+    else
+        request += "Content-Length: " + std::to_string(body.text.size()) + "\r\n";
+    request += "Connection: close\r\n\r\n";
+    request += body.text;
+
+    co_return co_await StreamAwaiter(state, std::move(host), port, tls);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <drogon/utils/coroutine.h>
+#include <trantor/net/EventLoop.h>
+
+#include <tllf/cancellation.hpp>
+
+namespace tllf::internal
+{
+
+struct HttpStreamResult
+{
+    int status = 0;
+    std::string body;           // Only collected for error responses
+    std::string retry_after;    // Retry-After or X-RateLimit-Reset header, if any
+    bool cancelled = false;     // on_data asked to stop before the response ended
+};
+
+/**
+ * Produces a request body piece by piece. Fill chunk with the next piece and return false once the body is complete.
+*/
+using BodyWriter = std::function<bool(std::string& chunk)>;
+
+/**
+ * A request body. Text is sent with a Content-Length. A writer is sent with chunked transfer encoding, one piece at
+ * a time as the connection drains, so the whole body never has to be in memory.
+*/
+struct HttpStreamBody
+{
+    HttpStreamBody(std::string text = "") : text(std::move(text)) {}
+    HttpStreamBody(const char* text) : text(text) {}
+    HttpStreamBody(BodyWriter writer) : writer(std::move(writer)) {}
+
+    std::string text;
+    BodyWriter writer;
+};
+
+/**
+ * Send a request and hand the response body to on_data piece by piece, as it arrives.
+ *
+ * drogon's HttpClient only returns complete responses, so this speaks HTTP/1.1 over its own connection. Returning
+ * false from on_data closes the connection on the spot, so the server stops generating.
+ * @param endpoint An id from internal::endpointId()
+ * @param headers Extra headers. Host, Content-Length or Transfer-Encoding, and Connection are set here
+ * @param cancel Closes the connection and throws CancelledError when cancelled
+*/
+drogon::Task<HttpStreamResult> streamRequest(uint32_t endpoint, std::string method, std::string path,
+    std::vector<std::pair<std::string, std::string>> headers, HttpStreamBody body,
+    std::function<bool(std::string_view)> on_data, trantor::EventLoop* loop = nullptr, CancellationToken cancel = {});
+
+/**
+ * Splits a text/event-stream into the data of each event.
+*/
+struct SseParser
+{
+    /**
+     * @param on_event Called with the data of each complete event. Return false to stop
+     * @return false if on_event asked to stop
+    */
+    bool feed(std::string_view bytes, const std::function<bool(std::string_view)>& on_event);
+
+protected:
+    std::string line_;
+    std::string data_;
+    bool has_data_ = false;
+};
+
+}
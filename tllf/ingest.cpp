@@ -0,0 +1,410 @@
+#include "ingest.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <semaphore>
+#include <stdexcept>
+#include <thread>
+
+#include <drogon/HttpAppFramework.h>
+
+using namespace tllf;
+using namespace drogon;
+
+static uint64_t nowMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+size_t TextChunker::splitPrefix(std::string_view text, bool last, std::vector<std::pair<size_t, size_t>>& out) const
+{
+    auto sizeOf = [&](size_t begin, size_t end) { return measure ? measure(text.substr(begin, end - begin)) : end - begin; };
+    // End of the longest prefix of [begin, end) that fits in a chunk, never splitting a UTF-8 character
+    auto hardCut = [&](size_t begin, size_t end) {
+        size_t fits = begin + 1, fails = end;
+        for(size_t step = std::max<size_t>(max_size, 1);; step *= 2) {
+            size_t probe = std::min(end, begin + step);
+            if(sizeOf(begin, probe) > max_size) {
+                fails = probe;
+                break;
+            }
+            if(probe == end)
+                return end;
+            fits = probe;
+        }
+        while(fails - fits > 1) {
+            size_t mid = fits + (fails - fits) / 2;
+            if(sizeOf(begin, mid) <= max_size)
+                fits = mid;
+            else
+                fails = mid;
+        }
+        while(fits > begin + 1 && (static_cast<unsigned char>(text[fits]) & 0xC0) == 0x80)
+            fits--;
+        return fits;
+    };
+
+    size_t start = 0;
+    while(start < text.size() && isSpace(text[start]))
+        start++;
+
+    // (word start, size of the chunk before that word) for every word of the chunk being built
+    std::vector<std::pair<size_t, size_t>> words;
+    while(start < text.size()) {
+        words.clear();
+        size_t pos = start, size = 0, best_break = 0;
+        bool reached_end = false;
+        while(true) {
+            size_t word = pos;
+            while(word < text.size() && isSpace(text[word]))
+                word++;
+            if(word == text.size()) {
+                reached_end = true;
+                break;
+            }
+            size_t word_end = word;
+            while(word_end < text.size() && !isSpace(text[word_end]))
+                word_end++;
+            if(words.empty()) {
+                // A word longer than a whole chunk is cut, even if it continues in the next piece of the stream
+                size_t cut = hardCut(word, word_end);
+                if(cut < word_end) {
+                    pos = cut;
+                    break;
+                }
+            }
+            if(word_end == text.size() && !last) {
+                // The word may continue in the next piece of the stream
+                reached_end = true;
+                break;
+            }
+
+            size_t unit = sizeOf(pos, word_end);
+            if(size + unit > max_size && pos > start)
+                break;
+            words.emplace_back(word, size);
+            size += unit;
+            pos = word_end;
+            // Prefer to end at a sentence or a paragraph once the chunk is half full
+            char c = text[pos - 1];
+            bool sentence = c == '.' || c == '!' || c == '?' || text.substr(pos, 2) == "\n\n";
+            if(sentence && size * 2 >= max_size)
+                best_break = pos;
+        }
+
+        if(reached_end) {
+            if(!last)
+                return start;
+            if(pos > start)
+                out.emplace_back(start, pos - start);
+            return text.size();
+        }
+
+        size_t chunk_end = best_break != 0 ? best_break : pos;
+        out.emplace_back(start, chunk_end - start);
+
+        // Start the next chunk at the earliest word whose distance to the chunk end fits in the overlap
+        size_t end_size = sizeOf(start, chunk_end);
+        size_t next = chunk_end;
+        for(const auto& [word, before] : words) {
+            if(word > start && word < chunk_end && end_size - before <= overlap) {
+                next = word;
+                break;
+            }
+        }
+        start = next;
+        while(start < text.size() && isSpace(text[start]))
+            start++;
+    }
+    return text.size();
+}
+
+std::vector<std::string> TextChunker::split(std::string_view text) const
+{
+    std::vector<std::pair<size_t, size_t>> spans;
+    splitPrefix(text, true, spans);
+    std::vector<std::string> res;
+    res.reserve(spans.size());
+    for(auto [offset, size] : spans)
+        res.emplace_back(text.substr(offset, size));
+    return res;
+}
+
+std::string IngestStats::toString() const
+{
+    auto rate = [](double n, double seconds) { return seconds > 0 ? n / seconds : 0.0; };
+    char buf[512];
+    std::snprintf(buf, sizeof(buf),
+        "read:  %zu docs, %zu bytes, %.1f docs/s (%.1f docs/s per reader)\n"
+        "chunk: %zu chunks, %.1f chunks/s\n"
+        "embed: %zu chunks, %.1f chunks/s (%.1f chunks/s per request)\n"
+        "index: %zu chunks, %.1f chunks/s (%.1f chunks/s while busy)\n"
+        "total: %.2f s",
+        docs, bytes, rate(docs, elapsed_seconds), rate(docs, read_seconds),
+        chunks, rate(chunks, elapsed_seconds),
+        embedded, rate(embedded, elapsed_seconds), rate(embedded, embed_seconds),
+        indexed, rate(indexed, elapsed_seconds), rate(indexed, index_seconds),
+        elapsed_seconds);
+    return buf;
+}
+
+IngestionPipeline::IngestionPipeline(std::shared_ptr<TextEmbedder> embedder, Sink sink, TextChunker chunker, IngestionOptions options)
+    : embedder(std::move(embedder)), sink(std::move(sink)), chunker(std::move(chunker)), options(std::move(options))
+{
+    if(this->options.batch_size == 0 || this->options.max_concurrency == 0 || this->options.queue_capacity == 0)
+        throw std::runtime_error("IngestionPipeline needs a non-zero batch size, concurrency and queue capacity");
+}
+
+IngestStats IngestionPipeline::Counters::snapshot() const
+{
+    IngestStats res;
+    res.docs = docs;
+    res.bytes = bytes;
+    res.chunks = chunks;
+    res.embedded = embedded;
+    res.indexed = indexed;
+    res.read_seconds = read_us / 1e6;
+    res.embed_seconds = embed_us / 1e6;
+    res.index_seconds = index_us / 1e6;
+    uint64_t elapsed = elapsed_us;
+    if(elapsed == 0)
+        elapsed = nowMicros() - start_us;
+    res.elapsed_seconds = elapsed / 1e6;
+    return res;
+}
+
+IngestStats IngestionPipeline::stats() const
+{
+    std::shared_ptr<const Counters> counters;
+    {
+        std::lock_guard lock(counters_mtx_);
+        counters = counters_;
+    }
+    return counters ? counters->snapshot() : IngestStats{};
+}
+
+void IngestionPipeline::readFile(const std::string& path, internal::BoundedQueue<Chunk>& out, Counters& counters)
+{
+    std::ifstream file(path, std::ios::binary);
+    if(!file)
+        throw std::runtime_error("Failed to open " + path);
+
+    // Only the unchunked tail of the file is kept in memory, never the whole file
+    std::string buffer;
+    size_t base = 0;
+    std::vector<std::pair<size_t, size_t>> spans;
+    bool eof = false;
+    while(!eof) {
+        uint64_t start = nowMicros();
+        size_t old_size = buffer.size();
+        buffer.resize(old_size + options.read_block_size);
+        file.read(buffer.data() + old_size, options.read_block_size);
+        buffer.resize(old_size + file.gcount());
+        if(file.bad())
+            throw std::runtime_error("Failed to read " + path);
+        eof = file.eof();
+        counters.bytes += file.gcount();
+
+        spans.clear();
+        size_t consumed = chunker.splitPrefix(buffer, eof, spans);
+        std::vector<Chunk> chunks;
+        chunks.reserve(spans.size());
+        for(auto [offset, size] : spans)
+            chunks.push_back({0, path, base + offset, buffer.substr(offset, size)});
+        buffer.erase(0, consumed);
+        base += consumed;
+        counters.read_us += nowMicros() - start;
+
+        for(auto& chunk : chunks) {
+            if(!out.push(std::move(chunk)))
+                return;
+            counters.chunks++;
+        }
+    }
+    counters.docs++;
+}
+
+namespace
+{
+struct EmbeddedBatch
+{
+    std::vector<Chunk> chunks;
+    EmbeddingMatrix embeddings;
+};
+
+// Shared with the embedding coroutines, which may finish touching it after runSync has stopped waiting
+struct RunState
+{
+    RunState(const IngestionOptions& options)
+        : chunk_queue(options.queue_capacity), embedded_queue(options.max_concurrency), in_flight(options.max_concurrency)
+    {
+    }
+
+    void fail(std::exception_ptr e)
+    {
+        {
+            std::lock_guard lock(error_mtx);
+            if(!error)
+                error = e;
+        }
+        failed = true;
+        chunk_queue.close();
+    }
+
+    internal::BoundedQueue<Chunk> chunk_queue;
+    internal::BoundedQueue<EmbeddedBatch> embedded_queue;
+    // A permit is held from the moment a batch is sent until it is indexed
+    std::counting_semaphore<> in_flight;
+    std::mutex error_mtx;
+    std::exception_ptr error;
+    std::atomic<bool> failed = false;
+};
+}
+
+IngestStats IngestionPipeline::runSync(const std::vector<std::string>& paths)
+{
+    // Each run counts on its own, so concurrent runs don't mix their stats
+    auto counters = std::make_shared<Counters>();
+    counters->start_us = nowMicros();
+    {
+        std::lock_guard lock(counters_mtx_);
+        counters_ = counters;
+    }
+    auto state = std::make_shared<RunState>(options);
+
+    std::atomic<size_t> next_file = 0;
+    const size_t num_readers = std::max<size_t>(options.reader_threads, 1);
+    std::atomic<size_t> readers_left = num_readers;
+    std::vector<std::jthread> readers;
+    for(size_t i = 0; i < num_readers; i++) {
+        readers.emplace_back([&]() {
+            try {
+                for(size_t f = next_file++; f < paths.size() && !state->failed; f = next_file++)
+                    readFile(paths[f], state->chunk_queue, *counters);
+            }
+            catch(...) {
+                state->fail(std::current_exception());
+            }
+            if(--readers_left == 0)
+                state->chunk_queue.close();
+        });
+    }
+
+    std::jthread indexer([&]() {
+        while(auto batch = state->embedded_queue.pop()) {
+            if(!state->failed) {
+                uint64_t start = nowMicros();
+                try {
+                    sink(batch->chunks, batch->embeddings);
+                    counters->indexed += batch->chunks.size();
+                }
+                catch(...) {
+                    state->fail(std::current_exception());
+                }
+                counters->index_us += nowMicros() - start;
+            }
+            state->in_flight.release();
+        }
+    });
+
+    // This thread groups chunks into batches and hands them to the event loops
+    std::vector<trantor::EventLoop*> loops = options.loops;
+    if(loops.empty())
+        loops.push_back(app().getLoop());
+    size_t next_loop = 0;
+    auto dispatch = [&](std::vector<Chunk> chunks) {
+        state->in_flight.acquire();
+        if(state->failed) {
+            state->in_flight.release();
+            return;
+        }
+        for(auto& chunk : chunks)
+            chunk.id = next_id_++;
+        auto loop = loops[next_loop++ % loops.size()];
+        loop->queueInLoop([this, state, counters, chunks = std::move(chunks)]() mutable {
+            async_run([this, state, counters, chunks = std::move(chunks)]() mutable -> Task<> {
+                uint64_t start = nowMicros();
+                try {
+                    std::vector<std::string> texts;
+                    texts.reserve(chunks.size());
+                    for(const auto& chunk : chunks)
+                        texts.push_back(chunk.text);
+                    auto embeddings = co_await embedder->embedMatrix(std::move(texts));
+                    if(embeddings.rows() != chunks.size())
+                        throw std::runtime_error("Embedder returned " + std::to_string(embeddings.rows()) + " embeddings for " + std::to_string(chunks.size()) + " chunks");
+                    counters->embed_us += nowMicros() - start;
+                    counters->embedded += chunks.size();
+                    // Never blocks: the queue holds as many batches as there are permits
+                    if(state->embedded_queue.push({std::move(chunks), std::move(embeddings)}))
+                        co_return;
+                }
+                catch(...) {
+                    state->fail(std::current_exception());
+                }
+                state->in_flight.release();
+            });
+        });
+    };
+
+    std::vector<Chunk> batch;
+    while(auto chunk = state->chunk_queue.pop()) {
+        batch.push_back(std::move(*chunk));
+        if(batch.size() >= options.batch_size)
+            dispatch(std::exchange(batch, {}));
+    }
+    if(!batch.empty())
+        dispatch(std::move(batch));
+
+    // Taking every permit means every batch was indexed or dropped
+    for(size_t i = 0; i < options.max_concurrency; i++)
+        state->in_flight.acquire();
+    state->embedded_queue.close();
+    indexer.join();
+    readers.clear();
+
+    counters->elapsed_us = nowMicros() - counters->start_us;
+    if(state->error)
+        std::rethrow_exception(state->error);
+    return counters->snapshot();
+}
+
+namespace
+{
+struct RunAwaiter : public CallbackAwaiter<IngestStats>
+{
+    RunAwaiter(IngestionPipeline* pipeline, std::vector<std::string> paths) : pipeline(pipeline), paths(std::move(paths)) {}
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        auto caller_loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+        // The stages block, so they get a thread of their own. The caller is resumed on its loop
+        std::thread([this, handle, caller_loop]() {
+            try {
+                setValue(pipeline->runSync(paths));
+            }
+            catch(...) {
+                setException(std::current_exception());
+            }
+            if(caller_loop != nullptr)
+                caller_loop->queueInLoop([handle]() { handle.resume(); });
+            else
+                handle.resume();
+        }).detach();
+    }
+
+    IngestionPipeline* pipeline;
+    std::vector<std::string> paths;
+};
+}
+
+Task<IngestStats> IngestionPipeline::run(std::vector<std::string> paths)
+{
+    co_return co_await RunAwaiter(this, std::move(paths));
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <drogon/utils/coroutine.h>
+#include <trantor/net/EventLoop.h>
+
+#include <tllf/tllf.hpp>
+
+namespace tllf
+{
+
+/**
+ * Splits text into overlapping chunks at word boundaries, preferring to end a chunk at a sentence or paragraph.
+ *
+ * @param max_size Maximum chunk size. A single word longer than this is cut into pieces of at most this size
+ * @param overlap How much of the end of a chunk is repeated at the start of the next
+ * @param measure Size of a piece of text, e.g. a tokenizer's token count. Defaults to the number of bytes
+*/
+struct TextChunker
+{
+    TextChunker(size_t max_size = 1000, size_t overlap = 200, std::function<size_t(std::string_view)> measure = {})
+        : max_size(max_size), overlap(overlap), measure(std::move(measure))
+    {
+    }
+
+    std::vector<std::string> split(std::string_view text) const;
+
+    /**
+     * Chunk as much of a stream as is known to be final.
+     * @param out Receives (offset, size) of each chunk
+     * @param last Whether text ends the stream. If not, the trailing partial chunk is left for the next call
+     * @return Offset where the unconsumed remainder starts. Prepend it to the next piece of the stream
+    */
+    size_t splitPrefix(std::string_view text, bool last, std::vector<std::pair<size_t, size_t>>& out) const;
+
+    size_t max_size;
+    size_t overlap;
+    std::function<size_t(std::string_view)> measure;
+};
+
+struct Chunk
+{
+    uint64_t id;        // Unique among the chunks of a pipeline, across runs
+    std::string source; // The file it was read from
+    size_t offset;      // Byte offset in the source
+    std::string text;
+};
+
+struct IngestStats
+{
+    size_t docs = 0;
+    size_t bytes = 0;
+    size_t chunks = 0;
+    size_t embedded = 0;
+    size_t indexed = 0;
+    // Time spent working in each stage, summed over its threads or requests
+    double read_seconds = 0;
+    double embed_seconds = 0;
+    double index_seconds = 0;
+    double elapsed_seconds = 0;
+
+    /**
+     * One line per stage with its count and rate.
+    */
+    std::string toString() const;
+};
+
+struct IngestionOptions
+{
+    size_t reader_threads = 2;
+    size_t queue_capacity = 1024;   // Chunks waiting to be embedded. Readers block when it is full
+    size_t batch_size = 64;         // Chunks per embedding request
+    size_t max_concurrency = 4;     // Embedding requests in flight or waiting to be indexed
+    size_t read_block_size = 1 << 20;
+    std::vector<trantor::EventLoop*> loops; // Loops running the embedding requests. Defaults to drogon's main loop
+};
+
+namespace internal
+{
+/**
+ * Blocking multi-producer multi-consumer queue with a fixed capacity.
+*/
+template <typename T>
+struct BoundedQueue
+{
+    BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+    /**
+     * Wait for space, then add item.
+     * @return false if the queue was closed
+    */
+    bool push(T item)
+    {
+        std::unique_lock lock(mtx_);
+        not_full_.wait(lock, [&]() { return closed_ || items_.size() < capacity_; });
+        if(closed_)
+            return false;
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /**
+     * Wait for an item.
+     * @return Nothing once the queue is closed and drained
+    */
+    std::optional<T> pop()
+    {
+        std::unique_lock lock(mtx_);
+        not_empty_.wait(lock, [&]() { return closed_ || !items_.empty(); });
+        if(items_.empty())
+            return std::nullopt;
+        T item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return item;
+    }
+
+    void close()
+    {
+        std::lock_guard lock(mtx_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+protected:
+    size_t capacity_;
+    std::deque<T> items_;
+    bool closed_ = false;
+    std::mutex mtx_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+}
+
+/**
+ * Reads files, chunks them, embeds the chunks and hands them to an index, with every stage running concurrently.
+ *
+ * Reader threads stream files in blocks and chunk them into a bounded queue. A dispatcher groups chunks into
+ * batches and sends them to the embedder on the configured event loops, with at most max_concurrency batches
+ * between being sent and being indexed. A single thread passes finished batches to the sink, so the sink does not
+ * need to be thread safe. Full queues stall the stages before them, so memory stays flat for any corpus size.
+ *
+ * @param embedder Wrap it in a BatchingTextEmbedder or CachingTextEmbedder as needed
+ * @param sink Receives each batch of chunks with one embedding row per chunk, e.g. to call FlatIndex::add
+*/
+struct IngestionPipeline
+{
+    using Sink = std::function<void(std::vector<Chunk>& chunks, const EmbeddingMatrix& embeddings)>;
+
+    IngestionPipeline(std::shared_ptr<TextEmbedder> embedder, Sink sink, TextChunker chunker = {}, IngestionOptions options = {});
+
+    /**
+     * Ingest the files and resume once every chunk is indexed.
+     * @note The first error from any stage stops the pipeline and is rethrown
+    */
+    drogon::Task<IngestStats> run(std::vector<std::string> paths);
+    /**
+     * Blocking version of run(). Must not be called from one of the event loops doing the embedding.
+    */
+    IngestStats runSync(const std::vector<std::string>& paths);
+
+    /**
+     * Progress of the latest run. Safe to call from any thread.
+     * @note Concurrent runs count separately, each run() returns the stats of its own files
+    */
+    IngestStats stats() const;
+
+    std::shared_ptr<TextEmbedder> embedder;
+    Sink sink;
+    TextChunker chunker;
+    IngestionOptions options;
+
+protected:
+    struct Counters
+    {
+        std::atomic<size_t> docs = 0;
+        std::atomic<size_t> bytes = 0;
+        std::atomic<size_t> chunks = 0;
+        std::atomic<size_t> embedded = 0;
+        std::atomic<size_t> indexed = 0;
+        std::atomic<uint64_t> read_us = 0;
+        std::atomic<uint64_t> embed_us = 0;
+        std::atomic<uint64_t> index_us = 0;
+        std::atomic<uint64_t> elapsed_us = 0;
+        uint64_t start_us = 0;
+
+        IngestStats snapshot() const;
+    };
+
+    void readFile(const std::string& path, internal::BoundedQueue<Chunk>& out, Counters& counters);
+
+    mutable std::mutex counters_mtx_;
+    std::shared_ptr<const Counters> counters_;
+    // Chunk ids stay unique across runs
+    std::atomic<uint64_t> next_id_ = 0;
+};
+
+}
@@ -1,24 +1,75 @@
-#include <nlohmann/json.hpp>
-#include <optional>
+#pragma once
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+#include <glaze/json/generic.hpp>
+#include <glaze/json/read.hpp>
 #include <yaml-cpp/yaml.h>
 
 namespace tllf::internal
 {
-inline void json2yaml_internal(YAML::Node& node, const nlohmann::json& json)
+/**
+ * What a plain YAML scalar is in JSON: a boolean, an integer, a finite number, or a string (monostate).
+ * Numbers are parsed with from_chars, so strings that are not numbers cost nothing and never throw.
+*/
+using YamlScalar = std::variant<std::monostate, bool, int64_t, double>;
+
+inline YamlScalar classifyYamlScalar(std::string_view str)
+{
+    if(str == "true")
+        return true;
+    if(str == "false")
+        return false;
+    if(str.empty())
+        return std::monostate{};
+    char c = str.front();
+    if(!(c >= '0' && c <= '9') && c != '-' && c != '.')
+        return std::monostate{};
+
+    const char* end = str.data() + str.size();
+    int64_t i;
+    auto [iptr, iec] = std::from_chars(str.data(), end, i);
+    if(iec == std::errc() && iptr == end)
+        return i;
+    double d;
+    auto [dptr, dec] = std::from_chars(str.data(), end, d);
+    if(dec == std::errc() && dptr == end && std::isfinite(d))
+        return d;
+    return std::monostate{};
+}
+
+// Quoted scalars ("123", 'true') are always strings
+inline bool isQuotedYamlScalar(const YAML::Node& node)
+{
+    return node.Tag() == "!";
+}
+
+inline void json2yaml_internal(YAML::Node& node, const glz::generic& json)
 {
     if(json.is_null())
         node = YAML::Node();
     else if(json.is_boolean())
-        node = json.get<bool>();
-    else if(json.is_number_integer())
-        node = json.get<int>();
-    else if(json.is_number_float())
-        node = json.get<double>();
+        node = json.get_boolean();
+    else if(json.is_number()) {
+        double val = json.get_number();
+        // Whole numbers are written without a fraction, as the integers they most likely were
+        if(val == std::floor(val) && std::abs(val) < 9007199254740992.0)
+            node = int64_t(val);
+        else
+            node = val;
+    }
     else if(json.is_string())
-        node = json.get<std::string>();
+        node = json.get_string();
     else if(json.is_array()) {
         node = YAML::Node(YAML::NodeType::Sequence);
-        for(auto& child : json)
+        for(const auto& child : json.get_array())
         {
             YAML::Node child_node;
             json2yaml_internal(child_node, child);
@@ -27,7 +78,7 @@ inline void json2yaml_internal(YAML::Node& node, const nlohmann::json& json)
     }
     else if(json.is_object()) {
         node = YAML::Node(YAML::NodeType::Map);
-        for(auto& [key, val] : json.items())
+        for(const auto& [key, val] : json.get_object())
         {
             YAML::Node child_node;
             json2yaml_internal(child_node, val);
@@ -39,86 +90,137 @@ inline void json2yaml_internal(YAML::Node& node, const nlohmann::json& json)
     }
 }
 
-inline YAML::Node json2yaml(const nlohmann::json& json)
+inline YAML::Node json2yaml(const glz::generic& json)
 {
     YAML::Node node;
     json2yaml_internal(node, json);
     return node;
 }
 
-static std::optional<double> try_stod(const std::string& str)
+inline YAML::Node json2yaml(std::string_view json)
 {
-    try {
-        size_t pos;
-        double val = std::stod(str, &pos);
-        if(pos == str.size())
-            return val;
-    }
-    catch(...) {}
-    return std::nullopt;
+    glz::generic data;
+    auto ec = glz::read_json(data, json);
+    if(ec)
+        throw std::runtime_error("Failed to parse JSON: " + glz::format_error(ec, json));
+    return json2yaml(data);
 }
 
-static std::optional<int> try_stoi(const std::string& str)
+inline void yaml2json_internal(glz::generic& json, const YAML::Node& node)
 {
-    try {
-        size_t pos;
-        int val = std::stoi(str, &pos);
-        if(pos == str.size())
-            return val;
+    if(node.IsNull())
+        json.data = nullptr;
+    else if(node.IsScalar()) {
+        const std::string& str = node.Scalar();
+        YamlScalar val = isQuotedYamlScalar(node) ? YamlScalar{} : classifyYamlScalar(str);
+        if(const bool* b = std::get_if<bool>(&val))
+            json.data = *b;
+        else if(const int64_t* i = std::get_if<int64_t>(&val))
+            json.data = double(*i);
+        else if(const double* d = std::get_if<double>(&val))
+            json.data = *d;
+        else
+            json.data = str;
+    }
+    else if(node.IsSequence()) {
+        auto& array = json.data.emplace<glz::generic::array_t>();
+        array.reserve(node.size());
+        for(const auto& child : node)
+            yaml2json_internal(array.emplace_back(), child);
+    }
+    else if(node.IsMap()) {
+        auto& object = json.data.emplace<glz::generic::object_t>();
+        for(const auto& n : node)
+            yaml2json_internal(object[n.first.Scalar()], n.second);
+    }
+    else {
+        throw std::runtime_error("Unknown yaml type");
     }
-    catch(...) {}
-    return std::nullopt;
 }
 
-static std::optional<bool> try_stob(const std::string& str)
+inline glz::generic yaml2json(const YAML::Node& node)
 {
-    if(str == "true")
-        return true;
-    if(str == "false")
-        return false;
-    return std::nullopt;
+    glz::generic json;
+    yaml2json_internal(json, node);
+    return json;
 }
 
-inline void yaml2json_internal(nlohmann::json& json, const YAML::Node& node)
+inline void appendJsonString(std::string& out, std::string_view str)
 {
-    if(node.IsScalar()) {
-        if(auto val = try_stob(node.as<std::string>()))
-            json = *val;
-        else if(auto val = try_stod(node.as<std::string>()))
-            json = *val;
-        else if(auto val = try_stoi(node.as<std::string>()))
-            json = *val;
+    out.push_back('"');
+    for(char ch : str) {
+        switch(ch) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        default:
+            if((unsigned char)ch < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)ch);
+                out += buf;
+            }
+            else
+                out.push_back(ch);
+        }
+    }
+    out.push_back('"');
+}
+
+/**
+ * Write a YAML node as JSON text straight into out, without building an intermediate JSON tree.
+*/
+inline void yaml2json(const YAML::Node& node, std::string& out)
+{
+    if(node.IsNull())
+        out += "null";
+    else if(node.IsScalar()) {
+        const std::string& str = node.Scalar();
+        YamlScalar val = isQuotedYamlScalar(node) ? YamlScalar{} : classifyYamlScalar(str);
+        char buf[32];
+        if(const bool* b = std::get_if<bool>(&val))
+            out += *b ? "true" : "false";
+        else if(const int64_t* i = std::get_if<int64_t>(&val))
+            out.append(buf, std::to_chars(buf, buf + sizeof(buf), *i).ptr);
+        else if(const double* d = std::get_if<double>(&val))
+            out.append(buf, std::to_chars(buf, buf + sizeof(buf), *d).ptr);
         else
-            json = node.as<std::string>();
+            appendJsonString(out, str);
     }
     else if(node.IsSequence()) {
-        json = nlohmann::json::array();
-        for(auto& child : node)
-        {
-            nlohmann::json child_json;
-            yaml2json_internal(child_json, child);
-            json.push_back(child_json);
+        out.push_back('[');
+        bool first = true;
+        for(const auto& child : node) {
+            if(!std::exchange(first, false))
+                out.push_back(',');
+            yaml2json(child, out);
         }
+        out.push_back(']');
     }
     else if(node.IsMap()) {
-        json = nlohmann::json::object();
-        for(auto& n : node)
-        {
-            std::string key = n.first.as<std::string>();
-            nlohmann::json child_json;
-            yaml2json_internal(child_json, n.second);
-            json[key] = child_json;
+        out.push_back('{');
+        bool first = true;
+        for(const auto& n : node) {
+            if(!std::exchange(first, false))
+                out.push_back(',');
+            appendJsonString(out, n.first.Scalar());
+            out.push_back(':');
+            yaml2json(n.second, out);
         }
+        out.push_back('}');
     }
     else {
         throw std::runtime_error("Unknown yaml type");
     }
 }
 
-inline nlohmann::json yaml2json(const YAML::Node& node)
+inline std::string yaml2jsonString(const YAML::Node& node)
 {
-    nlohmann::json json;
-    yaml2json_internal(json, node);
-    return json;
+    std::string out;
+    yaml2json(node, out);
+    return out;
+}
 }
-}
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "load_balancer.hpp"
+
+#include <stdexcept>
+
+using namespace tllf;
+using namespace drogon;
+
+BalancedLLM::BalancedLLM(std::vector<std::shared_ptr<LLM>> backends, Policy policy)
+    : policy(policy)
+{
+    if(backends.empty())
+        throw std::runtime_error("BalancedLLM needs at least one backend");
+    backends_.reserve(backends.size());
+    for(auto& llm : backends)
+        backends_.push_back(Backend{.llm = std::move(llm)});
+}
+
+std::vector<BalancedLLM::BackendStats> BalancedLLM::stats() const
+{
+    std::lock_guard lock(mtx_);
+    auto now = Clock::now();
+    std::vector<BackendStats> res;
+    res.reserve(backends_.size());
+    for(const auto& b : backends_) {
+        res.push_back(BackendStats{
+            .outstanding = b.outstanding,
+            .requests = b.requests,
+            .failures = b.failures,
+            .latency_ms = b.latency_ms,
+            .available = b.unavailable_until <= now
+        });
+    }
+    return res;
+}
+
+size_t BalancedLLM::acquire()
+{
+    std::lock_guard lock(mtx_);
+    const size_t n = backends_.size();
+    auto now = Clock::now();
+    size_t best = n;
+    double best_cost = 0;
+    // Start after the last pick so ties take turns
+    for(size_t k = 0; k < n; k++) {
+        size_t i = (next_ + k) % n;
+        const auto& b = backends_[i];
+        if(b.unavailable_until > now)
+            continue;
+        // Backends without a measurement yet look fast, so each gets tried early
+        double cost = policy == Policy::LeastOutstanding ? double(b.outstanding) : (b.latency_ms + 1) * (b.outstanding + 1);
+        if(best == n || cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+    if(best == n) {
+        best = 0;
+        for(size_t i = 1; i < n; i++) {
+            if(backends_[i].unavailable_until < backends_[best].unavailable_until)
+                best = i;
+        }
+    }
+    next_ = (best + 1) % n;
+    backends_[best].outstanding++;
+    return best;
+}
+
+void BalancedLLM::release(size_t backend, Clock::time_point start, std::exception_ptr error)
+{
+    std::lock_guard lock(mtx_);
+    auto& b = backends_[backend];
+    auto now = Clock::now();
+    b.outstanding--;
+    b.requests++;
+    if(!error) {
+        double ms = std::chrono::duration<double, std::milli>(now - start).count();
+        b.latency_ms = b.latency_ms == 0 ? ms : ewma_alpha * ms + (1 - ewma_alpha) * b.latency_ms;
+        b.consecutive_failures = 0;
+        return;
+    }
+
+    try {
+        std::rethrow_exception(error);
+    }
+    catch(const CancelledError&) {
+        // The caller gave up. Nothing wrong with the backend
+        return;
+    }
+    catch(const RateLimitError& e) {
+        b.failures++;
+        // Being rate limited says nothing about health. Just wait for the reset
+        double wait_ms = e.until_reset_ms.value_or(2000);
+        b.unavailable_until = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(wait_ms));
+        return;
+    }
+    catch(...) {
+    }
+    b.failures++;
+    if(++b.consecutive_failures >= max_failures) {
+        b.unavailable_until = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(drain_seconds));
+        b.consecutive_failures = 0;
+    }
+}
+
+Task<std::string> BalancedLLM::generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools)
+{
+    const size_t mark = history.size();
+    auto emitted = internal::watchEmitted(config);
+    std::exception_ptr error;
+    for(size_t attempt = 0; attempt < backends_.size(); attempt++) {
+        size_t i = acquire();
+        auto start = Clock::now();
+        try {
+            auto reply = co_await generateWith(*backends_[i].llm, history, config, tools);
+            release(i, start, nullptr);
+            co_return reply;
+        }
+        catch(...) {
+            error = std::current_exception();
+        }
+        release(i, start, error);
+        // Drop whatever the failed attempt left behind, like half a tool loop
+        history.erase(history.begin() + mark, history.end());
+        if(config.cancel.cancelled() || *emitted)
+            std::rethrow_exception(error);
+    }
+    std::rethrow_exception(error);
+}
+
+Task<std::vector<std::string>> BalancedLLM::sampleImpl(const Chatlog& history, size_t n, TextGenerationConfig config)
+{
+    auto emitted = internal::watchEmitted(config);
+    std::exception_ptr error;
+    for(size_t attempt = 0; attempt < backends_.size(); attempt++) {
+        size_t i = acquire();
+        auto start = Clock::now();
+        try {
+            auto samples = co_await sampleWith(*backends_[i].llm, history, n, config);
+            release(i, start, nullptr);
+            co_return samples;
+        }
+        catch(...) {
+            error = std::current_exception();
+        }
+        release(i, start, error);
+        if(config.cancel.cancelled() || *emitted)
+            std::rethrow_exception(error);
+    }
+    std::rethrow_exception(error);
+}
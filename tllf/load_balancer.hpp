@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <drogon/utils/coroutine.h>
+
+#include <tllf/tllf.hpp>
+
+namespace tllf
+{
+
+/**
+ * Spreads requests over several equivalent backends, e.g. OpenAIConnectors for different replicas or API keys.
+ *
+ * Each request goes to the available backend with the fewest requests in flight, or with the lowest expected
+ * wait (EWMA latency times requests in flight). A request that fails is tried once on each other backend before
+ * the error reaches the caller, unless on_text already received part of the reply. A rate limited backend gets no
+ * traffic until its limit resets, and one that fails max_failures times in a row is drained for drain_seconds.
+ * Health is only judged from real traffic.
+ * @note If every backend is drained, requests go to the one that comes back first
+*/
+struct BalancedLLM : public LLM
+{
+    enum class Policy
+    {
+        LeastOutstanding,
+        Latency
+    };
+
+    struct BackendStats
+    {
+        size_t outstanding = 0;
+        size_t requests = 0;
+        size_t failures = 0;
+        double latency_ms = 0;  // EWMA of successful requests. 0 until the first one
+        bool available = true;  // Not drained or rate limited
+    };
+
+    BalancedLLM(std::vector<std::shared_ptr<LLM>> backends, Policy policy = Policy::LeastOutstanding);
+
+    std::vector<BackendStats> stats() const;
+
+    Policy policy;
+    double ewma_alpha = 0.2;
+    size_t max_failures = 3;
+    double drain_seconds = 30;
+
+protected:
+    using Clock = std::chrono::steady_clock;
+
+    drogon::Task<std::string> generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools = {}) override;
+    drogon::Task<std::vector<std::string>> sampleImpl(const Chatlog& history, size_t n, TextGenerationConfig config) override;
+
+    // Pick the backend for the next request and count it as in flight
+    size_t acquire();
+    void release(size_t backend, Clock::time_point start, std::exception_ptr error);
+
+    struct Backend
+    {
+        std::shared_ptr<LLM> llm;
+        size_t outstanding = 0;
+        size_t requests = 0;
+        size_t failures = 0;
+        size_t consecutive_failures = 0;
+        double latency_ms = 0;
+        Clock::time_point unavailable_until;
+    };
+
+    mutable std::mutex mtx_;
+    std::vector<Backend> backends_;
+    size_t next_ = 0;
+};
+
+}
@@ -0,0 +1,83 @@
+#include "matrix.hpp"
+
+#include <charconv>
+
+using namespace tllf;
+
+namespace
+{
+struct JsonCursor
+{
+    const char* ptr;
+    const char* end;
+
+    void skipWs()
+    {
+        while(ptr != end && (*ptr == ' ' || *ptr == '\n' || *ptr == '\r' || *ptr == '\t'))
+            ptr++;
+    }
+
+    // Consume ch if it is the next non-whitespace character
+    bool consume(char ch)
+    {
+        skipWs();
+        if(ptr == end || *ptr != ch)
+            return false;
+        ptr++;
+        return true;
+    }
+
+    void expect(char ch)
+    {
+        if(!consume(ch))
+            throw std::runtime_error(std::string("Malformed embedding array. Expected '") + ch + "'");
+    }
+
+    float number()
+    {
+        skipWs();
+        float val;
+        auto [p, ec] = std::from_chars(ptr, end, val);
+        if(ec != std::errc())
+            throw std::runtime_error("Malformed embedding array. Expected a number");
+        ptr = p;
+        return val;
+    }
+};
+}
+
+void internal::parseJsonMatrix(std::string_view json, EmbeddingMatrix& out)
+{
+    JsonCursor cur{json.data(), json.data() + json.size()};
+    out = EmbeddingMatrix();
+    cur.expect('[');
+    if(cur.consume(']'))
+        return;
+
+    // The first row decides the dimension. Later rows are parsed in place
+    std::vector<float> first;
+    cur.expect('[');
+    if(!cur.consume(']')) {
+        do {
+            first.push_back(cur.number());
+        } while(cur.consume(','));
+        cur.expect(']');
+    }
+    out.append(first);
+
+    const size_t dim = out.dim();
+    while(cur.consume(',')) {
+        cur.expect('[');
+        size_t row = out.rows();
+        out.resize(row + 1);
+        float* ptr = out.row(row);
+        for(size_t i = 0; i < dim; i++) {
+            if(i != 0 && !cur.consume(','))
+                throw std::runtime_error("Embedding " + std::to_string(row) + " is shorter than " + std::to_string(dim));
+            ptr[i] = cur.number();
+        }
+        if(!cur.consume(']'))
+            throw std::runtime_error("Embedding " + std::to_string(row) + " is longer than " + std::to_string(dim));
+    }
+    cur.expect(']');
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace tllf
+{
+
+template <typename T, size_t Alignment>
+struct AlignedAllocator
+{
+    using value_type = T;
+    template <typename U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment))); }
+    void deallocate(T* ptr, size_t) { ::operator delete(ptr, std::align_val_t(Alignment)); }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+};
+
+/**
+ * Embeddings stored as one contiguous, 64 byte aligned, row-major buffer. One row per text.
+*/
+struct EmbeddingMatrix
+{
+    EmbeddingMatrix() = default;
+    EmbeddingMatrix(size_t rows, size_t dim) : data_(rows * dim), rows_(rows), dim_(dim) {}
+
+    size_t rows() const { return rows_; }
+    size_t dim() const { return dim_; }
+    bool empty() const { return rows_ == 0; }
+
+    float* data() { return data_.data(); }
+    const float* data() const { return data_.data(); }
+    float* row(size_t i) { return data_.data() + i * dim_; }
+    const float* row(size_t i) const { return data_.data() + i * dim_; }
+    std::span<const float> operator[](size_t i) const { return {row(i), dim_}; }
+
+    void reserve(size_t rows) { data_.reserve(rows * dim_); }
+    void resize(size_t rows) { data_.resize(rows * dim_); rows_ = rows; }
+
+    /**
+     * Append a row. The first row of an empty matrix sets the dimension.
+    */
+    void append(std::span<const float> vec)
+    {
+        if(rows_ == 0 && dim_ == 0)
+            dim_ = vec.size();
+        if(vec.size() != dim_)
+            throw std::runtime_error("Embedding has dimension " + std::to_string(vec.size()) + ", expected " + std::to_string(dim_));
+        data_.insert(data_.end(), vec.begin(), vec.end());
+        rows_++;
+    }
+
+    void append(const EmbeddingMatrix& other)
+    {
+        if(other.empty())
+            return;
+        if(rows_ == 0 && dim_ == 0)
+            dim_ = other.dim_;
+        if(other.dim_ != dim_)
+            throw std::runtime_error("Embedding has dimension " + std::to_string(other.dim_) + ", expected " + std::to_string(dim_));
+        data_.insert(data_.end(), other.data_.begin(), other.data_.end());
+        rows_ += other.rows_;
+    }
+
+    std::vector<std::vector<float>> toVectors() const
+    {
+        std::vector<std::vector<float>> res;
+        res.reserve(rows_);
+        for(size_t i = 0; i < rows_; i++)
+            res.emplace_back(row(i), row(i) + dim_);
+        return res;
+    }
+
+    static EmbeddingMatrix fromVectors(const std::vector<std::vector<float>>& vecs)
+    {
+        EmbeddingMatrix res;
+        if(!vecs.empty()) {
+            res.dim_ = vecs[0].size();
+            res.reserve(vecs.size());
+        }
+        for(const auto& vec : vecs)
+            res.append(vec);
+        return res;
+    }
+
+protected:
+    std::vector<float, AlignedAllocator<float, 64>> data_;
+    size_t rows_ = 0;
+    size_t dim_ = 0;
+};
+
+namespace internal
+{
+/**
+ * Parse a JSON array of equally sized number arrays straight into a matrix.
+*/
+void parseJsonMatrix(std::string_view json, EmbeddingMatrix& out);
+}
+
+}
@@ -0,0 +1,190 @@
+#include "partial_json.hpp"
+
+using namespace tllf;
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+static bool isScalarChar(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '+' || c == '.';
+}
+
+// Append a key as a JSON pointer segment: unescaped, with ~ and / escaped as ~0 and ~1
+static void appendSegment(std::string& path, std::string_view key)
+{
+    path.push_back('/');
+    for(size_t i = 0; i < key.size(); i++) {
+        char c = key[i];
+        if(c == '\\' && i + 1 < key.size()) {
+            c = key[++i];
+            switch(c) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'u':
+                // Rare in keys. Kept escaped
+                path += "\\u";
+                continue;
+            }
+        }
+        if(c == '~')
+            path += "~0";
+        else if(c == '/')
+            path += "~1";
+        else
+            path.push_back(c);
+    }
+}
+
+static bool pathMatches(std::string_view pattern, std::string_view path)
+{
+    while(!pattern.empty() && !path.empty()) {
+        // Both start with a /
+        size_t p = pattern.find('/', 1);
+        size_t q = path.find('/', 1);
+        auto seg_pattern = pattern.substr(1, p == std::string_view::npos ? p : p - 1);
+        auto seg_path = path.substr(1, q == std::string_view::npos ? q : q - 1);
+        if(seg_pattern != "*" && seg_pattern != seg_path)
+            return false;
+        pattern = p == std::string_view::npos ? std::string_view() : pattern.substr(p);
+        path = q == std::string_view::npos ? std::string_view() : path.substr(q);
+    }
+    return pattern.empty() && path.empty();
+}
+
+void PartialJsonParser::on(std::string path, Callback func)
+{
+    listeners_.emplace_back(std::move(path), std::move(func));
+}
+
+void PartialJsonParser::reset()
+{
+    buffer_.clear();
+    pos_ = 0;
+    root_ = std::string::npos;
+    end_ = std::string::npos;
+    stack_.clear();
+    token_ = Token::None;
+    escape_ = false;
+    key_ = false;
+    done_ = false;
+}
+
+void PartialJsonParser::buildPath()
+{
+    path_.clear();
+    for(const auto& frame : stack_) {
+        if(frame.type == '{')
+            appendSegment(path_, frame.key);
+        else {
+            path_.push_back('/');
+            path_ += std::to_string(frame.index);
+        }
+    }
+}
+
+void PartialJsonParser::complete(JsonEvent::Kind kind, size_t begin, size_t end)
+{
+    if(stack_.empty()) {
+        done_ = true;
+        end_ = end;
+    }
+    if(!on_value && listeners_.empty())
+        return;
+    buildPath();
+    JsonEvent event{kind, path_, std::string_view(buffer_).substr(begin, end - begin)};
+    if(on_value)
+        on_value(event);
+    for(const auto& [pattern, func] : listeners_) {
+        if(pathMatches(pattern, path_))
+            func(event);
+    }
+}
+
+void PartialJsonParser::feed(std::string_view chunk)
+{
+    buffer_ += chunk;
+    for(; pos_ < buffer_.size() && !done_; pos_++) {
+        char c = buffer_[pos_];
+        if(token_ == Token::String) {
+            if(escape_)
+                escape_ = false;
+            else if(c == '\\')
+                escape_ = true;
+            else if(c == '"') {
+                token_ = Token::None;
+                if(key_)
+                    stack_.back().key.assign(buffer_, token_start_ + 1, pos_ - token_start_ - 1);
+                else
+                    complete(JsonEvent::Kind::String, token_start_, pos_ + 1);
+            }
+            continue;
+        }
+        if(token_ == Token::Scalar) {
+            if(isScalarChar(c))
+                continue;
+            token_ = Token::None;
+            char first = buffer_[token_start_];
+            auto kind = first == 't' || first == 'f' ? JsonEvent::Kind::Bool : first == 'n' ? JsonEvent::Kind::Null : JsonEvent::Kind::Number;
+            complete(kind, token_start_, pos_);
+        }
+
+        if(root_ == std::string::npos) {
+            // Skip whatever comes before the value
+            if(c != '{' && c != '[')
+                continue;
+            root_ = pos_;
+        }
+        switch(c) {
+        case '"':
+            token_ = Token::String;
+            token_start_ = pos_;
+            key_ = !stack_.empty() && stack_.back().expect_key;
+            if(key_)
+                stack_.back().expect_key = false;
+            break;
+        case '{':
+        case '[':
+            stack_.push_back({c, pos_});
+            stack_.back().expect_key = c == '{';
+            break;
+        case '}':
+        case ']': {
+            if(stack_.empty())
+                break;
+            size_t start = stack_.back().start;
+            stack_.pop_back();
+            complete(c == '}' ? JsonEvent::Kind::Object : JsonEvent::Kind::Array, start, pos_ + 1);
+            break;
+        }
+        case ',':
+            if(!stack_.empty()) {
+                if(stack_.back().type == '{')
+                    stack_.back().expect_key = true;
+                else
+                    stack_.back().index++;
+            }
+            break;
+        case ':':
+            break;
+        default:
+            if(!isSpace(c)) {
+                token_ = Token::Scalar;
+                token_start_ = pos_;
+            }
+        }
+    }
+}
+
+std::optional<glz::generic> PartialJsonParser::partial() const
+{
+    glz::generic value;
+    if(partial(value))
+        return value;
+    return std::nullopt;
+}
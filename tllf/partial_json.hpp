@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <glaze/json/generic.hpp>
+#include <glaze/json/read.hpp>
+
+#include <tllf/structured.hpp>
+
+namespace tllf
+{
+
+/**
+ * A value that has just been completely received.
+*/
+struct JsonEvent
+{
+    enum class Kind
+    {
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object
+    };
+
+    Kind kind;
+    std::string_view path;  // JSON pointer, e.g. /items/0/name. Empty for the top level value
+    std::string_view raw;   // The value's JSON text. Only valid during the callback
+
+    /**
+     * Parse the value into T.
+    */
+    template <typename T>
+    T as() const
+    {
+        T value{};
+        // raw is a slice of a larger buffer
+        auto ec = glz::read<glz::opts{.null_terminated = false, .error_on_unknown_keys = false}>(value, raw);
+        if(ec)
+            throw std::runtime_error("Failed to parse " + std::string(path) + ": " + glz::format_error(ec, raw));
+        return value;
+    }
+};
+
+/**
+ * Incremental JSON parser for output that arrives in pieces, such as streamed content or tool call arguments.
+ *
+ * Chunks may split the text anywhere, including inside strings and escapes. Each byte is scanned once, and an
+ * event fires as soon as a value is complete, so work can start on a field before the rest of the document has
+ * arrived. The top level value must be an object or an array. Text around it, such as a Markdown fence, is skipped.
+ *
+ * @code
+ * PartialJsonParser parser;
+ * parser.on<std::string>("/query", [&](std::string query) { startSearch(query); });
+ * for(auto chunk : chunks) parser.feed(chunk);
+ * @endcode
+*/
+struct PartialJsonParser
+{
+    using Callback = std::function<void(const JsonEvent&)>;
+
+    PartialJsonParser(Callback on_value = {}) : on_value(std::move(on_value)) {}
+
+    void feed(std::string_view chunk);
+    void reset();
+
+    /**
+     * Call func whenever a value at path completes. A segment of just * matches every key or index.
+    */
+    void on(std::string path, Callback func);
+    template <typename T, typename Func>
+    void on(std::string path, Func&& func)
+    {
+        on(std::move(path), [func = std::forward<Func>(func)](const JsonEvent& event) { func(event.template as<T>()); });
+    }
+
+    // Whether the top level value is complete
+    bool done() const { return done_; }
+    // Everything fed so far
+    const std::string& text() const { return buffer_; }
+
+    /**
+     * What has arrived so far, with open strings, arrays and objects closed. Nothing before the value starts.
+    */
+    std::optional<glz::generic> partial() const;
+    /**
+     * Read what has arrived so far into value. Fields that have not arrived keep their value.
+     * @return false if nothing could be parsed yet
+    */
+    template <typename T>
+    bool partial(T& value) const
+    {
+        if(root_ == std::string::npos)
+            return false;
+        auto json = repairJson(std::string_view(buffer_).substr(root_, end_ == std::string::npos ? end_ : end_ - root_));
+        return !glz::read<glz::opts{.error_on_unknown_keys = false}>(value, json);
+    }
+
+    Callback on_value;  // Called for every value, innermost first
+
+protected:
+    struct Frame
+    {
+        char type;          // { or [
+        size_t start;       // Offset of the bracket
+        size_t index = 0;   // Index of the current element in arrays
+        std::string key;    // Key of the current member in objects
+        bool expect_key = false;
+    };
+
+    void complete(JsonEvent::Kind kind, size_t begin, size_t end);
+    void buildPath();
+
+    std::string buffer_;
+    size_t pos_ = 0;
+    size_t root_ = std::string::npos;   // Where the top level value starts
+    size_t end_ = std::string::npos;    // and ends, once it is done
+    std::vector<Frame> stack_;
+    enum class Token { None, String, Scalar } token_ = Token::None;
+    size_t token_start_ = 0;
+    bool escape_ = false;
+    bool key_ = false;
+    bool done_ = false;
+    std::string path_;
+    std::vector<std::pair<std::string, Callback>> listeners_;
+};
+
+}
@@ -0,0 +1,172 @@
+#include "prompt_library.hpp"
+
+#include <drogon/HttpAppFramework.h>
+#include <stdexcept>
+#include <trantor/utils/Logger.h>
+#include <yaml-cpp/yaml.h>
+
+using namespace tllf;
+
+static void loadPromptFile(PromptLibrary::Map& prompts, const std::string& path)
+{
+    YAML::Node root = YAML::LoadFile(path);
+    if(!root.IsMap())
+        throw std::runtime_error("Prompt file " + path + " must be a map of prompt names to prompts");
+
+    for(const auto& item : root) {
+        auto name = item.first.as<std::string>();
+        const YAML::Node& node = item.second;
+        auto entry = std::make_shared<PromptLibrary::Entry>();
+        if(node.IsScalar()) {
+            entry->source = node.as<std::string>();
+        }
+        else if(node.IsMap()) {
+            if(!node["template"])
+                throw std::runtime_error("Prompt " + name + " in " + path + " has no template");
+            entry->source = node["template"].as<std::string>();
+            if(node["defaults"]) {
+                for(const auto& def : node["defaults"])
+                    entry->defaults[def.first.as<std::string>()] = def.second.as<std::string>();
+            }
+        }
+        else {
+            throw std::runtime_error("Prompt " + name + " in " + path + " must be a string or a map");
+        }
+        // Defaults go through the same compile step as the template. So a broken or circular default fails the load
+        try {
+            entry->prompt = CompiledPrompt(entry->source, entry->defaults);
+        }
+        catch(const std::exception& e) {
+            throw std::runtime_error("Prompt " + name + " in " + path + ": " + e.what());
+        }
+        prompts[name] = std::move(entry);
+    }
+}
+
+std::string PromptLibrary::Entry::render(const std::unordered_map<std::string, std::string>& values) const
+{
+    bool overridden = false;
+    for(auto& [name, _] : values)
+        overridden |= defaults.contains(name);
+    if(!overridden)
+        return prompt.render(values);
+
+    auto remaining = defaults;
+    for(auto& [name, _] : values)
+        remaining.erase(name);
+    return CompiledPrompt(source, remaining).render(values);
+}
+
+bool PromptLibrary::State::reload(bool force)
+{
+    std::lock_guard lock(mtx);
+    std::vector<std::filesystem::file_time_type> mtimes;
+    mtimes.reserve(files.size());
+    bool modified = force;
+    for(auto& [path, mtime] : files) {
+        mtimes.push_back(std::filesystem::last_write_time(path));
+        modified |= mtimes.back() != mtime;
+    }
+    if(!modified)
+        return false;
+
+    // Build the whole snapshot before publishing it. Readers keep using the old one meanwhile
+    auto next = std::make_shared<Map>();
+    for(auto& [path, _] : files)
+        loadPromptFile(*next, path);
+    prompts.store(std::move(next));
+    for(size_t i = 0; i < files.size(); i++)
+        files[i].second = mtimes[i];
+    return true;
+}
+
+PromptLibrary::PromptLibrary()
+    : state_(std::make_shared<State>())
+{
+    state_->prompts.store(std::make_shared<Map>());
+}
+
+PromptLibrary::PromptLibrary(const std::vector<std::string>& paths)
+    : PromptLibrary()
+{
+    for(auto& path : paths)
+        load(path);
+}
+
+PromptLibrary::~PromptLibrary()
+{
+    if(watch_loop_ != nullptr)
+        watch_loop_->invalidateTimer(watch_timer_);
+}
+
+void PromptLibrary::load(const std::string& path)
+{
+    {
+        std::lock_guard lock(state_->mtx);
+        state_->files.push_back({path, std::filesystem::file_time_type::min()});
+    }
+    try {
+        state_->reload(true);
+    }
+    catch(...) {
+        std::lock_guard lock(state_->mtx);
+        std::erase_if(state_->files, [&](const auto& file) { return file.first == path; });
+        throw;
+    }
+}
+
+bool PromptLibrary::reload(bool force)
+{
+    return state_->reload(force);
+}
+
+void PromptLibrary::watch(trantor::EventLoop* loop, double interval)
+{
+    if(loop == nullptr)
+        loop = drogon::app().getLoop();
+    if(watch_loop_ != nullptr)
+        watch_loop_->invalidateTimer(watch_timer_);
+
+    // The timer only holds a weak reference. So it is harmless if it fires while the library is being destroyed
+    std::weak_ptr<State> weak = state_;
+    watch_loop_ = loop;
+    watch_timer_ = loop->runEvery(interval, [weak]() {
+        auto state = weak.lock();
+        if(state == nullptr)
+            return;
+        try {
+            if(state->reload(false))
+                LOG_INFO << "Prompt library reloaded";
+        }
+        catch(const std::exception& e) {
+            LOG_ERROR << "Failed to reload prompt library: " << e.what();
+        }
+    });
+}
+
+PromptLibrary::EntryPtr PromptLibrary::get(const std::string& name) const
+{
+    auto prompts = state_->prompts.load();
+    auto it = prompts->find(name);
+    if(it == prompts->end())
+        return nullptr;
+    return it->second;
+}
+
+std::string PromptLibrary::render(const std::string& name, const std::unordered_map<std::string, std::string>& values) const
+{
+    auto entry = get(name);
+    if(entry == nullptr)
+        throw std::runtime_error("Prompt " + name + " not found in library");
+    return entry->render(values);
+}
+
+std::vector<std::string> PromptLibrary::names() const
+{
+    auto prompts = state_->prompts.load();
+    std::vector<std::string> res;
+    res.reserve(prompts->size());
+    for(auto& [name, _] : *prompts)
+        res.push_back(name);
+    return res;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <trantor/net/EventLoop.h>
+
+#include <tllf/tllf.hpp>
+
+namespace tllf
+{
+
+/**
+ * Named prompt templates loaded from YAML files.
+ *
+ * Each top level key is a prompt name. The value is either the template string or a map like
+ *   greet:
+ *     template: "Hello {name}, I am {bot}"
+ *     defaults:
+ *       bot: Lacia
+ * Templates are compiled once at load time with their defaults inlined. Defaults are used for variables not given
+ * at render time and may reference other variables, like PromptTemplate. Lookups read an atomically swapped
+ * snapshot, so a reload never blocks a render.
+*/
+struct PromptLibrary
+{
+    struct Entry
+    {
+        std::string source;
+        CompiledPrompt prompt; // source with all defaults inlined
+        std::unordered_map<std::string, std::string> defaults;
+
+        /**
+         * @note Overriding a default recompiles the template without it, since other defaults may refer to it.
+        */
+        std::string render(const std::unordered_map<std::string, std::string>& values = {}) const;
+    };
+    using EntryPtr = std::shared_ptr<const Entry>;
+    using Map = std::unordered_map<std::string, EntryPtr>;
+
+    PromptLibrary();
+    PromptLibrary(const std::vector<std::string>& paths);
+    ~PromptLibrary();
+    PromptLibrary(const PromptLibrary&) = delete;
+    PromptLibrary& operator=(const PromptLibrary&) = delete;
+
+    /**
+     * Add a YAML file to the library and load it. Prompts in later files override earlier ones with the same name.
+    */
+    void load(const std::string& path);
+
+    /**
+     * Re-read all files and publish a new snapshot.
+     * @param force Reload even if no file has been modified
+     * @return true if a new snapshot has been published
+     * @note On a parse error the current snapshot is kept and the error is thrown.
+    */
+    bool reload(bool force = false);
+
+    /**
+     * Periodically check the files for modification and reload them.
+     * @param loop The event loop to poll on. Defaults to drogon's main loop
+     * @param interval Seconds between checks
+    */
+    void watch(trantor::EventLoop* loop = nullptr, double interval = 1.0);
+
+    /**
+     * @return The prompt. Or nullptr if there is no prompt with the name
+    */
+    EntryPtr get(const std::string& name) const;
+    std::string render(const std::string& name, const std::unordered_map<std::string, std::string>& values = {}) const;
+    std::vector<std::string> names() const;
+
+protected:
+    struct State
+    {
+        std::mutex mtx; // Serializes reloads. Never taken by readers
+        std::vector<std::pair<std::string, std::filesystem::file_time_type>> files;
+        std::atomic<std::shared_ptr<const Map>> prompts;
+
+        bool reload(bool force);
+    };
+
+    std::shared_ptr<State> state_;
+    trantor::EventLoop* watch_loop_ = nullptr;
+    trantor::TimerId watch_timer_ = 0;
+};
+
+}
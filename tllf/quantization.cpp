@@ -0,0 +1,194 @@
+#include "quantization.hpp"
+#include "simd.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <stdexcept>
+
+using namespace tllf;
+
+float internal::quantizeInt8(std::span<const float> vec, int8_t* out)
+{
+    float max = 0;
+    for(float x : vec)
+        max = std::max(max, std::abs(x));
+    if(max == 0) {
+        std::fill(out, out + vec.size(), 0);
+        return 0;
+    }
+    float scale = max / 127.f;
+    float inv = 127.f / max;
+    for(size_t i = 0; i < vec.size(); i++)
+        out[i] = static_cast<int8_t>(std::lround(vec[i] * inv));
+    return scale;
+}
+
+void internal::quantizeBinary(std::span<const float> vec, uint64_t* out)
+{
+    std::fill(out, out + (vec.size() + 63) / 64, 0);
+    for(size_t i = 0; i < vec.size(); i++) {
+        if(vec[i] > 0)
+            out[i / 64] |= uint64_t(1) << (i % 64);
+    }
+}
+
+QuantizedIndex::QuantizedIndex(size_t dim, Quantization quantization, std::string vectors_path, Metric metric, size_t rerank_factor)
+    : dim_(dim), quantization_(quantization), metric_(metric)
+    , rerank_factor_(rerank_factor != 0 ? rerank_factor : quantization == Quantization::Int8 ? 4 : 16)
+    , words_((dim + 63) / 64), vectors_path_(std::move(vectors_path))
+{
+    if(dim == 0)
+        throw std::runtime_error("QuantizedIndex needs a non-zero dimension");
+    if(!vectors_path_.empty()) {
+        vectors_out_.open(vectors_path_, std::ios::binary | std::ios::trunc);
+        if(!vectors_out_)
+            throw std::runtime_error("Failed to open " + vectors_path_ + " for writing");
+    }
+}
+
+QuantizedIndex::~QuantizedIndex() = default;
+
+void QuantizedIndex::add(uint64_t id, std::span<const float> vec)
+{
+    if(vec.size() != dim_)
+        throw std::runtime_error("Vector has dimension " + std::to_string(vec.size()) + " but the index uses " + std::to_string(dim_));
+
+    std::vector<float> normalized;
+    if(metric_ == Metric::Cosine) {
+        normalized.assign(vec.begin(), vec.end());
+        simd::normalize(normalized.data(), dim_);
+        vec = normalized;
+    }
+
+    if(quantization_ == Quantization::Int8) {
+        codes_.resize(codes_.size() + dim_);
+        scales_.push_back(internal::quantizeInt8(vec, codes_.data() + codes_.size() - dim_));
+    }
+    else {
+        bits_.resize(bits_.size() + words_);
+        internal::quantizeBinary(vec, bits_.data() + bits_.size() - words_);
+    }
+    ids_.push_back(id);
+
+    if(!vectors_path_.empty()) {
+        std::lock_guard lock(file_mtx_);
+        vectors_out_.write(reinterpret_cast<const char*>(vec.data()), dim_ * sizeof(float));
+        if(!vectors_out_)
+            throw std::runtime_error("Failed to write to " + vectors_path_);
+    }
+}
+
+void QuantizedIndex::add(std::span<const uint64_t> ids, const EmbeddingMatrix& vecs)
+{
+    if(ids.size() != vecs.rows())
+        throw std::runtime_error("Got " + std::to_string(ids.size()) + " ids for " + std::to_string(vecs.rows()) + " vectors");
+    if(quantization_ == Quantization::Int8) {
+        codes_.reserve(codes_.size() + vecs.rows() * dim_);
+        scales_.reserve(scales_.size() + vecs.rows());
+    }
+    else {
+        bits_.reserve(bits_.size() + vecs.rows() * words_);
+    }
+    ids_.reserve(ids_.size() + vecs.rows());
+    for(size_t i = 0; i < vecs.rows(); i++)
+        add(ids[i], vecs[i]);
+}
+
+void QuantizedIndex::add(const EmbeddingMatrix& vecs, uint64_t first_id)
+{
+    std::vector<uint64_t> ids(vecs.rows());
+    for(size_t i = 0; i < ids.size(); i++)
+        ids[i] = first_id + i;
+    add(ids, vecs);
+}
+
+size_t QuantizedIndex::memoryUsage() const
+{
+    return ids_.size() * sizeof(uint64_t) + codes_.size() + scales_.size() * sizeof(float) + bits_.size() * sizeof(uint64_t);
+}
+
+void QuantizedIndex::scan(const float* query, size_t begin, size_t end, internal::TopK& topk) const
+{
+    std::span<const float> q(query, dim_);
+    if(quantization_ == Quantization::Int8) {
+        std::vector<int8_t> qcodes(dim_);
+        float qscale = internal::quantizeInt8(q, qcodes.data());
+        for(size_t row = begin; row < end; row++)
+            topk.push(row, simd::dotI8(qcodes.data(), codes_.data() + row * dim_, dim_) * qscale * scales_[row]);
+    }
+    else {
+        std::vector<uint64_t> qbits(words_);
+        internal::quantizeBinary(q, qbits.data());
+        // Matching minus differing signs, scaled to [-1, 1]. The cosine similarity of the sign vectors
+        const float inv = 2.f / dim_;
+        for(size_t row = begin; row < end; row++)
+            topk.push(row, 1.f - inv * simd::hamming(qbits.data(), bits_.data() + row * words_, words_));
+    }
+}
+
+std::shared_ptr<const utils::MappedFile> QuantizedIndex::fullVectors() const
+{
+    std::lock_guard lock(file_mtx_);
+    // Remap only when rows were added since the last search
+    if(mapped_rows_ != size()) {
+        vectors_out_.rdbuf()->pubsync();
+        mapped_ = std::make_shared<utils::MappedFile>(vectors_path_, false);
+        mapped_rows_ = size();
+    }
+    return mapped_;
+}
+
+std::vector<SearchResult> QuantizedIndex::search(std::span<const float> query, size_t k) const
+{
+    EmbeddingMatrix queries;
+    queries.append(query);
+    return std::move(search(queries, k)[0]);
+}
+
+std::vector<std::vector<SearchResult>> QuantizedIndex::search(const EmbeddingMatrix& queries, size_t k) const
+{
+    const size_t nq = queries.rows();
+    if(nq != 0 && queries.dim() != dim_)
+        throw std::runtime_error("Query has dimension " + std::to_string(queries.dim()) + " but the index uses " + std::to_string(dim_));
+
+    EmbeddingMatrix normalized = queries;
+    if(metric_ == Metric::Cosine) {
+        for(size_t i = 0; i < nq; i++)
+            simd::normalize(normalized.row(i), dim_);
+    }
+
+    // Stage 1: the best candidates by their quantized codes. TopK holds row numbers here, not ids
+    const size_t candidates = reranks() ? k * rerank_factor_ : k;
+    std::vector<internal::TopK> results(nq, internal::TopK(candidates));
+    std::mutex mtx;
+    utils::parallelFor(size(), [&](size_t begin, size_t end) {
+        std::vector<internal::TopK> local(nq, internal::TopK(candidates));
+        for(size_t j = 0; j < nq; j++)
+            scan(normalized.row(j), begin, end, local[j]);
+        std::lock_guard lock(mtx);
+        for(size_t j = 0; j < nq; j++)
+            results[j].merge(local[j]);
+    }, 4096);
+
+    // Stage 2: rescore the candidates against the full-precision vectors on disk
+    std::shared_ptr<const utils::MappedFile> file;
+    if(reranks() && size() != 0)
+        file = fullVectors();
+    std::vector<std::vector<SearchResult>> res(nq);
+    for(size_t j = 0; j < nq; j++) {
+        auto rows = std::move(results[j]).sorted();
+        if(file) {
+            auto vectors = reinterpret_cast<const float*>(file->data().data());
+            for(auto& r : rows)
+                r.score = simd::dot(normalized.row(j), vectors + r.id * dim_, dim_);
+            std::sort(rows.begin(), rows.end(), [](const SearchResult& a, const SearchResult& b) { return a.score > b.score; });
+            rows.resize(std::min(rows.size(), k));
+        }
+        for(auto& r : rows)
+            r.id = ids_[r.id];
+        res[j] = std::move(rows);
+    }
+    return res;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <tllf/matrix.hpp>
+#include <tllf/vector_index.hpp>
+
+namespace tllf
+{
+
+enum class Quantization
+{
+    Int8,   // One signed byte per dimension plus a scale per vector. 4x smaller than float32
+    Binary  // The sign of each dimension as one bit. 32x smaller than float32
+};
+
+/**
+ * Brute-force search over quantized embeddings, with optional exact reranking.
+ *
+ * Only the quantized codes are kept in memory. When a vectors_path is given the full-precision vectors are also
+ * appended to that file, and each search rescores the best k * rerank_factor quantized candidates against them
+ * through a memory map. This recovers almost all of the recall lost to quantization while the float vectors stay
+ * on disk.
+*/
+struct QuantizedIndex
+{
+    /**
+     * @param vectors_path File for the full-precision vectors. Truncated on construction. Empty disables reranking
+     * @param rerank_factor How many quantized candidates per requested result are rescored exactly. 0 picks 4 for
+     * Int8 and 16 for Binary, whose estimates are much coarser
+    */
+    QuantizedIndex(size_t dim, Quantization quantization, std::string vectors_path = "", Metric metric = Metric::Cosine,
+        size_t rerank_factor = 0);
+    ~QuantizedIndex();
+    QuantizedIndex(const QuantizedIndex&) = delete;
+    QuantizedIndex& operator=(const QuantizedIndex&) = delete;
+
+    void add(uint64_t id, std::span<const float> vec);
+    /**
+     * @param ids One id per row
+    */
+    void add(std::span<const uint64_t> ids, const EmbeddingMatrix& vecs);
+    void add(const EmbeddingMatrix& vecs, uint64_t first_id);
+
+    /**
+     * @return The k best matches, best first. Scores are exact when reranking, estimates otherwise
+    */
+    std::vector<SearchResult> search(std::span<const float> query, size_t k) const;
+    std::vector<std::vector<SearchResult>> search(const EmbeddingMatrix& queries, size_t k) const;
+
+    size_t size() const { return ids_.size(); }
+    size_t dim() const { return dim_; }
+    Quantization quantization() const { return quantization_; }
+    Metric metric() const { return metric_; }
+    bool reranks() const { return !vectors_path_.empty(); }
+    /**
+     * Bytes of memory used by the codes and ids.
+    */
+    size_t memoryUsage() const;
+
+protected:
+    // Scores of the quantized codes against one query, written as (row, score) into topk
+    void scan(const float* query, size_t begin, size_t end, internal::TopK& topk) const;
+    std::shared_ptr<const utils::MappedFile> fullVectors() const;
+
+    size_t dim_;
+    Quantization quantization_;
+    Metric metric_;
+    size_t rerank_factor_;
+    size_t words_; // 64 bit words per binary code
+
+    std::vector<uint64_t> ids_;
+    std::vector<int8_t> codes_;
+    std::vector<float> scales_;
+    std::vector<uint64_t> bits_;
+
+    std::string vectors_path_;
+    std::ofstream vectors_out_;
+    mutable std::mutex file_mtx_;
+    mutable std::shared_ptr<const utils::MappedFile> mapped_;
+    mutable size_t mapped_rows_ = 0;
+};
+
+namespace internal
+{
+/**
+ * Symmetric int8 quantization of one vector: out[i] * scale ~= vec[i].
+ * @return scale
+*/
+float quantizeInt8(std::span<const float> vec, int8_t* out);
+/**
+ * Pack the sign bits of vec into (vec.size() + 63) / 64 words. Padding bits are zero.
+*/
+void quantizeBinary(std::span<const float> vec, uint64_t* out);
+}
+
+}
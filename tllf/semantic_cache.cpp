@@ -0,0 +1,155 @@
+#include "semantic_cache.hpp"
+
+#include <algorithm>
+
+#include <glaze/json/write.hpp>
+
+using namespace tllf;
+using namespace drogon;
+
+std::optional<std::string> SemanticCache::find(const std::string& ns, std::span<const float> embedding)
+{
+    std::shared_ptr<const FlatIndex> index;
+    uint64_t generation = 0;
+    {
+        std::lock_guard lock(mtx_);
+        auto it = spaces_.find(ns);
+        if(it != spaces_.end() && it->second.index->size() != 0 && it->second.index->dim() == embedding.size()) {
+            index = it->second.index;
+            generation = it->second.generation;
+        }
+    }
+    if(index == nullptr) {
+        misses_++;
+        return std::nullopt;
+    }
+
+    // The search is the slow part. Without the lock, lookups and inserts don't queue up behind it
+    auto results = index->search(embedding, 4);
+
+    std::lock_guard lock(mtx_);
+    auto it = spaces_.find(ns);
+    // Entries are only appended within a generation, so the ids found still point at the same entries
+    if(it != spaces_.end() && it->second.generation == generation) {
+        auto now = Clock::now();
+        // A few candidates in case the closest ones have expired
+        for(const auto& res : results) {
+            if(res.score < threshold)
+                break;
+            const auto& entry = it->second.entries[res.id];
+            if(entry.expires > now) {
+                hits_++;
+                return entry.response;
+            }
+        }
+    }
+    misses_++;
+    return std::nullopt;
+}
+
+void SemanticCache::insert(const std::string& ns, std::span<const float> embedding, std::string response)
+{
+    std::lock_guard lock(mtx_);
+    auto& space = spaces_[ns];
+    if(space.generation == 0 || (space.index->size() != 0 && space.index->dim() != embedding.size())) {
+        space = Namespace();
+        space.generation = next_generation_++;
+    }
+    if(space.entries.size() >= max_entries)
+        compact(space);
+    else if(space.index.use_count() > 1)
+        space.index = std::make_shared<FlatIndex>(*space.index);
+    space.index->add(space.entries.size(), embedding);
+    space.entries.push_back({std::move(response), Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(ttl))});
+}
+
+void SemanticCache::compact(Namespace& space)
+{
+    // Drop expired entries, then the oldest ones until a quarter of the space is free. Rebuilding the index is
+    // linear, so it only happens every max_entries / 4 inserts
+    auto now = Clock::now();
+    size_t keep_from = space.entries.size() > max_entries * 3 / 4 ? space.entries.size() - max_entries * 3 / 4 : 0;
+    Namespace compacted;
+    compacted.index = std::make_shared<FlatIndex>(space.index->dim(), space.index->metric());
+    compacted.generation = next_generation_++;
+    for(size_t i = keep_from; i < space.entries.size(); i++) {
+        if(space.entries[i].expires <= now)
+            continue;
+        compacted.index->add(compacted.entries.size(), space.index->vectors()[i]);
+        compacted.entries.push_back(std::move(space.entries[i]));
+    }
+    space = std::move(compacted);
+}
+
+void SemanticCache::clear(const std::string& ns)
+{
+    std::lock_guard lock(mtx_);
+    spaces_.erase(ns);
+}
+
+void SemanticCache::clear()
+{
+    std::lock_guard lock(mtx_);
+    spaces_.clear();
+}
+
+size_t SemanticCache::size(const std::string& ns) const
+{
+    std::lock_guard lock(mtx_);
+    auto it = spaces_.find(ns);
+    return it == spaces_.end() ? 0 : it->second.entries.size();
+}
+
+/**
+ * The text of a message, or nothing if it has images.
+*/
+static std::optional<std::string> messageText(const ChatEntry& entry)
+{
+    if(const auto* str = std::get_if<std::string>(&entry.content))
+        return *str;
+    std::string text;
+    for(const auto& part : std::get<ChatEntry::Parts>(entry.content)) {
+        const auto* str = std::get_if<std::string>(&part);
+        if(str == nullptr)
+            return std::nullopt;
+        text += *str;
+    }
+    return text;
+}
+
+Task<std::string> SemanticCachingLLM::generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools)
+{
+    std::optional<std::string> query;
+    // A stop_when predicate can cut the reply anywhere, there is no telling which replies are alike
+    if(tools.empty() && !config.stop_when && !history.empty() && history.back().role == "user")
+        query = messageText(history.back());
+    if(!query.has_value())
+        co_return co_await generateWith(*llm, history, std::move(config), tools);
+
+    // Everything before the question must match exactly. Hash it into the namespace
+    size_t context = std::hash<std::string>()(config.prompt);
+    if(config.response_format.has_value())
+        context = context * 31 + std::hash<std::string>()(glz::write_json(*config.response_format).value_or(""));
+    for(const auto& stop : config.stop)
+        context = context * 31 + std::hash<std::string>()(stop);
+    for(size_t i = 0; i + 1 < history.size(); i++) {
+        auto text = messageText(history[i]);
+        if(!text.has_value() || !history[i].tool_calls.empty())
+            co_return co_await generateWith(*llm, history, std::move(config), tools);
+        context = context * 31 + std::hash<std::string>()(history[i].role + '\0' + *text);
+    }
+    std::string key = ns + '\0' + std::to_string(context);
+
+    auto embedding = co_await embedder->embed(*query, config.cancel);
+    if(auto hit = cache->find(key, embedding)) {
+        // A streaming caller still expects to see the text, all in one piece
+        if(config.on_text)
+            config.on_text(*hit);
+        history.push_back(*hit, "assistant");
+        co_return *hit;
+    }
+
+    auto response = co_await generateWith(*llm, history, std::move(config), tools);
+    cache->insert(key, embedding, response);
+    co_return response;
+}
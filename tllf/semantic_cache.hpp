@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <drogon/utils/coroutine.h>
+
+#include <tllf/tllf.hpp>
+#include <tllf/vector_index.hpp>
+
+namespace tllf
+{
+
+/**
+ * Responses keyed by the embedding of the question that produced them. A lookup matches any earlier question
+ * whose embedding has a cosine similarity of at least threshold, so paraphrases hit the cache too.
+ *
+ * Entries live in namespaces that never see each other's entries, e.g. one per model, system prompt or tenant.
+ * @param threshold Minimum cosine similarity for a hit. Too low returns answers to different questions
+ * @param ttl Seconds an entry stays valid
+ * @param max_entries Per namespace. The oldest entries are dropped first
+*/
+struct SemanticCache
+{
+    SemanticCache(float threshold = 0.95f, double ttl = 3600, size_t max_entries = 10000)
+        : threshold(threshold), ttl(ttl), max_entries(max_entries)
+    {
+    }
+
+    std::optional<std::string> find(const std::string& ns, std::span<const float> embedding);
+    void insert(const std::string& ns, std::span<const float> embedding, std::string response);
+
+    void clear(const std::string& ns);
+    void clear();
+    size_t size(const std::string& ns) const;
+
+    size_t hits() const { return hits_; }
+    size_t misses() const { return misses_; }
+
+    float threshold;
+    double ttl;
+    size_t max_entries;
+
+protected:
+    using Clock = std::chrono::steady_clock;
+    struct Entry
+    {
+        std::string response;
+        Clock::time_point expires;
+    };
+    // Entries are in insertion order, so entry i is row i of the index and the oldest come first
+    struct Namespace
+    {
+        // Searched outside the lock. Copied before an insert if a search still holds it
+        std::shared_ptr<FlatIndex> index = std::make_shared<FlatIndex>();
+        std::vector<Entry> entries;
+        // Changes whenever the rows are renumbered, so a search can tell its ids went stale
+        uint64_t generation = 0;
+    };
+
+    void compact(Namespace& space);
+
+    mutable std::mutex mtx_;
+    std::unordered_map<std::string, Namespace> spaces_;
+    uint64_t next_generation_ = 1;
+    std::atomic<size_t> hits_ = 0;
+    std::atomic<size_t> misses_ = 0;
+};
+
+/**
+ * LLM adapter that answers from a SemanticCache when the last user message is close enough to an earlier one.
+ *
+ * The last message is embedded and looked up in the cache. On a hit the stored response is appended to the
+ * history as the assistant's reply, and the wrapped LLM is never called. On a miss the response is stored.
+ * Earlier messages must match exactly: they are hashed into the namespace, so the same question in a different
+ * conversation is a different entry.
+ * @param llm The LLM doing the actual work
+ * @param embedder Embeds the user messages. A small, fast model is enough
+ * @param ns Namespace in the cache. Use a different one per model and generation settings
+ * @note Requests with tools or images bypass the cache, and so does sampling several replies
+*/
+struct SemanticCachingLLM : public LLM
+{
+    SemanticCachingLLM(std::shared_ptr<LLM> llm, std::shared_ptr<TextEmbedder> embedder, std::shared_ptr<SemanticCache> cache, std::string ns = "default")
+        : llm(std::move(llm)), embedder(std::move(embedder)), cache(std::move(cache)), ns(std::move(ns))
+    {
+    }
+
+    std::shared_ptr<LLM> llm;
+    std::shared_ptr<TextEmbedder> embedder;
+    std::shared_ptr<SemanticCache> cache;
+    std::string ns;
+
+protected:
+    drogon::Task<std::string> generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools = {}) override;
+    drogon::Task<std::vector<std::string>> sampleImpl(const Chatlog& history, size_t n, TextGenerationConfig config) override
+    {
+        return sampleWith(*llm, history, n, std::move(config));
+    }
+};
+
+}
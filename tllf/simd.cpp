@@ -0,0 +1,327 @@
+#include "simd.hpp"
+#include <bit>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TLLF_SIMD_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define TLLF_SIMD_NEON
+#endif
+
+namespace tllf::simd
+{
+static float dotScalar(const float* a, const float* b, size_t n)
+{
+    float sum = 0;
+    for(size_t i = 0; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+static void dot4Scalar(const float* a, const float* const* b, size_t n, float* out)
+{
+    for(int j = 0; j < 4; j++)
+        out[j] = dotScalar(a, b[j], n);
+}
+
+static float l2sqScalar(const float* a, const float* b, size_t n)
+{
+    float sum = 0;
+    for(size_t i = 0; i < n; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+static int32_t dotI8Scalar(const int8_t* a, const int8_t* b, size_t n)
+{
+    int32_t sum = 0;
+    for(size_t i = 0; i < n; i++)
+        sum += int32_t(a[i]) * b[i];
+    return sum;
+}
+
+static uint64_t hammingScalar(const uint64_t* a, const uint64_t* b, size_t words)
+{
+    uint64_t sum = 0;
+    for(size_t i = 0; i < words; i++)
+        sum += std::popcount(a[i] ^ b[i]);
+    return sum;
+}
+
+#ifdef TLLF_SIMD_X86
+__attribute__((target("avx2,fma")))
+static float hsum256(__m256 v)
+{
+    __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+    return _mm_cvtss_f32(lo);
+}
+
+__attribute__((target("avx2,fma")))
+static float dotAVX2(const float* a, const float* b, size_t n)
+{
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for(; i + 8 <= n; i += 8)
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    return hsum256(_mm256_add_ps(acc0, acc1)) + dotScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void dot4AVX2(const float* a, const float* const* b, size_t n, float* out)
+{
+    __m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m256 va = _mm256_loadu_ps(a + i);
+        for(int j = 0; j < 4; j++)
+            acc[j] = _mm256_fmadd_ps(va, _mm256_loadu_ps(b[j] + i), acc[j]);
+    }
+    for(int j = 0; j < 4; j++)
+        out[j] = hsum256(acc[j]) + dotScalar(a + i, b[j] + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static float l2sqAVX2(const float* a, const float* b, size_t n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc = _mm256_fmadd_ps(d, d, acc);
+    }
+    return hsum256(acc) + l2sqScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int32_t dotI8AVX2(const int8_t* a, const int8_t* b, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        // Widen to 16 bits and multiply-add pairs into 32 bit lanes
+        __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    return _mm_cvtsi128_si32(sum) + dotI8Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("popcnt")))
+static uint64_t hammingPopcnt(const uint64_t* a, const uint64_t* b, size_t words)
+{
+    uint64_t sum = 0;
+    // Compiles to popcnt with the target above. Unlike _mm_popcnt_u64 it also builds for 32-bit x86
+    for(size_t i = 0; i < words; i++)
+        sum += std::popcount(a[i] ^ b[i]);
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static float dotAVX512(const float* a, const float* b, size_t n)
+{
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    if(i + 16 <= n) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        i += 16;
+    }
+    // Masked loads take care of the tail
+    __mmask16 mask = (1u << (n - i)) - 1;
+    acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), acc1);
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+static void dot4AVX512(const float* a, const float* const* b, size_t n, float* out)
+{
+    __m512 acc[4] = {_mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps()};
+    for(size_t i = 0; i < n; i += 16) {
+        __mmask16 mask = n - i >= 16 ? __mmask16(0xffff) : __mmask16((1u << (n - i)) - 1);
+        __m512 va = _mm512_maskz_loadu_ps(mask, a + i);
+        for(int j = 0; j < 4; j++)
+            acc[j] = _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(mask, b[j] + i), acc[j]);
+    }
+    for(int j = 0; j < 4; j++)
+        out[j] = _mm512_reduce_add_ps(acc[j]);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int32_t dotI8AVX512(const int8_t* a, const int8_t* b, size_t n)
+{
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32) {
+        __m512i va = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)));
+        __m512i vb = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(va, vb));
+    }
+    return _mm512_reduce_add_epi32(acc) + dotI8Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64_t hammingAVX512(const uint64_t* a, const uint64_t* b, size_t words)
+{
+    __m512i acc = _mm512_setzero_si512();
+    for(size_t i = 0; i < words; i += 8) {
+        __mmask8 mask = words - i >= 8 ? __mmask8(0xff) : __mmask8((1u << (words - i)) - 1);
+        __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(mask, a + i), _mm512_maskz_loadu_epi64(mask, b + i));
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+    }
+    return _mm512_reduce_add_epi64(acc);
+}
+#endif
+
+#ifdef TLLF_SIMD_NEON
+static float dotNEON(const float* a, const float* b, size_t n)
+{
+    float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1)) + dotScalar(a + i, b + i, n - i);
+}
+
+static void dot4NEON(const float* a, const float* const* b, size_t n, float* out)
+{
+    float32x4_t acc[4] = {vdupq_n_f32(0), vdupq_n_f32(0), vdupq_n_f32(0), vdupq_n_f32(0)};
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        float32x4_t va = vld1q_f32(a + i);
+        for(int j = 0; j < 4; j++)
+            acc[j] = vfmaq_f32(acc[j], va, vld1q_f32(b[j] + i));
+    }
+    for(int j = 0; j < 4; j++)
+        out[j] = vaddvq_f32(acc[j]) + dotScalar(a + i, b[j] + i, n - i);
+}
+
+static float l2sqNEON(const float* a, const float* b, size_t n)
+{
+    float32x4_t acc = vdupq_n_f32(0);
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        float32x4_t d = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        acc = vfmaq_f32(acc, d, d);
+    }
+    return vaddvq_f32(acc) + l2sqScalar(a + i, b + i, n - i);
+}
+
+static int32_t dotI8NEON(const int8_t* a, const int8_t* b, size_t n)
+{
+    int32x4_t acc = vdupq_n_s32(0);
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        int8x16_t va = vld1q_s8(a + i), vb = vld1q_s8(b + i);
+        acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+        acc = vpadalq_s16(acc, vmull_high_s8(va, vb));
+    }
+    return vaddvq_s32(acc) + dotI8Scalar(a + i, b + i, n - i);
+}
+
+static uint64_t hammingNEON(const uint64_t* a, const uint64_t* b, size_t words)
+{
+    uint64x2_t acc = vdupq_n_u64(0);
+    size_t i = 0;
+    for(; i + 2 <= words; i += 2) {
+        uint8x16_t x = vreinterpretq_u8_u64(veorq_u64(vld1q_u64(a + i), vld1q_u64(b + i)));
+        acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(vcntq_u8(x))));
+    }
+    return vaddvq_u64(acc) + hammingScalar(a + i, b + i, words - i);
+}
+#endif
+
+struct Kernels
+{
+    float (*dot)(const float*, const float*, size_t) = dotScalar;
+    void (*dot4)(const float*, const float* const*, size_t, float*) = dot4Scalar;
+    float (*l2sq)(const float*, const float*, size_t) = l2sqScalar;
+    int32_t (*dotI8)(const int8_t*, const int8_t*, size_t) = dotI8Scalar;
+    uint64_t (*hamming)(const uint64_t*, const uint64_t*, size_t) = hammingScalar;
+
+    Kernels()
+    {
+#if defined(TLLF_SIMD_X86)
+        if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            dot = dotAVX2;
+            dot4 = dot4AVX2;
+            l2sq = l2sqAVX2;
+            dotI8 = dotI8AVX2;
+        }
+        if(__builtin_cpu_supports("popcnt"))
+            hamming = hammingPopcnt;
+        if(__builtin_cpu_supports("avx512f")) {
+            dot = dotAVX512;
+            dot4 = dot4AVX512;
+        }
+        if(__builtin_cpu_supports("avx512bw"))
+            dotI8 = dotI8AVX512;
+        if(__builtin_cpu_supports("avx512vpopcntdq"))
+            hamming = hammingAVX512;
+#elif defined(TLLF_SIMD_NEON)
+        dot = dotNEON;
+        dot4 = dot4NEON;
+        l2sq = l2sqNEON;
+        dotI8 = dotI8NEON;
+        hamming = hammingNEON;
+#endif
+    }
+};
+
+static const Kernels& kernels()
+{
+    static const Kernels k;
+    return k;
+}
+
+float dot(const float* a, const float* b, size_t n)
+{
+    return kernels().dot(a, b, n);
+}
+
+void dot4(const float* a, const float* const* b, size_t n, float* out)
+{
+    kernels().dot4(a, b, n, out);
+}
+
+float l2sq(const float* a, const float* b, size_t n)
+{
+    return kernels().l2sq(a, b, n);
+}
+
+int32_t dotI8(const int8_t* a, const int8_t* b, size_t n)
+{
+    return kernels().dotI8(a, b, n);
+}
+
+uint64_t hamming(const uint64_t* a, const uint64_t* b, size_t words)
+{
+    return kernels().hamming(a, b, words);
+}
+
+void normalize(float* a, size_t n)
+{
+    float len = std::sqrt(dot(a, a, n));
+    if(len == 0)
+        return;
+    for(size_t i = 0; i < n; i++)
+        a[i] /= len;
+}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Vector kernels used by the indexes. Each picks the widest instruction set the CPU supports
+ * (AVX-512, AVX2 or NEON) at runtime and falls back to scalar code.
+*/
+namespace tllf::simd
+{
+float dot(const float* a, const float* b, size_t n);
+
+/**
+ * Dot products of one vector against 4 others. Loads a only once, which makes scoring a batch of queries
+ * close to a matrix multiply.
+*/
+void dot4(const float* a, const float* const* b, size_t n, float* out);
+
+float l2sq(const float* a, const float* b, size_t n);
+
+/**
+ * Dot product of int8 codes.
+ * @note The sum is 32 bit. Safe for any embedding size below 100K dimensions
+*/
+int32_t dotI8(const int8_t* a, const int8_t* b, size_t n);
+
+/**
+ * Number of differing bits between two bit strings of the given number of 64 bit words.
+*/
+uint64_t hamming(const uint64_t* a, const uint64_t* b, size_t words);
+
+/**
+ * Scale a to unit length. Zero vectors are left alone.
+*/
+void normalize(float* a, size_t n);
+}
@@ -0,0 +1,89 @@
+#include "stop_matcher.hpp"
+
+#include <algorithm>
+#include <deque>
+
+using namespace tllf;
+
+static constexpr uint32_t none = UINT32_MAX;
+
+StopMatcher::StopMatcher(const std::vector<std::string>& patterns)
+{
+    nodes_.emplace_back();
+    for(const auto& pattern : patterns) {
+        if(pattern.empty())
+            continue;
+        uint32_t node = 0;
+        for(uint8_t c : pattern) {
+            uint32_t next = child(node, c);
+            if(next == none) {
+                next = nodes_.size();
+                auto& edges = nodes_[node].next;
+                edges.insert(std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, 0u)), {c, next});
+                nodes_.emplace_back();
+                nodes_[next].depth = nodes_[node].depth + 1;
+            }
+            node = next;
+        }
+        nodes_[node].match = nodes_[node].depth;
+    }
+
+    // Fail links in breadth first order, so every shallower node is done before it is needed
+    std::deque<uint32_t> queue;
+    for(auto [c, next] : nodes_[0].next)
+        queue.push_back(next);
+    while(!queue.empty()) {
+        uint32_t node = queue.front();
+        queue.pop_front();
+        for(auto [c, next] : nodes_[node].next) {
+            uint32_t fail = nodes_[node].fail;
+            while(fail != 0 && child(fail, c) == none)
+                fail = nodes_[fail].fail;
+            uint32_t target = child(fail, c);
+            nodes_[next].fail = target != none && target != next ? target : 0;
+            nodes_[next].match = std::max(nodes_[next].match, nodes_[nodes_[next].fail].match);
+            queue.push_back(next);
+        }
+    }
+}
+
+uint32_t StopMatcher::child(uint32_t node, uint8_t c) const
+{
+    const auto& edges = nodes_[node].next;
+    auto it = std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, 0u));
+    return it != edges.end() && it->first == c ? it->second : none;
+}
+
+uint32_t StopMatcher::step(uint32_t node, uint8_t c) const
+{
+    while(true) {
+        uint32_t next = child(node, c);
+        if(next != none)
+            return next;
+        if(node == 0)
+            return 0;
+        node = nodes_[node].fail;
+    }
+}
+
+std::optional<size_t> StopMatcher::feed(std::string_view text)
+{
+    if(empty())
+        return std::nullopt;
+    for(size_t i = 0; i < text.size(); i++) {
+        state_ = step(state_, text[i]);
+        if(nodes_[state_].match != 0) {
+            size_t end = offset_ + i + 1;
+            offset_ += text.size();
+            return end - nodes_[state_].match;
+        }
+    }
+    offset_ += text.size();
+    return std::nullopt;
+}
+
+void StopMatcher::reset()
+{
+    state_ = 0;
+    offset_ = 0;
+}
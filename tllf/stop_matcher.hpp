@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace tllf
+{
+
+/**
+ * Finds the first occurrence of any of a set of strings in text that arrives in pieces (Aho-Corasick).
+ *
+ * Every byte is looked at once, whatever the number of patterns, and matches that straddle two pieces are found.
+*/
+struct StopMatcher
+{
+    StopMatcher() = default;
+    StopMatcher(const std::vector<std::string>& patterns);
+
+    /**
+     * Scan the next piece of the stream.
+     * @return Offset in the whole stream where the first match starts, if a match ends in this piece
+    */
+    std::optional<size_t> feed(std::string_view text);
+    void reset();
+
+    bool empty() const { return nodes_.size() <= 1; }
+    /**
+     * Length of the end of the stream that is the start of some pattern. Hold that much text back from the
+     * reader, it may turn out to be part of a match.
+    */
+    size_t pending() const { return nodes_.empty() ? 0 : nodes_[state_].depth; }
+
+protected:
+    struct Node
+    {
+        std::vector<std::pair<uint8_t, uint32_t>> next;  // Sorted by byte
+        uint32_t fail = 0;
+        uint32_t depth = 0;
+        uint32_t match = 0;     // Length of the longest pattern ending here, through fail links too. 0 if none
+    };
+
+    uint32_t child(uint32_t node, uint8_t c) const;
+    uint32_t step(uint32_t node, uint8_t c) const;
+
+    std::vector<Node> nodes_;
+    uint32_t state_ = 0;
+    size_t offset_ = 0;
+};
+
+}
@@ -0,0 +1,187 @@
+#include "structured.hpp"
+
+#include <stdexcept>
+#include <vector>
+
+#include <glaze/json.hpp>
+
+using namespace tllf;
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+static bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool isAlpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+std::string_view tllf::extractJson(std::string_view text)
+{
+    size_t begin = text.find_first_of("{[");
+    if(begin == std::string_view::npos)
+        return text;
+    // Cut at the bracket closing the first one, so prose after the value goes too. Brackets in strings don't count
+    size_t depth = 0;
+    bool in_string = false;
+    bool escape = false;
+    for(size_t i = begin; i < text.size(); i++) {
+        char c = text[i];
+        if(in_string) {
+            if(escape)
+                escape = false;
+            else if(c == '\\')
+                escape = true;
+            else if(c == '"')
+                in_string = false;
+        }
+        else if(c == '"')
+            in_string = true;
+        else if(c == '{' || c == '[')
+            depth++;
+        else if((c == '}' || c == ']') && --depth == 0)
+            return text.substr(begin, i - begin + 1);
+    }
+    // Cut off before the value ended. Left for repairJson()
+    return text.substr(begin);
+}
+
+static void trimBack(std::string& out)
+{
+    while(!out.empty() && isSpace(out.back()))
+        out.pop_back();
+}
+
+// Make whatever ends out a complete value or member, so the container can be closed after it
+// @param key_start Where a key still waiting for its value starts, or npos
+static void completeTail(std::string& out, size_t key_start)
+{
+    trimBack(out);
+    if(out.empty())
+        return;
+    char c = out.back();
+    if(key_start != std::string::npos && (c == ':' || c == '"')) {
+        // Drop the dangling key rather than invent a value for it
+        out.resize(key_start);
+        completeTail(out, std::string::npos);
+    }
+    else if(c == ',') {
+        out.pop_back();
+        trimBack(out);
+    }
+    else if(c == ':')
+        out += "null";
+    else if(c == '-' || c == '+' || c == '.' || ((c == 'e' || c == 'E') && out.size() > 1 && isDigit(out[out.size() - 2]))) {
+        while(!out.empty() && (out.back() == '-' || out.back() == '+' || out.back() == '.' || out.back() == 'e' || out.back() == 'E'))
+            out.pop_back();
+        // Nothing left of the number
+        if(!out.empty() && !isDigit(out.back()))
+            completeTail(out, std::string::npos);
+    }
+    else if(isAlpha(c)) {
+        size_t start = out.size();
+        while(start > 0 && isAlpha(out[start - 1]))
+            start--;
+        std::string_view word = std::string_view(out).substr(start);
+        for(std::string_view literal : {"true", "false", "null"}) {
+            if(literal.starts_with(word)) {
+                out += literal.substr(word.size());
+                break;
+            }
+        }
+    }
+}
+
+std::string tllf::repairJson(std::string_view text)
+{
+    std::string out;
+    out.reserve(text.size() + 16);
+    std::vector<char> stack;
+    bool in_string = false;
+    bool escape = false;
+    // Where the last key starts, until its value does
+    size_t key_start = std::string::npos;
+    for(char c : text) {
+        if(in_string) {
+            out.push_back(c);
+            if(escape)
+                escape = false;
+            else if(c == '\\')
+                escape = true;
+            else if(c == '"')
+                in_string = false;
+            continue;
+        }
+
+        switch(c) {
+        case '"': {
+            size_t last = out.find_last_not_of(" \t\r\n");
+            char prev = last == std::string::npos ? 0 : out[last];
+            bool key = !stack.empty() && stack.back() == '{' && (prev == '{' || prev == ',');
+            key_start = key ? out.size() : std::string::npos;
+            in_string = true;
+            break;
+        }
+        case '{':
+        case '[':
+            key_start = std::string::npos;
+            stack.push_back(c);
+            break;
+        case '}':
+        case ']':
+            completeTail(out, c == '}' ? key_start : std::string::npos);
+            key_start = std::string::npos;
+            if(!stack.empty())
+                stack.pop_back();
+            break;
+        case ':':
+        case ',':
+            break;
+        default:
+            if(!isSpace(c))
+                key_start = std::string::npos;
+        }
+        out.push_back(c);
+    }
+
+    if(in_string) {
+        if(escape)
+            out.pop_back();
+        // A \u escape missing some of its digits
+        size_t slash = out.rfind("\\u");
+        if(slash != std::string::npos && out.size() - slash < 6 && (slash == 0 || out[slash - 1] != '\\'))
+            out.resize(slash);
+        out.push_back('"');
+    }
+    while(!stack.empty()) {
+        completeTail(out, stack.back() == '{' ? key_start : std::string::npos);
+        key_start = std::string::npos;
+        out.push_back(stack.back() == '{' ? '}' : ']');
+        stack.pop_back();
+    }
+    return out;
+}
+
+glz::generic internal::jsonSchemaFormat(std::string_view name, std::string_view schema)
+{
+    glz::generic parsed;
+    auto ec = glz::read_json(parsed, schema);
+    if(ec)
+        throw std::runtime_error("Invalid JSON schema: " + glz::format_error(ec, schema));
+
+    std::string clean_name;
+    for(char c : name)
+        clean_name.push_back(isAlpha(c) || isDigit(c) || c == '-' ? c : '_');
+
+    glz::generic format;
+    format["type"] = "json_schema";
+    format["json_schema"]["name"] = clean_name.empty() ? std::string("response") : clean_name;
+    format["json_schema"]["schema"] = std::move(parsed);
+    return format;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include <glaze/json/generic.hpp>
+
+namespace tllf
+{
+
+/**
+ * The JSON value in an LLM reply, without the Markdown code fence or prose models like to wrap around it.
+ * @return A view into text, from the first bracket to the one closing it. Up to the end of text if the value is
+ * cut off, and text itself if it has no object or array
+*/
+std::string_view extractJson(std::string_view text);
+
+/**
+ * Best-effort syntactic repair of JSON that was cut short or written sloppily. Unterminated strings and
+ * containers are closed, trailing commas and keys without a value dropped, and truncated literals and numbers
+ * completed or trimmed.
+ * @note Valid JSON comes back unchanged. Nothing is done about missing or wrongly typed fields
+*/
+std::string repairJson(std::string_view text);
+
+namespace internal
+{
+/**
+ * An OpenAI style response_format asking for JSON that follows schema.
+ * @param name Name of the schema. Characters the API does not accept are replaced
+ * @param schema The JSON schema, as text
+*/
+glz::generic jsonSchemaFormat(std::string_view name, std::string_view schema);
+}
+
+}
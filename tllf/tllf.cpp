@@ -1,3 +1,4 @@
+#include "tllf/base64.hpp"
 #include "tllf/tool.hpp"
 #include "tllf/utils.hpp"
 #include <cstddef>
@@ -6,11 +7,19 @@
 #include <drogon/utils/coroutine.h>
 #include <glaze/core/common.hpp>
 #include <glaze/json.hpp>
-#include <fstream>
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <filesystem>
+#include <list>
+#include <mutex>
 #include <glaze/json/generic.hpp>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <tllf/http_stream.hpp>
+#include <tllf/stop_matcher.hpp>
 #include <tllf/tllf.hpp>
 #include <tllf/url_parser.hpp>
 
@@ -33,18 +42,94 @@ namespace tllf
 
 namespace internal
 {
-static drogon::CacheMap<std::string, drogon::HttpClientPtr> clientCache(drogon::app().getLoop());
-drogon::HttpClientPtr getClient(const std::string& hoststr, trantor::EventLoop* loop)
+namespace
+{
+struct StringHash
+{
+    using is_transparent = void;
+    size_t operator()(std::string_view str) const { return std::hash<std::string_view>()(str); }
+};
+
+std::mutex endpoint_mtx;
+std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>> endpoint_ids;
+std::vector<std::string> endpoint_strings;
+
+uint32_t intern(std::string_view key)
+{
+    std::lock_guard lock(endpoint_mtx);
+    auto it = endpoint_ids.find(key);
+    if(it != endpoint_ids.end())
+        return it->second;
+    uint32_t id = endpoint_strings.size();
+    endpoint_strings.emplace_back(key);
+    endpoint_ids.emplace(key, id);
+    return id;
+}
+}
+
+uint32_t endpointId(const UrlView& url)
+{
+    // Build the canonical key on the stack. Only absurdly long hosts need the heap
+    char buf[320];
+    std::string heap;
+    char port_buf[8];
+    std::string_view port;
+    if(url.port() != url.defaultPort())
+        port = std::string_view(port_buf, std::to_chars(port_buf, port_buf + sizeof(port_buf), url.port()).ptr);
+    size_t size = url.protocol().size() + 3 + url.host().size() + port.size() + 1;
+    char* out = buf;
+    if(size > sizeof(buf)) {
+        heap.resize(size);
+        out = heap.data();
+    }
+    char* ptr = out;
+    auto append = [&](std::string_view str, bool lower) {
+        for(char ch : str)
+            *ptr++ = lower && ch >= 'A' && ch <= 'Z' ? ch - 'A' + 'a' : ch;
+    };
+    append(url.protocol(), true);
+    append(url.protocol().empty() ? "//" : "://", false);
+    append(url.host(), true);
+    if(!port.empty()) {
+        append(":", false);
+        append(port, false);
+    }
+    return intern(std::string_view(out, ptr - out));
+}
+
+uint32_t endpointId(std::string_view url)
+{
+    UrlView view(url);
+    if(!view.good())
+        return intern(url);
+    return endpointId(view);
+}
+
+std::string endpointString(uint32_t endpoint)
+{
+    std::lock_guard lock(endpoint_mtx);
+    if(endpoint >= endpoint_strings.size())
+        throw std::runtime_error("Unknown endpoint id " + std::to_string(endpoint));
+    return endpoint_strings[endpoint];
+}
+
+static drogon::CacheMap<uint32_t, drogon::HttpClientPtr> clientCache(drogon::app().getLoop());
+drogon::HttpClientPtr getClient(uint32_t endpoint, trantor::EventLoop* loop)
 {
     drogon::HttpClientPtr res;
-    bool ok = clientCache.findAndFetch(hoststr, res);
+    bool ok = clientCache.findAndFetch(endpoint, res);
     if(ok)
         return res;
-    res = drogon::HttpClient::newHttpClient(hoststr, loop);
-    clientCache.insert(hoststr, res, 1200);
+    res = drogon::HttpClient::newHttpClient(endpointString(endpoint), loop);
+    clientCache.insert(endpoint, res, 1200);
     return res;
 }
 
+drogon::HttpClientPtr getClient(const std::string& hoststr, trantor::EventLoop* loop)
+{
+    return getClient(endpointId(hoststr), loop);
+}
+
 std::string env(const std::string& key)
 {
     char* val = std::getenv(key.c_str());
@@ -53,48 +138,211 @@ std::string env(const std::string& key)
 }
 }
 
-std::string dataUrlfromFile(const std::string& path, std::string mime) {
-    // Open the file in binary mode
-    std::ifstream file(path, std::ios::binary | std::ios::ate);
-    if (!file) {
-        throw std::runtime_error("Failed to open file: " + path);
+static std::string detectMime(std::string_view data)
+{
+    std::string_view magic = data.substr(0, 8);
+    if(magic.starts_with("\x89\x50\x4E\x47\x0D\x0A\x1A\x0A"))
+        return "image/png";
+    else if(magic.starts_with("\xFF\xD8\xFF"))
+        return "image/jpeg";
+    else if(magic.starts_with("GIF87a") || magic.starts_with("GIF89a"))
+        return "image/gif";
+    else if(magic.starts_with("BM"))
+        return "image/bmp";
+    else if(magic.starts_with("RIFF") && magic.substr(4, 4) == "WEBP")
+        return "image/webp";
+    else if(magic.starts_with(std::string_view("\x49\x49\x2A\x00", 4)) || magic.starts_with(std::string_view("\x4D\x4D\x00\x2A", 4)))
+        return "image/tiff";
+    else if(magic.starts_with(std::string_view("\x00\x00\x01\x00", 4)))
+        return "image/x-icon";
+    return "";
+}
+
+/**
+ * Base64 encoded files keyed by path. An entry is only used while the file's size and modification time match.
+ * Least recently used entries are evicted once the total size goes over the capacity.
+*/
+struct DataUrlCache
+{
+    struct Entry
+    {
+        std::filesystem::file_time_type mtime;
+        size_t size;
+        std::string mime; // Empty if the type is unknown
+        std::shared_ptr<const std::string> base64;
+        std::list<std::string>::iterator lru_it;
+    };
+
+    std::optional<std::pair<std::string, std::shared_ptr<const std::string>>> find(const std::string& path, std::filesystem::file_time_type mtime, size_t size)
+    {
+        std::lock_guard lock(mtx);
+        auto it = entries.find(path);
+        if(it == entries.end())
+            return std::nullopt;
+        if(it->second.mtime != mtime || it->second.size != size) {
+            erase(it);
+            return std::nullopt;
+        }
+        lru.splice(lru.begin(), lru, it->second.lru_it);
+        return std::make_pair(it->second.mime, it->second.base64);
+    }
+
+    void insert(const std::string& path, Entry entry)
+    {
+        std::lock_guard lock(mtx);
+        if(auto it = entries.find(path); it != entries.end())
+            erase(it);
+        if(entry.base64->size() > capacity)
+            return;
+        lru.push_front(path);
+        entry.lru_it = lru.begin();
+        bytes += entry.base64->size();
+        entries.emplace(path, std::move(entry));
+        shrink();
+    }
+
+    void setCapacity(size_t n)
+    {
+        std::lock_guard lock(mtx);
+        capacity = n;
+        shrink();
+    }
+
+protected:
+    void erase(std::unordered_map<std::string, Entry>::iterator it)
+    {
+        bytes -= it->second.base64->size();
+        lru.erase(it->second.lru_it);
+        entries.erase(it);
+    }
+
+    void shrink()
+    {
+        while(bytes > capacity && !lru.empty())
+            erase(entries.find(lru.back()));
     }
 
-    // Determine the file size
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
+    std::mutex mtx;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru;
+    size_t bytes = 0;
+    size_t capacity = 256 * 1024 * 1024;
+};
+
+static DataUrlCache data_url_cache;
+
+void setDataUrlCacheCapacity(size_t bytes)
+{
+    data_url_cache.setCapacity(bytes);
+}
+
+MediaUrl MediaUrl::fromFile(const std::string& path, std::string mime)
+{
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(path, ec);
+    size_t size = ec ? 0 : std::filesystem::file_size(path, ec);
+    if(ec)
+        throw std::runtime_error("Failed to open file: " + path);
 
-    // Read the file into a buffer
-    std::vector<char> buffer(size);
-    if (!file.read(buffer.data(), size)) {
-        throw std::runtime_error("Failed to read file: " + path);
+    std::string detected_mime;
+    std::shared_ptr<const std::string> base64;
+    if(auto hit = data_url_cache.find(path, mtime, size)) {
+        detected_mime = std::move(hit->first);
+        base64 = std::move(hit->second);
+    }
+    else {
+        // Map the file instead of reading it. The encoder reads straight from the page cache
+        tllf::utils::MappedFile file(path);
+        detected_mime = detectMime(file.data());
+        base64 = std::make_shared<const std::string>(tllf::utils::base64Encode(file.data()));
+        data_url_cache.insert(path, {.mtime = mtime, .size = file.size(), .mime = detected_mime, .base64 = base64, .lru_it = {}});
     }
-    file.close();
 
     // Determine MIME type if not provided
     if (mime.empty()) {
-        if(buffer.size() < 8)
+        if(size < 8)
             throw std::runtime_error("File too small. Cannot automatically decide file type");
-        std::string_view magic = std::string_view(buffer.data(), 8);
-        if(magic.starts_with("\x89\x50\x4E\x47\x0D\x0A\x1A\x0A"))
-            mime = "image/png";
-        else if(magic.starts_with("\xFF\xD8\xFF"))
-            mime = "image/jpeg";
-        else if(magic.starts_with("GIF87a") || magic.starts_with("GIF89a"))
-            mime = "image/gif";
-        else if(magic.starts_with("BM"))
-            mime = "image/bmp";
-        else if(magic.starts_with("RIFF") && magic.substr(4, 4) == "WEBP")
-            mime = "image/webp";
-        else if(magic.starts_with("\x49\x49\x2A\x00") || magic.starts_with("\x4D\x4D\x00\x2A"))
-            mime = "image/tiff";
-        else if(magic.starts_with("\x00\x00\x01\x00"))
-            mime = "image/x-icon";
-        else
+        if(detected_mime.empty())
             throw std::runtime_error("Unsupported file type");
+        mime = std::move(detected_mime);
+    }
+    return fromBase64(std::move(base64), std::move(mime));
+}
+
+std::string dataUrlfromFile(const std::string& path, std::string mime) {
+    return MediaUrl::fromFile(path, std::move(mime)).str();
+}
+
+MediaUrl::MediaUrl(std::string url)
+    : data_(std::make_shared<const std::string>(std::move(url)))
+{
+}
+
+// The MIME type is written into JSON and data URLs as is, so only token characters and '/' are allowed
+static void checkMime(std::string_view mime)
+{
+    for(char c : mime) {
+        if(!std::isalnum(static_cast<unsigned char>(c)) && std::string_view("!#$%&'*+-.^_`|~/").find(c) == std::string_view::npos)
+            throw std::runtime_error("Invalid MIME type: " + std::string(mime));
     }
+}
+
+MediaUrl MediaUrl::fromBytes(std::string bytes, std::string mime)
+{
+    checkMime(mime);
+    MediaUrl res;
+    res.encoding_ = Encoding::Raw;
+    res.data_ = std::make_shared<const std::string>(std::move(bytes));
+    res.mime_ = std::move(mime);
+    return res;
+}
+
+MediaUrl MediaUrl::fromBase64(std::shared_ptr<const std::string> base64, std::string mime)
+{
+    checkMime(mime);
+    MediaUrl res;
+    res.encoding_ = Encoding::Base64;
+    res.data_ = std::move(base64);
+    res.mime_ = std::move(mime);
+    return res;
+}
+
+static constexpr std::string_view data_url_prefix = "data:";
+static constexpr std::string_view data_url_base64 = ";base64,";
+
+size_t MediaUrl::size() const
+{
+    size_t n = payload().size();
+    if(encoding_ == Encoding::Url)
+        return n;
+    if(encoding_ == Encoding::Raw)
+        n = tllf::utils::base64EncodedSize(n);
+    return data_url_prefix.size() + mime_.size() + data_url_base64.size() + n;
+}
+
+size_t MediaUrl::write(char* out) const
+{
+    auto data = payload();
+    if(encoding_ == Encoding::Url)
+        return std::copy(data.begin(), data.end(), out) - out;
+
+    char* ptr = std::copy(data_url_prefix.begin(), data_url_prefix.end(), out);
+    ptr = std::copy(mime_.begin(), mime_.end(), ptr);
+    ptr = std::copy(data_url_base64.begin(), data_url_base64.end(), ptr);
+    if(encoding_ == Encoding::Base64)
+        ptr = std::copy(data.begin(), data.end(), ptr);
+    else
+        ptr += tllf::utils::base64Encode(data.data(), data.size(), ptr);
+    return ptr - out;
+}
 
-    return "data:" + mime + ";base64," + drogon::utils::base64Encode(buffer.data(), buffer.size());
+std::string MediaUrl::str() const
+{
+    if(encoding_ == Encoding::Url)
+        return std::string(payload());
+    std::string res(size(), '\0');
+    write(res.data());
+    return res;
 }
 }
 
@@ -105,6 +353,15 @@ struct glz:: meta<ChatEntry::Part>
     static constexpr auto ids = std::array{"text", "image_url"};
 };
 
+// An inline media left out of serialized JSON, and where its data URL goes
+struct DeferredMedia
+{
+    size_t offset;  // Between the quotes of its empty JSON string
+    MediaUrl media;
+};
+// While set, inline media are written as empty strings and collected here. See writeRequestBody()
+static thread_local std::vector<DeferredMedia>* deferred_media = nullptr;
+
 namespace glz
 {
    template <>
@@ -119,6 +376,47 @@ namespace glz
       }
    };
 
+   template <>
+   struct from<JSON, MediaUrl>
+   {
+      template <auto Opts>
+      static void op(MediaUrl& value, is_context auto&& ctx, auto&& it, auto&& end)
+      {
+         std::string url_str;
+         parse<JSON>::op<Opts>(url_str, ctx, it, end);
+         value = MediaUrl(std::move(url_str));
+      }
+   };
+
+   template <>
+   struct to<JSON, MediaUrl>
+   {
+      template <auto Opts>
+      static void op(auto&& value, is_context auto&& ctx, auto&& b, auto&& ix) noexcept
+      {
+         if(value.encoding() == MediaUrl::Encoding::Url) {
+            serialize<JSON>::op<Opts>(value.payload(), ctx, b, ix);
+            return;
+         }
+         if(deferred_media != nullptr) {
+            // glaze only ever appends, so the offset still holds in the finished JSON
+            if(ix + 2 > b.size())
+               b.resize((std::max)(b.size() * 2, ix + 2));
+            b[ix++] = '"';
+            deferred_media->push_back({size_t(ix), value});
+            b[ix++] = '"';
+            return;
+         }
+         // Data URLs never need escaping. Write (and encode) the payload straight into the output buffer
+         const size_t n = value.size() + 2;
+         if(ix + n > b.size())
+            b.resize((std::max)(b.size() * 2, ix + n));
+         b[ix++] = '"';
+         ix += value.write(b.data() + ix);
+         b[ix++] = '"';
+      }
+   };
+
    template <>
    struct to<JSON, Url>
    {
@@ -140,10 +438,177 @@ struct OpenAIDataBody
     std::optional<int> top_p;
     std::optional<int> frequency_penalty;
     std::optional<int> presence_penalty;
-    std::optional<int> stop_sequence;
+    std::optional<std::vector<std::string>> stop;
     std::optional<std::vector<std::variant<OpenAIToolDesc, glz::generic>>> tools;
+    std::optional<glz::generic> response_format;
+    std::optional<bool> stream;
+    std::optional<size_t> n;
+};
+
+struct OpenAIStreamChunk
+{
+    struct ToolCallDelta
+    {
+        size_t index = 0;
+        std::optional<std::string> id;
+        std::optional<std::string> type;
+        struct FunctionDelta {
+            std::optional<std::string> name;
+            std::optional<std::string> arguments;
+        };
+        FunctionDelta function;
+        std::optional<glz::generic> extra_content;
+    };
+    struct Delta
+    {
+        std::optional<std::string> content;
+        std::vector<ToolCallDelta> tool_calls;
+    };
+    struct Choice
+    {
+        Delta delta;
+        std::optional<std::string> finish_reason;
+        size_t index = 0;
+    };
+    std::vector<Choice> choices;
+};
+
+/**
+ * Rough upper bound of the serialized size of the messages. Inline media dominates for multimodal requests.
+*/
+static size_t estimateJsonSize(const std::vector<ChatEntry>& messages)
+{
+    size_t size = 0;
+    for(const auto& entry : messages) {
+        size += 64 + entry.role.size();
+        if(std::holds_alternative<std::string>(entry.content)) {
+            size += std::get<std::string>(entry.content).size();
+        }
+        else {
+            for(const auto& part : std::get<ChatEntry::Parts>(entry.content)) {
+                if(std::holds_alternative<std::string>(part))
+                    size += 32 + std::get<std::string>(part).size();
+                else
+                    size += 64 + std::get<ImageByUrl>(part).image_url.url.size();
+            }
+        }
+        for(const auto& call : entry.tool_calls)
+            size += 128 + call.function.name.size() + call.function.arguments.size();
+    }
+    // Escaping makes text grow a little
+    return size + size / 8;
+}
+
+/**
+ * Serialize a request body into a buffer sized up front. The buffer is meant to be moved into the request,
+ * so large inline images are encoded once, straight into the memory that gets sent.
+*/
+template <typename T>
+static std::string writeJsonBody(const T& body, size_t size_hint)
+{
+    std::string buffer;
+    // glaze grows the buffer as it writes. Reserving keeps that from reallocating and copying
+    buffer.reserve(size_hint + 4096);
+    auto ec = glz::write_json(body, buffer);
+    if(ec)
+        throw std::runtime_error("Failed to serialize request: " + glz::format_error(ec, buffer));
+    return buffer;
+}
+
+std::string tllf::internal::writeChatJson(const std::vector<ChatEntry>& messages)
+{
+    return writeJsonBody(messages, estimateJsonSize(messages));
+}
+
+/**
+ * JSON body with inline media that is produced while it is sent. The JSON around the media is serialized up front,
+ * the media are base64 encoded a piece at a time into the chunks of the request.
+*/
+struct ChunkedJsonBody
+{
+    bool next(std::string& chunk);
+
+    std::string skeleton;       // The JSON with an empty string in place of each media
+    std::vector<DeferredMedia> media; // In the order they appear in skeleton
+    size_t pos = 0;             // Next byte of skeleton to send
+    size_t next_media = 0;      // First media not sent yet
+    std::optional<size_t> current; // Media being sent
+    size_t offset = 0;          // Next byte of the current media's payload
 };
 
+bool ChunkedJsonBody::next(std::string& chunk)
+{
+    constexpr size_t piece_size = 64 * 1024;
+    chunk.reserve(piece_size + 256);
+    while(chunk.size() < piece_size) {
+        if(current.has_value()) {
+            const auto& m = media[*current].media;
+            auto data = m.payload();
+            size_t room = piece_size - chunk.size();
+            if(m.encoding() == MediaUrl::Encoding::Base64) {
+                size_t n = std::min(room, data.size() - offset);
+                chunk.append(data.substr(offset, n));
+                offset += n;
+            }
+            else {
+                // Whole groups of 3 bytes, so the pieces join into one valid base64 string
+                size_t n = std::min(std::max<size_t>(room / 4 * 3, 3), data.size() - offset);
+                tllf::utils::base64EncodeAppend(chunk, data.substr(offset, n));
+                offset += n;
+            }
+            if(offset == data.size())
+                current.reset();
+            continue;
+        }
+        if(pos == skeleton.size())
+            return false;
+
+        size_t media_at = next_media < media.size() ? media[next_media].offset : skeleton.size();
+        if(pos < media_at) {
+            size_t end = std::min(media_at, pos + piece_size - chunk.size());
+            chunk.append(skeleton, pos, end - pos);
+            pos = end;
+            continue;
+        }
+        const auto& m = media[next_media].media;
+        chunk += data_url_prefix;
+        chunk += m.mime();
+        chunk += data_url_base64;
+        current = next_media++;
+        offset = 0;
+    }
+    return pos < skeleton.size() || current.has_value();
+}
+
+// Bodies estimated larger than this are sent with chunked encoding instead of being serialized whole
+static constexpr size_t chunked_body_threshold = 1024 * 1024;
+
+/**
+ * Serialize a request body. Small bodies are written out in full. Large ones, which are large because of inline
+ * media, become a writer that encodes the media while the request is sent.
+*/
+template <typename T>
+static internal::HttpStreamBody writeRequestBody(const T& body, size_t size_hint)
+{
+    if(size_hint < chunked_body_threshold)
+        return writeJsonBody(body, size_hint);
+
+    auto chunked = std::make_shared<ChunkedJsonBody>();
+    deferred_media = &chunked->media;
+    auto ec = glz::write_json(body, chunked->skeleton);
+    deferred_media = nullptr;
+    if(ec)
+        throw std::runtime_error("Failed to serialize request: " + glz::format_error(ec, chunked->skeleton));
+    if(chunked->media.empty())
+        return std::move(chunked->skeleton);
+    return internal::BodyWriter([chunked](std::string& chunk) { return chunked->next(chunk); });
+}
+
+internal::HttpStreamBody tllf::internal::writeChatBody(const std::vector<ChatEntry>& messages)
+{
+    return writeRequestBody(messages, estimateJsonSize(messages));
+}
+
 struct OpenAIErrorData
 {
     int code;
@@ -155,47 +620,254 @@ struct OpenAIError
     OpenAIErrorData error;
 };
 
+[[noreturn]] static void throwErrorResponse(const std::string& body)
+{
+    std::vector<OpenAIError> error;
+    auto ec = glz::read<glz::opts{.error_on_unknown_keys=false}>(error, body);
+    if(ec)
+        throw std::runtime_error("Failed to parse error response: " + glz::format_error(ec, body));
+    if(error.size() == 0)
+        throw std::runtime_error("Unknown error");
+    throw std::runtime_error(error[0].error.message);
+}
+
+/**
+ * Run one chat completion as a server-sent event stream and assemble the first choice from its deltas.
+ *
+ * Stop strings are matched on the client as the text arrives and stop_when is asked after every delta. Either
+ * one ending the generation closes the connection, so the server stops generating as well.
+*/
+static Task<OpenAIResponse::Choice> streamChat(uint32_t endpoint, std::string path, const std::string& api_key
+    , internal::HttpStreamBody body, const TextGenerationConfig& config)
+{
+    OpenAIResponse::Choice choice{};
+    choice.message.role = "assistant";
+    std::string content;
+    StopMatcher matcher(config.stop);
+    // Bytes of content already given to on_text
+    size_t emitted = 0;
+    bool stopped = false;
+    std::exception_ptr error;
+    internal::SseParser sse;
+
+    auto on_event = [&](std::string_view data) {
+        if(data == "[DONE]")
+            return true;
+        OpenAIStreamChunk chunk;
+        auto ec = glz::read<glz::opts{.error_on_unknown_keys=false}>(chunk, data);
+        if(ec)
+            throw std::runtime_error("Failed to parse stream chunk: " + glz::format_error(ec, data));
+        for(auto& c : chunk.choices) {
+            if(c.index != 0)
+                continue;
+            if(c.finish_reason.has_value())
+                choice.finish_reason = *c.finish_reason;
+            for(auto& delta : c.delta.tool_calls) {
+                auto& calls = choice.message.tool_calls;
+                if(delta.index >= calls.size())
+                    calls.resize(delta.index + 1);
+                auto& call = calls[delta.index];
+                if(delta.id.has_value())
+                    call.id = std::move(*delta.id);
+                if(delta.type.has_value())
+                    call.type = std::move(*delta.type);
+                if(delta.function.name.has_value())
+                    call.function.name += *delta.function.name;
+                if(delta.function.arguments.has_value())
+                    call.function.arguments += *delta.function.arguments;
+                if(delta.extra_content.has_value())
+                    call.extra_content = std::move(*delta.extra_content);
+            }
+            if(!c.delta.content.has_value() || c.delta.content->empty())
+                continue;
+
+            size_t before = content.size();
+            content += *c.delta.content;
+            if(auto match = matcher.feed(*c.delta.content)) {
+                content.resize(*match);
+                stopped = true;
+            }
+            else if(config.stop_when && config.stop_when(content, std::string_view(content).substr(before)))
+                stopped = true;
+
+            if(config.on_text) {
+                // Hold back what may turn out to be the start of a stop string
+                size_t ready = stopped ? content.size() : content.size() - std::min(matcher.pending(), content.size());
+                if(ready > emitted) {
+                    config.on_text(std::string_view(content).substr(emitted, ready - emitted));
+                    emitted = ready;
+                }
+            }
+            if(stopped) {
+                choice.finish_reason = "stop";
+                return false;
+            }
+        }
+        return true;
+    };
+
+    auto result = co_await internal::streamRequest(endpoint, "POST", std::move(path), {
+            {"Authorization", "Bearer " + api_key},
+            {"Content-Type", "application/json"},
+            {"Accept", "text/event-stream"}
+        }, std::move(body), [&](std::string_view bytes) {
+            // Do not throw through the connection's callbacks. Rethrown below
+            try {
+                return sse.feed(bytes, on_event);
+            }
+            catch(...) {
+                error = std::current_exception();
+                return false;
+            }
+        }, nullptr, config.cancel);
+    if(error)
+        std::rethrow_exception(error);
+
+    LOG_TRACE << "status = " << result.status;
+    if(result.status == k429TooManyRequests)
+        throw LLM::RateLimitError(result.retry_after.empty() ? 2000. : std::stod(result.retry_after) * 1000);
+    else if(result.status != k200OK)
+        throwErrorResponse(result.body);
+
+    if(config.on_text && content.size() > emitted)
+        config.on_text(std::string_view(content).substr(emitted));
+    for(auto& call : choice.message.tool_calls) {
+        if(call.type.empty())
+            call.type = "function";
+    }
+    choice.message.content = std::move(content);
+    co_return choice;
+}
+
 OpenAIConnector::OpenAIConnector(const std::string& model_name, const std::string& hoststr, const std::string& api_key, std::vector<glz::generic> builtin_tools)
     : model_name(model_name), api_key(api_key), builtin_tools(builtin_tools)
 {
-    Url url(hoststr);
-    if(!url.validate())
+    UrlView url(hoststr);
+    if(!url.good() || url.protocol().empty())
         throw std::runtime_error("Invalid URL: " + hoststr);
-    base = url.path();
-    client = internal::getClient(url.withFragment("").withParam("").str(), drogon::app().getLoop());
+    base = url.normalizedPath();
+    endpoint = internal::endpointId(url);
+    client = internal::getClient(endpoint, drogon::app().getLoop());
 }
 
-Task<std::string> LLM::generate(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools)
+std::shared_ptr<std::atomic<bool>> tllf::internal::watchEmitted(TextGenerationConfig& config)
+{
+    auto emitted = std::make_shared<std::atomic<bool>>(false);
+    if(config.on_text) {
+        config.on_text = [on_text = std::move(config.on_text), emitted](std::string_view delta) {
+            *emitted = true;
+            on_text(delta);
+        };
+    }
+    return emitted;
+}
+
+/**
+ * Run attempt until it succeeds, waiting between tries on errors that may go away. Stops as soon as cancel is,
+ * and once emitted is set, since a retry would stream the same text again.
+*/
+template <typename F>
+static auto retryRequest(F attempt, const CancellationToken& cancel, const std::atomic<bool>& emitted) -> decltype(attempt())
 {
     constexpr int max_retry = 4;
     for(int retry = 0; retry < max_retry; retry++) {
+        cancel.throwIfCancelled();
         bool errored = false;
         // By defaul retry after 500ms
         double retry_delay = 0.5;
         try {
-            co_return co_await generateImpl(history, std::move(config), tools);
+            co_return co_await attempt();
         }
-        catch(const RateLimitError& e) {
+        catch(const LLM::RateLimitError& e) {
+            if(emitted)
+                throw;
             errored = true;
             if(e.until_reset_ms.has_value())
                 retry_delay = e.until_reset_ms.value() / 1000;
         }
         catch(const HttpException& e) {
+            if(emitted)
+                throw;
             errored = true;
         }
         catch(const std::runtime_error& e) {
+            if(emitted)
+                throw;
             errored = true;
             LOG_ERROR << "LLM request failed: " << e.what();
         }
 
         if(errored) {
-            co_await drogon::sleepCoro(trantor::EventLoop::getEventLoopOfCurrentThread(), retry_delay);
+            co_await withCancellation(drogon::sleepCoro(trantor::EventLoop::getEventLoopOfCurrentThread(), retry_delay), cancel);
         }
     }
     throw std::runtime_error("Request failed. Retried " + std::to_string(max_retry) + " times.");
 }
 
-drogon::Task<std::string> OpenAIConnector::generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools)
+Task<std::string> LLM::generate(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools)
+{
+    auto emitted = internal::watchEmitted(config);
+    co_return co_await retryRequest([&]() { return generateImpl(history, config, tools); }, config.cancel, *emitted);
+}
+
+Task<std::vector<std::string>> LLM::sample(const Chatlog& history, size_t n, TextGenerationConfig config)
+{
+    if(n == 0)
+        co_return {};
+    auto emitted = internal::watchEmitted(config);
+    co_return co_await retryRequest([&]() { return sampleImpl(history, n, config); }, config.cancel, *emitted);
+}
+
+Task<std::string> LLM::generateBest(Chatlog& history, size_t n, SampleSelector select, TextGenerationConfig config)
+{
+    auto samples = co_await sample(history, std::max<size_t>(n, 1), std::move(config));
+    if(samples.empty())
+        throw std::runtime_error("No samples generated");
+    size_t best = select ? select(samples) : 0;
+    if(best >= samples.size())
+        throw std::runtime_error("Sample selector returned index " + std::to_string(best) + " out of " + std::to_string(samples.size()));
+    history.push_back(samples[best], "assistant");
+    co_return std::move(samples[best]);
+}
+
+Task<std::vector<std::string>> LLM::sampleImpl(const Chatlog& history, size_t n, TextGenerationConfig config)
+{
+    std::vector<Chatlog> logs(n, history);
+    std::vector<Task<std::string>> runs;
+    runs.reserve(n);
+    for(auto& log : logs)
+        runs.push_back(generateImpl(log, config));
+    co_return co_await when_all(std::move(runs));
+}
+
+// The API takes up to 4 stop strings. Any beyond that are matched on the client, which needs a stream
+static constexpr size_t max_api_stops = 4;
+
+static bool needsStream(const TextGenerationConfig& config)
+{
+    return config.on_text || config.stop_when || config.stop.size() > max_api_stops;
+}
+
+static OpenAIDataBody makeChatBody(const std::string& model_name, const Chatlog& history, TextGenerationConfig& config)
+{
+    OpenAIDataBody body {
+        .model = model_name,
+        .messages = history,
+        .max_tokens = config.max_tokens,
+        .temperature = config.temperature,
+        .top_p = config.top_p,
+        .frequency_penalty = config.frequency_penalty,
+        .presence_penalty = config.presence_penalty,
+        .response_format = std::move(config.response_format)
+    };
+    if(!config.stop.empty())
+        body.stop.emplace(config.stop.begin(), config.stop.begin() + std::min(config.stop.size(), max_api_stops));
+    if(needsStream(config))
+        body.stream = true;
+    return body;
+}
+
+static HttpRequestPtr makeChatRequest(const std::string& base, const std::string& api_key)
 {
     drogon::HttpRequestPtr req = drogon::HttpRequest::newHttpRequest();
     auto p = std::filesystem::path(base) / "chat/completions";
@@ -204,6 +876,84 @@ drogon::Task<std::string> OpenAIConnector::generateImpl(Chatlog& history, TextGe
     req->addHeader("Authorization", "Bearer " + api_key);
     req->addHeader("Accept", "application/json");
     req->setMethod(drogon::HttpMethod::Post);
+    return req;
+}
+
+static OpenAIResponse parseChatResponse(int status, const std::string& retry_after, std::string_view body)
+{
+    LOG_TRACE << "status = " << status;
+    LOG_TRACE << "Response: " << body;
+    if(status == k429TooManyRequests)
+        throw LLM::RateLimitError((retry_after.empty() ? 2. : std::stod(retry_after)) * 1000);
+    else if(status != k200OK)
+        throwErrorResponse(std::string(body));
+
+    OpenAIResponse response;
+    auto ec = glz::read<glz::opts{.error_on_unknown_keys=false}>(response, body);
+    if(ec)
+        throw std::runtime_error("Failed to parse response: " + glz::format_error(ec, body));
+    if(response.choices.size() == 0)
+        throw std::runtime_error("Server response does not contain any choices");
+    return response;
+}
+
+// Post a JSON body and collect the whole response
+static Task<internal::HttpStreamResult> postJson(HttpClientPtr client, uint32_t endpoint, HttpRequestPtr req, internal::HttpStreamBody body, CancellationToken cancel)
+{
+    // The shared client needs the whole body up front, and cannot drop a request it already sent. A token that can
+    // only end by cancel() gets a connection of our own, which is closed on cancel so the server stops working too
+    if(body.writer || (cancel.cancellable() && !cancel.deadline())) {
+        std::string response_body;
+        auto result = co_await internal::streamRequest(endpoint, "POST", req->path(), {
+                {"Authorization", req->getHeader("Authorization")},
+                {"Content-Type", "application/json"},
+                {"Accept", "application/json"}
+            }, std::move(body), [&](std::string_view bytes) {
+                response_body += bytes;
+                return true;
+            }, nullptr, cancel);
+        if(result.status == k200OK)
+            result.body = std::move(response_body);
+        co_return result;
+    }
+
+    req->setBody(std::move(body.text));
+    req->setContentTypeCode(CT_APPLICATION_JSON);
+    HttpResponsePtr resp;
+    if(cancel.cancellable()) {
+        // A deadline keeps the pooled connection: the client drops the request by itself once it passes. An earlier
+        // cancel only stops the wait and the late response is dropped
+        cancel.throwIfCancelled();
+        try {
+            resp = co_await withCancellation(client->sendRequestCoro(req, *cancel.remaining()), cancel);
+        }
+        catch(...) {
+            // The client's timeout is the deadline
+            cancel.throwIfCancelled();
+            throw;
+        }
+    }
+    else
+        resp = co_await client->sendRequestCoro(req);
+
+    internal::HttpStreamResult result;
+    result.status = resp->statusCode();
+    result.retry_after = resp->getHeader("Retry-After");
+    if(result.retry_after.empty())
+        result.retry_after = resp->getHeader("X-RateLimit-Reset");
+    result.body = resp->body();
+    co_return result;
+}
+
+static Task<OpenAIResponse> sendChat(HttpClientPtr client, uint32_t endpoint, HttpRequestPtr req, internal::HttpStreamBody body, CancellationToken cancel)
+{
+    auto result = co_await postJson(std::move(client), endpoint, std::move(req), std::move(body), std::move(cancel));
+    co_return parseChatResponse(result.status, result.retry_after, result.body);
+}
+
+drogon::Task<std::string> OpenAIConnector::generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools)
+{
+    auto req = makeChatRequest(base, api_key);
 
     std::vector<std::variant<OpenAIToolDesc, glz::generic>> tools_desc;
     tools_desc.reserve(tools.size() + builtin_tools.size());
@@ -217,52 +967,24 @@ drogon::Task<std::string> OpenAIConnector::generateImpl(Chatlog& history, TextGe
         tools_desc.push_back(tool);
     }
 
-    OpenAIDataBody body {
-        .model = model_name,
-        .messages = history,
-        .max_tokens = config.max_tokens,
-        .temperature = config.temperature,
-        .top_p = config.top_p,
-        .frequency_penalty = config.frequency_penalty,
-        .presence_penalty = config.presence_penalty,
-        .stop_sequence = config.stop_sequence,
-        .tools = tools.empty() ? std::nullopt : std::make_optional(std::move(tools_desc))
-    };
+    OpenAIDataBody body = makeChatBody(model_name, history, config);
+    if(!tools.empty())
+        body.tools = std::move(tools_desc);
+    const bool streaming = body.stream.has_value();
 
     const size_t max_iterations = 30;
 
     OpenAIResponse response;
     for(size_t i = 0; i < max_iterations; ++i) {
-        std::string body_str = glz::write_json(body).value();
-        LOG_TRACE << "Request: " << body_str;
-        req->setBody(body_str);
-        req->setContentTypeCode(CT_APPLICATION_JSON);
-        auto resp = co_await client->sendRequestCoro(req);
-        LOG_TRACE << "status = " << static_cast<int>(resp->statusCode());
-        LOG_TRACE << "Response: " << resp->body();
-        if(resp->statusCode() == k429TooManyRequests) {
-            double until_reset = 2.;
-            if(resp->getHeader("Retry-After") != "")
-                until_reset = std::stod(resp->getHeader("Retry-After"));
-            else if(resp->getHeader("X-RateLimit-Reset") != "")
-                until_reset = std::stod(resp->getHeader("X-RateLimit-Reset"));
-            throw RateLimitError(until_reset * 1000);
-        }
-        else if(resp->statusCode() != k200OK) {
-            std::vector<OpenAIError> error;
-            auto ec = glz::read<glz::opts{.error_on_unknown_keys=false}>(error, resp->body());
-            if(ec)
-                throw std::runtime_error("Failed to parse error response: " + glz::format_error(ec, resp->body()));
-            if(error.size() == 0)
-                throw std::runtime_error("Unknown error");
-            throw std::runtime_error(error[0].error.message);
+        config.cancel.throwIfCancelled();
+        auto request_body = writeRequestBody(body, estimateJsonSize(body.messages));
+        LOG_TRACE << "Request: " << (request_body.writer ? "(chunked)" : request_body.text);
+        if(streaming) {
+            response.choices.clear();
+            response.choices.push_back(co_await streamChat(endpoint, req->path(), api_key, std::move(request_body), config));
         }
-
-        auto ec = glz::read<glz::opts{.error_on_unknown_keys=false}>(response, resp->body());
-        if(ec)
-            throw std::runtime_error("Failed to parse response: " + glz::format_error(ec, resp->body()));
-        if(response.choices.size() == 0)
-            throw std::runtime_error("Server response does not contain any choices");
+        else
+            response = co_await sendChat(client, endpoint, req, std::move(request_body), config.cancel);
 
         const auto& choice = response.choices[0];
         if(response.choices.empty()) {
@@ -300,9 +1022,11 @@ drogon::Task<std::string> OpenAIConnector::generateImpl(Chatlog& history, TextGe
                 args = tool_call.function.arguments;
 
             std::cout << "[Running tool: " << it->name << "]" << std::endl;
-            invocations.push_back(it->func(args));
+            invocations.push_back(it->invoke(args, config.cancel));
         }
+        // Running tools are not abandoned, they may use the caller's data. They see the token and stop early
         auto res = co_await when_all(std::move(invocations));
+        config.cancel.throwIfCancelled();
         assert(res.size() == tool_calls.size());
         for(size_t i = 0; i < res.size(); ++i) {
             auto& r = res[i];
@@ -324,6 +1048,32 @@ drogon::Task<std::string> OpenAIConnector::generateImpl(Chatlog& history, TextGe
     co_return "";
 }
 
+Task<std::vector<std::string>> OpenAIConnector::sampleImpl(const Chatlog& history, size_t n, TextGenerationConfig config)
+{
+    // A stream is read for its first choice only
+    if(needsStream(config))
+        co_return co_await LLM::sampleImpl(history, n, std::move(config));
+
+    OpenAIDataBody body = makeChatBody(model_name, history, config);
+    body.n = n;
+    auto request_body = writeRequestBody(body, estimateJsonSize(body.messages));
+    LOG_TRACE << "Request: " << (request_body.writer ? "(chunked)" : request_body.text);
+    auto response = co_await sendChat(client, endpoint, makeChatRequest(base, api_key), std::move(request_body), config.cancel);
+
+    std::sort(response.choices.begin(), response.choices.end(), [](const auto& a, const auto& b) {
+        return a.index < b.index;
+    });
+    std::vector<std::string> samples;
+    samples.reserve(response.choices.size());
+    for(auto& choice : response.choices) {
+        if(std::holds_alternative<std::string>(choice.message.content))
+            samples.push_back(std::move(std::get<std::string>(choice.message.content)));
+        else
+            samples.emplace_back();
+    }
+    co_return samples;
+}
+
 std::string PromptTemplate::render() const
 {
     std::string rendered = prompt;
@@ -383,6 +1133,212 @@ std::unordered_set<std::string> PromptTemplate::extractVars(const std::string& p
     return prompt_vars;
 }
 
+static void compilePrompt(CompiledPrompt& out, const std::string& prompt, const std::unordered_map<std::string, std::string>& defaults
+    , std::unordered_map<std::string, size_t>& slots, size_t depth)
+{
+    // Same limit as PromptTemplate::render()
+    if(depth > 6)
+        throw std::runtime_error("Variable replacements haven't converged after 6 runs. Please check for circular dependencies.");
+
+    size_t literal_begin = out.literals.size();
+    auto flush = [&]() {
+        if(out.literals.size() != literal_begin)
+            out.segments.push_back({literal_begin, out.literals.size() - literal_begin, CompiledPrompt::Segment::literal});
+        literal_begin = out.literals.size();
+    };
+
+    for(size_t i = 0; i < prompt.size(); i++) {
+        char ch = prompt[i];
+        if(ch == '\\') {
+            if(i + 1 >= prompt.size())
+                throw std::runtime_error("Escape character at end of prompt");
+            // Escapes are kept as-is, like render() does
+            out.literals += prompt.substr(i, 2);
+            i++;
+            continue;
+        }
+        else if(ch != '{') {
+            out.literals += ch;
+            continue;
+        }
+
+        size_t end = prompt.find_first_of("{}\n\\", i + 1);
+        if(end == std::string::npos)
+            throw std::runtime_error("Unmatched curly brace in prompt");
+        else if(prompt[end] == '\n') {
+            // A newline ends the variable. Everything up to here is plain text
+            out.literals += prompt.substr(i, end - i + 1);
+            i = end;
+            continue;
+        }
+        else if(prompt[end] == '{')
+            throw std::runtime_error("Nested curly braces in prompt");
+        else if(prompt[end] == '\\')
+            throw std::runtime_error("Escape character inside variable name");
+
+        std::string name = prompt.substr(i + 1, end - i - 1);
+        i = end;
+        flush();
+        auto it = defaults.find(name);
+        if(it != defaults.end()) {
+            compilePrompt(out, it->second, defaults, slots, depth + 1);
+            literal_begin = out.literals.size();
+            continue;
+        }
+        auto [slot, inserted] = slots.try_emplace(name, out.slot_names.size());
+        if(inserted)
+            out.slot_names.push_back(name);
+        out.segments.push_back({0, 0, slot->second});
+    }
+    flush();
+}
+
+CompiledPrompt::CompiledPrompt(const std::string& prompt, const std::unordered_map<std::string, std::string>& defaults)
+{
+    std::unordered_map<std::string, size_t> slots;
+    compilePrompt(*this, prompt, defaults, slots, 0);
+}
+
+std::string CompiledPrompt::render(const std::unordered_map<std::string, std::string>& values, const std::unordered_map<std::string, std::string>& fallback) const
+{
+    std::vector<const std::string*> slot_values;
+    slot_values.reserve(slot_names.size());
+    size_t size = 0;
+    for(auto& name : slot_names) {
+        auto it = values.find(name);
+        if(it != values.end()) {
+            slot_values.push_back(&it->second);
+            continue;
+        }
+        it = fallback.find(name);
+        if(it == fallback.end())
+            throw std::runtime_error("Variable " + name + " not found in variables map");
+        slot_values.push_back(&it->second);
+    }
+    for(auto& seg : segments)
+        size += seg.slot == Segment::literal ? seg.size : slot_values[seg.slot]->size();
+
+    std::string rendered;
+    rendered.reserve(size);
+    for(auto& seg : segments) {
+        if(seg.slot == Segment::literal)
+            rendered.append(literals, seg.offset, seg.size);
+        else
+            rendered += *slot_values[seg.slot];
+    }
+    return rendered;
+}
+
+RenderedBatch CompiledPrompt::renderBatch(const PromptColumns& columns) const
+{
+    std::vector<std::span<const std::string>> cols;
+    cols.reserve(slot_names.size());
+    size_t rows = columns.empty() ? 0 : columns.begin()->second.size();
+    for(auto& name : slot_names) {
+        auto it = columns.find(name);
+        if(it == columns.end())
+            throw std::runtime_error("Variable " + name + " not found in columns");
+        cols.push_back(it->second);
+    }
+    for(auto& [name, col] : columns) {
+        if(col.size() != rows)
+            throw std::runtime_error("Column " + name + " has " + std::to_string(col.size()) + " rows, expected " + std::to_string(rows));
+    }
+
+    size_t literal_size = 0;
+    for(auto& seg : segments) {
+        if(seg.slot == Segment::literal)
+            literal_size += seg.size;
+    }
+
+    RenderedBatch batch;
+    batch.offsets.resize(rows + 1);
+    batch.offsets[0] = 0;
+    // First pass: the size of every row. Then a prefix sum turns them into offsets
+    tllf::utils::parallelFor(rows, [&](size_t begin, size_t end) {
+        for(size_t row = begin; row < end; row++) {
+            size_t size = literal_size;
+            for(auto& seg : segments) {
+                if(seg.slot != Segment::literal)
+                    size += cols[seg.slot][row].size();
+            }
+            batch.offsets[row + 1] = size;
+        }
+    });
+    for(size_t row = 0; row < rows; row++)
+        batch.offsets[row + 1] += batch.offsets[row];
+
+    // Second pass: every row writes into its own part of the arena
+    batch.arena.resize(batch.offsets[rows]);
+    tllf::utils::parallelFor(rows, [&](size_t begin, size_t end) {
+        for(size_t row = begin; row < end; row++) {
+            char* ptr = batch.arena.data() + batch.offsets[row];
+            for(auto& seg : segments) {
+                if(seg.slot == Segment::literal) {
+                    ptr = std::copy_n(literals.data() + seg.offset, seg.size, ptr);
+                }
+                else {
+                    const auto& val = cols[seg.slot][row];
+                    ptr = std::copy_n(val.data(), val.size(), ptr);
+                }
+            }
+        }
+    });
+    return batch;
+}
+
+std::vector<std::string_view> RenderedBatch::views() const
+{
+    std::vector<std::string_view> res;
+    res.reserve(size());
+    for(size_t i = 0; i < size(); i++)
+        res.push_back((*this)[i]);
+    return res;
+}
+
+std::vector<std::string> RenderedBatch::strings() const
+{
+    std::vector<std::string> res;
+    res.reserve(size());
+    for(size_t i = 0; i < size(); i++)
+        res.emplace_back((*this)[i]);
+    return res;
+}
+
+std::unordered_map<std::string, std::vector<std::string>> tllf::readJsonlColumns(std::istream& in)
+{
+    std::unordered_map<std::string, std::vector<std::string>> columns;
+    std::string line;
+    size_t row = 0;
+    while(std::getline(in, line)) {
+        if(tllf::utils::trim(line).empty())
+            continue;
+        glz::generic json;
+        auto ec = glz::read_json(json, line);
+        if(ec)
+            throw std::runtime_error("Failed to parse JSONL row " + std::to_string(row) + ": " + glz::format_error(ec, line));
+        if(!json.is_object())
+            throw std::runtime_error("JSONL row " + std::to_string(row) + " is not an object");
+
+        auto& obj = json.get_object();
+        if(row == 0) {
+            for(auto& [key, _] : obj)
+                columns[key];
+        }
+        for(auto& [name, col] : columns) {
+            auto it = obj.find(name);
+            if(it == obj.end())
+                throw std::runtime_error("JSONL row " + std::to_string(row) + " is missing column " + name);
+            if(it->second.is_string())
+                col.push_back(it->second.get_string());
+            else
+                col.push_back(glz::write_json(it->second).value());
+        }
+        row++;
+    }
+    return columns;
+}
+
 Task<std::vector<float>> DeepinfraTextEmbedder::embed(std::string text)
 {
     std::vector<std::string> texts = {std::move(text)};
@@ -396,7 +1352,8 @@ struct DeepinfraEmbedDataBody
 
 struct DeepinfraEmbedResponse
 {
-    std::vector<std::vector<float>> embeddings;
+    // Kept raw and parsed by parseJsonMatrix() straight into contiguous memory
+    glz::raw_json embeddings;
 };
 
 struct DeepinfraEmbedError
@@ -406,6 +1363,11 @@ struct DeepinfraEmbedError
 
 
 Task<std::vector<std::vector<float>>> DeepinfraTextEmbedder::embed(std::vector<std::string> texts)
+{
+    co_return (co_await embedMatrix(std::move(texts))).toVectors();
+}
+
+Task<EmbeddingMatrix> DeepinfraTextEmbedder::embedMatrix(std::vector<std::string> texts)
 {
     HttpRequestPtr req = HttpRequest::newHttpRequest();
     req->setPath("/v1/inference/" + model_name);
@@ -413,8 +1375,10 @@ Task<std::vector<std::vector<float>>> DeepinfraTextEmbedder::embed(std::vector<s
     req->setMethod(HttpMethod::Post);
     DeepinfraEmbedDataBody body;
     body.inputs = std::move(texts);
-    auto body_str = glz::write_json(body).value();
-    req->setBody(body_str);
+    size_t size_hint = 0;
+    for(const auto& text : body.inputs)
+        size_hint += text.size() + text.size() / 8 + 4;
+    req->setBody(writeJsonBody(body, size_hint));
     req->setContentTypeCode(CT_APPLICATION_JSON);
     auto resp = co_await client->sendRequestCoro(req);
     if(resp->statusCode() != k200OK) {
@@ -429,7 +1393,195 @@ Task<std::vector<std::vector<float>>> DeepinfraTextEmbedder::embed(std::vector<s
     auto ec = glz::read<glz::opts{.error_on_unknown_keys=false}>(response, resp->body());
     if(ec)
         throw std::runtime_error("Failed to parse response: " + glz::format_error(ec, resp->body()));
-    co_return response.embeddings;
+    EmbeddingMatrix res;
+    internal::parseJsonMatrix(response.embeddings.str, res);
+    co_return res;
+}
+
+struct OpenAIEmbedDataBody
+{
+    std::string model;
+    std::vector<std::string> input;
+    std::string encoding_format = "base64";
+    std::optional<int> dimensions;
+};
+
+struct OpenAIEmbedResponse
+{
+    struct Item
+    {
+        // A base64 string normally. Some servers send a plain array of numbers anyway
+        glz::raw_json embedding;
+        size_t index;
+    };
+    std::vector<Item> data;
+};
+
+/**
+ * Decode a base64 embedding into out, which holds exactly dim floats.
+*/
+static void decodeBase64Row(std::string_view b64, float* out, size_t dim)
+{
+    const size_t bytes = dim * sizeof(float);
+    char* dst = reinterpret_cast<char*>(out);
+    // The decoder may write up to 3 bytes past the data. Decode what surely fits in place and the tail via a buffer
+    size_t bulk = std::min(bytes >= 3 ? (bytes - 3) / 3 * 4 : 0, b64.size() / 4 * 4);
+    size_t n = tllf::utils::base64Decode(b64.substr(0, bulk), dst);
+    auto rest = b64.substr(bulk);
+    char tail[32];
+    if(tllf::utils::base64DecodedSize(rest.size()) > sizeof(tail))
+        throw std::runtime_error("Embedding is longer than " + std::to_string(dim) + " floats");
+    size_t tail_size = tllf::utils::base64Decode(rest, tail);
+    if(n + tail_size != bytes)
+        throw std::runtime_error("Embedding has " + std::to_string(n + tail_size) + " bytes, expected " + std::to_string(bytes));
+    std::copy(tail, tail + tail_size, dst + n);
+}
+
+/**
+ * The content of a raw JSON string. Base64 needs no escaping, so the quotes are simply cut off unless the server
+ * escaped something anyway, like "\/".
+ * @param scratch Holds the unescaped content if there was any escape
+*/
+static std::string_view jsonStringContent(std::string_view quoted, std::string& scratch)
+{
+    if(quoted.find('\\') == std::string_view::npos)
+        return quoted.substr(1, quoted.size() - 2);
+    // glaze wants a null terminated buffer, which a slice of the response is not
+    std::string copy(quoted);
+    scratch.clear();
+    auto ec = glz::read_json(scratch, copy);
+    if(ec)
+        throw std::runtime_error("Failed to parse embedding: " + glz::format_error(ec, copy));
+    return scratch;
+}
+
+OpenAITextEmbedder::OpenAITextEmbedder(const std::string& model_name, const std::string& hoststr, const std::string& api_key, std::optional<int> dimensions)
+    : model_name(model_name), api_key(api_key), dimensions(dimensions)
+{
+    UrlView url(hoststr);
+    if(!url.good() || url.protocol().empty())
+        throw std::runtime_error("Invalid URL: " + hoststr);
+    base = url.normalizedPath();
+    endpoint = internal::endpointId(url);
+    client = internal::getClient(endpoint, drogon::app().getLoop());
+}
+
+EmbeddingMatrix tllf::internal::parseEmbeddingResponse(std::string_view body, size_t n)
+{
+    OpenAIEmbedResponse response;
+    auto ec = glz::read<glz::opts{.error_on_unknown_keys=false}>(response, body);
+    if(ec)
+        throw std::runtime_error("Failed to parse response: " + glz::format_error(ec, body));
+    if(response.data.size() != n)
+        throw std::runtime_error("Server returned " + std::to_string(response.data.size()) + " embeddings for " + std::to_string(n) + " texts");
+
+    EmbeddingMatrix res;
+    if(n == 0)
+        return res;
+
+    // The first item decides the dimension. Every row is then decoded straight into its place
+    std::string_view first = tllf::utils::trim(response.data[0].embedding.str);
+    std::string unescaped;
+    size_t dim = 0;
+    if(first.starts_with('"')) {
+        auto b64 = jsonStringContent(first, unescaped);
+        while(b64.ends_with('='))
+            b64.remove_suffix(1);
+        size_t bytes = b64.size() * 3 / 4;
+        if(bytes % sizeof(float) != 0)
+            throw std::runtime_error("Base64 embedding is not a whole number of floats");
+        dim = bytes / sizeof(float);
+    }
+    else {
+        EmbeddingMatrix single;
+        parseJsonMatrix("[" + std::string(first) + "]", single);
+        dim = single.dim();
+    }
+    res = EmbeddingMatrix(n, dim);
+
+    // There are as many items as texts, so with no index twice every row gets filled
+    std::vector<bool> filled(n, false);
+    for(const auto& item : response.data) {
+        if(item.index >= n)
+            throw std::runtime_error("Embedding index out of range");
+        if(filled[item.index])
+            throw std::runtime_error("Server returned embedding " + std::to_string(item.index) + " twice");
+        filled[item.index] = true;
+
+        // Items may come back in any order. index says which input they belong to
+        float* row = res.row(item.index);
+        std::string_view raw = tllf::utils::trim(item.embedding.str);
+        if(raw.starts_with('"')) {
+            decodeBase64Row(jsonStringContent(raw, unescaped), row, dim);
+            if constexpr(std::endian::native == std::endian::big) {
+                for(size_t i = 0; i < dim; i++)
+                    row[i] = std::bit_cast<float>(std::byteswap(std::bit_cast<uint32_t>(row[i])));
+            }
+        }
+        else {
+            EmbeddingMatrix single;
+            parseJsonMatrix("[" + std::string(raw) + "]", single);
+            if(single.dim() != dim)
+                throw std::runtime_error("Embedding has dimension " + std::to_string(single.dim()) + ", expected " + std::to_string(dim));
+            std::copy(single.data(), single.data() + dim, row);
+        }
+    }
+    return res;
+}
+
+Task<std::vector<float>> OpenAITextEmbedder::embed(std::string text)
+{
+    return embed(std::move(text), CancellationToken());
+}
+
+Task<std::vector<std::vector<float>>> OpenAITextEmbedder::embed(std::vector<std::string> texts)
+{
+    return embed(std::move(texts), CancellationToken());
+}
+
+Task<EmbeddingMatrix> OpenAITextEmbedder::embedMatrix(std::vector<std::string> texts)
+{
+    return embedMatrix(std::move(texts), CancellationToken());
+}
+
+Task<std::vector<float>> OpenAITextEmbedder::embed(std::string text, CancellationToken cancel)
+{
+    std::vector<std::string> texts = {std::move(text)};
+    co_return (co_await embed(std::move(texts), std::move(cancel)))[0];
+}
+
+Task<std::vector<std::vector<float>>> OpenAITextEmbedder::embed(std::vector<std::string> texts, CancellationToken cancel)
+{
+    co_return (co_await embedMatrix(std::move(texts), std::move(cancel))).toVectors();
+}
+
+Task<EmbeddingMatrix> OpenAITextEmbedder::embedMatrix(std::vector<std::string> texts, CancellationToken cancel)
+{
+    HttpRequestPtr req = HttpRequest::newHttpRequest();
+    auto p = std::filesystem::path(base) / "embeddings";
+    req->setPath(p.lexically_normal().string());
+    req->addHeader("Authorization", "Bearer " + api_key);
+    req->setMethod(HttpMethod::Post);
+
+    const size_t n = texts.size();
+    OpenAIEmbedDataBody body {
+        .model = model_name,
+        .input = std::move(texts),
+        .dimensions = dimensions
+    };
+    size_t size_hint = 0;
+    for(const auto& text : body.input)
+        size_hint += text.size() + text.size() / 8 + 4;
+    auto result = co_await postJson(client, endpoint, req, writeJsonBody(body, size_hint), std::move(cancel));
+    if(result.status != k200OK) {
+        OpenAIError error;
+        auto ec = glz::read<glz::opts{.error_on_unknown_keys=false}>(error, result.body);
+        if(ec)
+            throw std::runtime_error("Failed to parse error response: " + glz::format_error(ec, result.body));
+        throw std::runtime_error(error.error.message);
+    }
+
+    co_return internal::parseEmbeddingResponse(result.body, n);
 }
 
 std::string tllf::to_string(const Chatlog& chatlog)
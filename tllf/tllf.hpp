@@ -1,14 +1,20 @@
 #pragma once
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <drogon/CacheMap.h>
 #include <drogon/HttpClient.h>
 #include <drogon/HttpTypes.h>
 #include <exception>
+#include <functional>
 #include <initializer_list>
+#include <istream>
+#include <memory>
 #include <optional>
+#include <span>
 #include <string>
+#include <string_view>
 #include <sys/types.h>
 #include <trantor/net/EventLoop.h>
 #include <unordered_map>
@@ -17,14 +23,34 @@
 #include <unordered_set>
 #include <yaml-cpp/node/node.h>
 
+#include <glaze/json/read.hpp>
+#include <glaze/json/schema.hpp>
+
+#include <tllf/cancellation.hpp>
+#include <tllf/matrix.hpp>
+#include <tllf/structured.hpp>
 #include <tllf/utils.hpp>
 #include <tllf/tool.hpp>
 
 namespace tllf
 {
 
+struct UrlView;
+
 namespace internal
 {
+/**
+ * Intern the endpoint (protocol, host and port) of a URL into a small id. URLs that only differ in case, path,
+ * parameters or by spelling out the default port get the same id.
+ * @note Strings that are not URLs are interned as they are
+*/
+uint32_t endpointId(std::string_view url);
+uint32_t endpointId(const UrlView& url);
+/**
+ * The canonical protocol://host[:port] of an interned endpoint.
+*/
+std::string endpointString(uint32_t endpoint);
+drogon::HttpClientPtr getClient(uint32_t endpoint, trantor::EventLoop* loop = nullptr);
 drogon::HttpClientPtr getClient(const std::string& hoststr, trantor::EventLoop* loop = nullptr);
 std::string env(const std::string& key);
 }
@@ -37,12 +63,82 @@ struct TextGenerationConfig
     std::optional<int> top_p;
     std::optional<int> frequency_penalty;
     std::optional<int> presence_penalty;
-    std::optional<int> stop_sequence;
+    // Generation ends before the first of these strings. Any number of them, the API only takes 4 and the rest are
+    // matched while streaming
+    std::vector<std::string> stop;
+    std::optional<glz::generic> response_format; // Sent as is. See LLM::generate<T>() for JSON schemas
+    /**
+     * Checked each time more text arrives while streaming. Return true to end the generation there, the connection
+     * is closed so the server stops spending tokens on it.
+     * @param text All text generated so far
+     * @param delta The part of text that just arrived
+    */
+    std::function<bool(std::string_view text, std::string_view delta)> stop_when;
+    // Receives the text as it is generated. Never sees any part of a stop string
+    std::function<void(std::string_view delta)> on_text;
+    /**
+     * Gives up on the generation when cancelled or past its deadline, with CancelledError. Without a deadline,
+     * requests to the model are sent on their own connection, which is closed on cancel so the server stops
+     * generating. With one, they keep the pooled connection and time out at the deadline. Retries and tool loops
+     * stop, and tools get the token to stop early.
+    */
+    CancellationToken cancel;
+};
+
+/**
+ * URL of an image or other media. The payload is immutable and shared between copies, so copying a Chatlog or
+ * building a request body does not copy inline images.
+ *
+ * Inline data is either kept as raw bytes, which are base64 encoded while serializing, or as already encoded base64.
+*/
+struct MediaUrl
+{
+    enum class Encoding
+    {
+        Url,    // A plain URL. Including data: URLs given as a string
+        Base64, // Base64 payload of a data URL
+        Raw     // Raw bytes of a data URL
+    };
+
+    MediaUrl() = default;
+    MediaUrl(std::string url);
+    MediaUrl(const char* url) : MediaUrl(std::string(url)) {}
+
+    /**
+     * @param mime Such as "image/png". Throws if it has characters other than HTTP token characters and '/'
+    */
+    static MediaUrl fromBytes(std::string bytes, std::string mime);
+    static MediaUrl fromBase64(std::shared_ptr<const std::string> base64, std::string mime);
+    /**
+     * Reference a file's content. Uses the same cache as dataUrlfromFile().
+    */
+    static MediaUrl fromFile(const std::string& path, std::string mime = "");
+
+    Encoding encoding() const { return encoding_; }
+    const std::string& mime() const { return mime_; }
+    std::string_view payload() const { return data_ ? std::string_view(*data_) : std::string_view(); }
+
+    /**
+     * Length of the full URL. Computed without building it.
+    */
+    size_t size() const;
+    /**
+     * Write the full URL to out.
+     * @param out Must hold at least size() bytes
+     * @return Number of bytes written
+    */
+    size_t write(char* out) const;
+    std::string str() const;
+
+protected:
+    Encoding encoding_ = Encoding::Url;
+    std::shared_ptr<const std::string> data_;
+    std::string mime_;
 };
 
 struct ImageUrl
 {
-    std::string url;
+    MediaUrl url;
 };
 
 struct ImageByUrl
@@ -112,23 +208,51 @@ struct Chatlog : public std::vector<ChatEntry>
 
     void push_back(ChatEntry entry)
     {
-        std::vector<ChatEntry>::push_back(entry);
+        std::vector<ChatEntry>::push_back(std::move(entry));
     }
 
     void push_back(std::string content, std::string role)
     {
-        push_back(ChatEntry{.content = content, .role = role});
+        push_back(ChatEntry{.content = std::move(content), .role = std::move(role)});
     }
 
     void push_back(ChatEntry::Parts parts, std::string role)
     {
-        push_back(ChatEntry{.content = parts, .role = role});
+        push_back(ChatEntry{.content = std::move(parts), .role = std::move(role)});
     }
 
 };
 
 std::string to_string(const Chatlog& chatlog);
 
+namespace internal
+{
+/**
+ * The messages as they are serialized into a chat completions request.
+*/
+std::string writeChatJson(const std::vector<ChatEntry>& messages);
+struct HttpStreamBody;
+/**
+ * Same JSON as writeChatJson(), but large inline media are encoded while the body is sent, like a request does.
+ * @note Include tllf/http_stream.hpp to use the result
+*/
+HttpStreamBody writeChatBody(const std::vector<ChatEntry>& messages);
+
+/**
+ * Make config.on_text note when it is called. Text handed out cannot be taken back, so a request that already
+ * streamed some must not be retried or sent to another model.
+ * @return Set once on_text has received text
+*/
+std::shared_ptr<std::atomic<bool>> watchEmitted(TextGenerationConfig& config);
+
+/**
+ * Decode the body of an OpenAI compatible embeddings response into one row per input text. Embeddings may be base64
+ * strings or arrays of numbers and may come in any order.
+ * @param n Number of texts embedded
+*/
+EmbeddingMatrix parseEmbeddingResponse(std::string_view body, size_t n);
+}
+
 struct LLM
 {
     struct RateLimitError : public std::exception
@@ -146,10 +270,90 @@ struct LLM
      * TODO: Handle rate limiting
     */
     drogon::Task<std::string> generate(Chatlog& history, TextGenerationConfig config = TextGenerationConfig(), const std::vector<Tool>& tools = {});
+
+    /**
+     * Generate a response and parse it into T. A JSON schema derived from T is sent as the response format.
+     *
+     * The reply is parsed straight into T. If that fails the reply is unwrapped from any Markdown fence and
+     * syntactically repaired, then the model is shown the parse error and asked for a fix at most max_repairs times.
+     * The history ends with the reply as if it had been valid the first time.
+     * @param max_repairs How many times to ask the model to fix its reply. 0 to only repair locally
+     * @note Fields of T that are std::optional may be missing. Every other field is required
+    */
+    template <typename T>
+    drogon::Task<T> generate(Chatlog& history, TextGenerationConfig config = TextGenerationConfig(), size_t max_repairs = 1);
+
+    /**
+     * Sample n independent replies to the same history. Connectors that support it ask for all of them in one
+     * request, so the prompt is sent, processed and billed once instead of n times.
+     * @return The replies, in the order the server numbered them. history is left unchanged
+     * @note Tools are not available. Each sample would need its own tool loop
+    */
+    drogon::Task<std::vector<std::string>> sample(const Chatlog& history, size_t n, TextGenerationConfig config = TextGenerationConfig());
+
+    /**
+     * Pick one of several samples. Return its index.
+    */
+    using SampleSelector = std::function<size_t(const std::vector<std::string>& samples)>;
+
+    /**
+     * Best-of-n generation. Sample n replies in one request and append the one chosen by select to history.
+     * @param select Scores, votes on or otherwise picks a sample. The first sample is taken if empty
+    */
+    drogon::Task<std::string> generateBest(Chatlog& history, size_t n, SampleSelector select, TextGenerationConfig config = TextGenerationConfig());
 protected:
     virtual drogon::Task<std::string> generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools = {}) = 0;
+    /**
+     * The default implementation runs n generations concurrently. Override it when the backend can return
+     * several choices for one request.
+    */
+    virtual drogon::Task<std::vector<std::string>> sampleImpl(const Chatlog& history, size_t n, TextGenerationConfig config);
+
+    /**
+     * Call another LLM's generateImpl(). For adapters wrapping an LLM, whose own generate() already retries.
+    */
+    static drogon::Task<std::string> generateWith(LLM& llm, Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools)
+    {
+        return llm.generateImpl(history, std::move(config), tools);
+    }
+
+    static drogon::Task<std::vector<std::string>> sampleWith(LLM& llm, const Chatlog& history, size_t n, TextGenerationConfig config)
+    {
+        return llm.sampleImpl(history, n, std::move(config));
+    }
 };
 
+template <typename T>
+drogon::Task<T> LLM::generate(Chatlog& history, TextGenerationConfig config, size_t max_repairs)
+{
+    static const glz::generic format = internal::jsonSchemaFormat(glz::name_v<T>, glz::write_json_schema<T>().value());
+    constexpr auto opts = glz::opts{.error_on_unknown_keys = false, .error_on_missing_keys = true};
+    config.response_format = format;
+
+    std::string text = co_await generate(history, config);
+    const size_t reply = history.size() - 1;
+    T value{};
+    auto ec = glz::read<opts>(value, text);
+    if(!ec)
+        co_return value;
+
+    std::string fixed = repairJson(extractJson(text));
+    ec = glz::read<opts>(value, fixed);
+    for(size_t i = 0; ec && i < max_repairs; i++) {
+        history.push_back("Your reply does not match the requested JSON schema: " + glz::format_error(ec, fixed)
+            + "\nReply with the corrected JSON only.", "user");
+        text = co_await generate(history, config);
+        history.erase(history.begin() + reply + 1, history.end());
+        fixed = repairJson(extractJson(text));
+        value = T{};
+        ec = glz::read<opts>(value, fixed);
+    }
+    if(ec)
+        throw std::runtime_error("Failed to parse structured output: " + glz::format_error(ec, fixed));
+    history[reply].content = std::move(fixed);
+    co_return value;
+}
+
 struct TextEmbedder
 {
     virtual drogon::Task<std::vector<float>> embed(std::string text) = 0;
@@ -160,6 +364,32 @@ struct TextEmbedder
             res.push_back(co_await embed(text));
         co_return res;
     }
+
+    /**
+     * Embed texts into one contiguous matrix, one row per text.
+     * @note The default implementation repacks the result of embed(). Connectors override it to parse straight into the matrix.
+    */
+    virtual drogon::Task<EmbeddingMatrix> embedMatrix(std::vector<std::string> texts)
+    {
+        co_return EmbeddingMatrix::fromVectors(co_await embed(std::move(texts)));
+    }
+
+    /**
+     * Same as the calls above, but give up with CancelledError when cancel is cancelled. By default the request
+     * still finishes in the background, so the embedder must outlive it. Connectors override these to abort it.
+    */
+    virtual drogon::Task<std::vector<float>> embed(std::string text, CancellationToken cancel)
+    {
+        return withCancellation(embed(std::move(text)), std::move(cancel));
+    }
+    virtual drogon::Task<std::vector<std::vector<float>>> embed(std::vector<std::string> texts, CancellationToken cancel)
+    {
+        return withCancellation(embed(std::move(texts)), std::move(cancel));
+    }
+    virtual drogon::Task<EmbeddingMatrix> embedMatrix(std::vector<std::string> texts, CancellationToken cancel)
+    {
+        return withCancellation(embedMatrix(std::move(texts)), std::move(cancel));
+    }
 };
 
 struct DeepinfraTextEmbedder : public TextEmbedder
@@ -169,14 +399,48 @@ struct DeepinfraTextEmbedder : public TextEmbedder
     {
     }
 
+    using TextEmbedder::embed;
+    using TextEmbedder::embedMatrix;
     drogon::Task<std::vector<float>> embed(std::string text) override;
     drogon::Task<std::vector<std::vector<float>>> embed(std::vector<std::string> texts) override;
+    drogon::Task<EmbeddingMatrix> embedMatrix(std::vector<std::string> texts) override;
 
     drogon::HttpClientPtr client;
     std::string model_name;
     std::string api_key;
 };
 
+/**
+ * Embedder for OpenAI-compatible /embeddings endpoints. Also works with most local servers.
+ *
+ * Embeddings are requested as base64 encoded little-endian float32, which is decoded straight into the output.
+ * Servers that ignore encoding_format and send plain numbers are handled too.
+ * @param model_name The name of the model to use. For example, "text-embedding-3-small".
+ * @param baseurl The base URL of the API. Defaults to "https://api.openai.com/v1".
+ * @param api_key The API key to use
+ * @param dimensions Ask the model to truncate embeddings to this many dimensions. Not all models support it
+*/
+struct OpenAITextEmbedder : public TextEmbedder
+{
+    OpenAITextEmbedder(const std::string& model_name, const std::string& baseurl="https://api.openai.com/v1", const std::string& api_key="", std::optional<int> dimensions = std::nullopt);
+
+    using TextEmbedder::embed;
+    using TextEmbedder::embedMatrix;
+    drogon::Task<std::vector<float>> embed(std::string text) override;
+    drogon::Task<std::vector<std::vector<float>>> embed(std::vector<std::string> texts) override;
+    drogon::Task<EmbeddingMatrix> embedMatrix(std::vector<std::string> texts) override;
+    drogon::Task<std::vector<float>> embed(std::string text, CancellationToken cancel) override;
+    drogon::Task<std::vector<std::vector<float>>> embed(std::vector<std::string> texts, CancellationToken cancel) override;
+    drogon::Task<EmbeddingMatrix> embedMatrix(std::vector<std::string> texts, CancellationToken cancel) override;
+
+    drogon::HttpClientPtr client;
+    uint32_t endpoint = 0;
+    std::string base;
+    std::string model_name;
+    std::string api_key;
+    std::optional<int> dimensions;
+};
+
 /**
  * Connector for OpenAI-like API endpoints.
  *
@@ -191,14 +455,87 @@ struct OpenAIConnector : public LLM
     OpenAIConnector(const std::string& model_name, const std::string& baseurl="https://api.openai.com/", const std::string& api_key="", std::vector<glz::generic> builtin_tools = {});
 
     drogon::Task<std::string> generateImpl(Chatlog& history, TextGenerationConfig config, const std::vector<Tool>& tools = {});
+    drogon::Task<std::vector<std::string>> sampleImpl(const Chatlog& history, size_t n, TextGenerationConfig config) override;
 
     drogon::HttpClientPtr client;
+    uint32_t endpoint = 0;
     std::string base;
     std::string model_name;
     std::string api_key;
     std::vector<glz::generic> builtin_tools;
 };
 
+/**
+ * Many rendered prompts stored back to back in one buffer.
+ * Row i lives in arena[offsets[i], offsets[i+1]).
+*/
+struct RenderedBatch
+{
+    std::string arena;
+    std::vector<size_t> offsets;
+
+    size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    std::string_view operator[](size_t i) const
+    {
+        return std::string_view(arena).substr(offsets[i], offsets[i+1] - offsets[i]);
+    }
+
+    std::vector<std::string_view> views() const;
+    std::vector<std::string> strings() const;
+};
+
+using PromptColumns = std::unordered_map<std::string, std::span<const std::string>>;
+
+/**
+ * A prompt template parsed once into literal pieces and variable slots.
+ *
+ * Variables that have a default are inlined at compile time with the same rules as PromptTemplate::render().
+ * The remaining ones become slots that are filled by render() or renderBatch().
+ * @note Slot values are inserted verbatim. Curly braces inside them are not expanded again.
+*/
+struct CompiledPrompt
+{
+    CompiledPrompt() = default;
+    CompiledPrompt(const std::string& prompt, const std::unordered_map<std::string, std::string>& defaults = {});
+
+    /**
+     * Names of the variables that still need a value, in order of first appearance.
+    */
+    const std::vector<std::string>& variables() const { return slot_names; }
+
+    /**
+     * Render a single prompt.
+     * @param values Values of the variables
+     * @param fallback Used for variables not found in values
+    */
+    std::string render(const std::unordered_map<std::string, std::string>& values = {}, const std::unordered_map<std::string, std::string>& fallback = {}) const;
+
+    /**
+     * Render one prompt per row from column-oriented inputs. Rows are rendered in parallel into a single arena.
+     * @param columns Maps every variable to its values. All columns must have the same length.
+    */
+    RenderedBatch renderBatch(const PromptColumns& columns) const;
+
+    struct Segment
+    {
+        static constexpr size_t literal = size_t(-1);
+        size_t offset; // into literals. Only used when slot == literal
+        size_t size;
+        size_t slot;
+    };
+
+    std::string literals;
+    std::vector<Segment> segments;
+    std::vector<std::string> slot_names;
+};
+
+/**
+ * Read a JSONL stream into columns usable by CompiledPrompt::renderBatch().
+ * The keys of the first row decide the columns. Non-string values are kept as their JSON text.
+ * @note Build a PromptColumns from the result to render it: PromptColumns(columns.begin(), columns.end())
+*/
+std::unordered_map<std::string, std::vector<std::string>> readJsonlColumns(std::istream& in);
+
 struct PromptTemplate
 {
     PromptTemplate() = default;
@@ -226,9 +563,21 @@ struct PromptTemplate
     std::unordered_map<std::string, std::string> variables;
 
     std::string render() const;
+    CompiledPrompt compile() const { return CompiledPrompt(prompt, variables); }
 
     static std::unordered_set<std::string> extractVars(const std::string& prompt);
 };
 
+/**
+ * Read a file into a base64 data URL.
+ * @param path Path to the file
+ * @param mime MIME type of the file. Detected from the file's content when empty
+ * @note Encoded files are cached by path, size and modification time. Attaching the same file again is a lookup.
+*/
 std::string dataUrlfromFile(const std::string& path, std::string mime="");
+
+/**
+ * Set the maximum total size of the base64 data kept by dataUrlfromFile(). Defaults to 256MB.
+*/
+void setDataUrlCacheCapacity(size_t bytes);
 }
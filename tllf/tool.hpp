@@ -11,6 +11,7 @@
 #include <type_traits>
 #include <variant>
 
+#include <tllf/cancellation.hpp>
 #include <tllf/inner/utils.hpp>
 
 #include <yaml-cpp/emittermanip.h>
@@ -168,6 +169,8 @@ struct Tool
     std::string name;
     std::function<drogon::Task<std::string>(const std::string&)> func;
     ToolDoc doc;
+    // Used instead of func when set. Gets the request's token, so long running tools can stop early
+    std::function<drogon::Task<std::string>(const std::string&, CancellationToken)> cancellable_func;
 
     template <typename ... Args>
     drogon::Task<std::string> operator()(Args&&... args)
@@ -175,6 +178,13 @@ struct Tool
         return func(std::forward<Args>(args)...);
     }
 
+    drogon::Task<std::string> invoke(const std::string& args, CancellationToken cancel) const
+    {
+        if(cancellable_func)
+            return cancellable_func(args, std::move(cancel));
+        return func(args);
+    }
+
     // FIXME: Use static schemas
     // TODO: Migrate to use of Glaze's JSON scheme generation
     glz::generic makeOpenAIToolObject() const
@@ -1,110 +1,121 @@
 #include "url_parser.hpp"
 #include <filesystem>
 #include <algorithm>
+#include <charconv>
 
 using namespace tllf;
 
-Url::Url(const std::string& str, bool normalize_url)
+UrlView::UrlView(std::string_view str)
 {
-    if(str.empty()) {
-        good_ = false;
-        return;
-    }
-
-    good_ = true;
-    std::string_view sv = str;
-
     // Find protocol
-    auto idx = sv.find("//");
-    if(idx == std::string_view::npos) {
-        good_ = false;
+    auto idx = str.find("//");
+    if(idx == std::string_view::npos)
         return;
-    }
-    else if(idx == 0) {
-        // URLs with no protocol. example: //example.com
-        // this indicates the URL points to the same protocol as the current one
-
-        protocol_ = "";
-    }
-    else {
-        if(sv[idx-1] != ':') {
-            good_ = false;
+    // URLs with no protocol (//example.com) point to the same protocol as the current one
+    if(idx != 0) {
+        if(str[idx-1] != ':')
             return;
-        }
-        protocol_ = sv.substr(0, idx-1);
-        if(protocol_.empty()) {
-            good_ = false;
+        protocol_ = str.substr(0, idx-1);
+        if(protocol_.empty())
             return;
-        }
         for(auto ch : protocol_) {
-            if(isalnum(ch) == false) {
-                good_ = false;
+            if(isalnum(ch) == false)
                 return;
-            }
         }
-        default_port_ = protocolDefaultPort(protocol_);
     }
 
     // Find host
-    sv = sv.substr(idx+2);
-    idx = sv.find_first_of(":/");
-    host_ = sv.substr(0, idx);
-    if(host_.empty() || host_[0] == '.') {
-        good_ = false;
+    size_t pos = idx+2;
+    idx = str.find_first_of(":/", pos);
+    host_ = str.substr(pos, idx == std::string_view::npos ? idx : idx-pos);
+    if(host_.empty() || host_[0] == '.')
         return;
-    }
-    if(idx == std::string::npos) {
-        path_ = "/";
-        if(normalize_url)
-            normalize();
+    if(idx == std::string_view::npos) {
+        origin_ = str;
+        good_ = true;
         return;
     }
     // Find port
-    if(sv[idx] == ':') {
-        sv = sv.substr(idx+1);
-        idx = sv.find("/");
-        auto port_sv = sv.substr(0, idx);
-        if(port_sv.empty()) {
-            good_ = false;
-            return;
-        }
-        try {
-            port_ = std::stoi(std::string(port_sv));
-            if(port_ <= 0 || port_ > 65535) {
-                good_ = false;
-                return;
-            }
-        }
-        catch(...) {
-            good_ = false;
+    if(str[idx] == ':') {
+        pos = idx+1;
+        idx = str.find('/', pos);
+        auto port_sv = str.substr(pos, idx == std::string_view::npos ? idx : idx-pos);
+        auto [ptr, ec] = std::from_chars(port_sv.data(), port_sv.data() + port_sv.size(), port_);
+        if(port_sv.empty() || ec != std::errc() || ptr != port_sv.data() + port_sv.size() || port_ <= 0 || port_ > 65535) {
+            port_ = 0;
             return;
         }
-        if(idx != std::string_view::npos)
-            sv = sv.substr(idx+1);
-        else
-            sv = std::string_view();
     }
-    else 
-        sv = sv.substr(idx+1);
-    // Find path
-    idx = sv.find_first_of("?#");
-    path_ = "/"+std::string(sv.substr(0, idx));
-    if(normalize_url)
-        normalize();
+    origin_ = str.substr(0, idx);
+    good_ = true;
+    if(idx == std::string_view::npos)
+        return;
+
+    // Find path. It keeps its leading /
+    pos = idx;
+    idx = str.find_first_of("?#", pos);
+    path_ = str.substr(pos, idx == std::string_view::npos ? idx : idx-pos);
     if(idx == std::string_view::npos)
         return;
     // Find param
-    if(sv[idx] == '?') {
-        sv = sv.substr(idx+1);
-        idx = sv.find('#');
-        param_ = sv.substr(0, idx);
+    if(str[idx] == '?') {
+        pos = idx+1;
+        idx = str.find('#', pos);
+        param_ = str.substr(pos, idx == std::string_view::npos ? idx : idx-pos);
     }
 
     // Find fragment
     if(idx == std::string_view::npos)
         return;
-    sv = sv.substr(idx+1);
-    fragment_ = sv;
+    fragment_ = str.substr(idx+1);
+}
+
+int UrlView::port(int default_port) const
+{
+    if(port_ != 0)
+        return port_;
+    else if(default_port != 0)
+        return default_port;
+    else
+        return defaultPort();
+}
+
+int UrlView::defaultPort() const
+{
+    // Url lowercases the protocol while normalizing. Do the same without allocating
+    char proto[16];
+    if(protocol_.size() > sizeof(proto))
+        return 0;
+    std::transform(protocol_.begin(), protocol_.end(), proto, ::tolower);
+    return Url::protocolDefaultPort(std::string_view(proto, protocol_.size()));
+}
+
+std::string UrlView::normalizedPath() const
+{
+    return std::filesystem::path(path()).lexically_normal().generic_string();
+}
+
+Url UrlView::url(bool normalize_url) const
+{
+    Url res;
+    res.good_ = good_;
+    if(!good_)
+        return res;
+    res.protocol_ = protocol_;
+    res.host_ = host_;
+    res.port_ = port_;
+    res.path_ = path();
+    res.param_ = param_;
+    res.fragment_ = fragment_;
+    res.default_port_ = defaultPort();
+    if(normalize_url)
+        res.normalize();
+    return res;
+}
+
+Url::Url(const std::string& str, bool normalize_url)
+    : Url(UrlView(str).url(normalize_url))
+{
 }
 
 std::string Url::str() const
@@ -1,10 +1,57 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 
 namespace tllf
 {
 
+struct Url;
+
+/**
+ * Non-owning view of a URL. Parsing only slices the string, so nothing is allocated and the string must outlive the
+ * view. Follows the same rules as Url, but nothing is normalized: the protocol and host keep their case and the path
+ * is returned as written.
+*/
+struct UrlView
+{
+    UrlView() = default;
+    explicit UrlView(std::string_view str);
+
+    inline bool good() const { return good_; }
+    std::string_view protocol() const { return protocol_; }
+    std::string_view host() const { return host_; }
+    // "/" when the URL has no path
+    std::string_view path() const { return path_.empty() ? std::string_view("/") : path_; }
+    std::string_view param() const { return param_; }
+    std::string_view fragment() const { return fragment_; }
+    int port(int default_port = 0) const;
+    // The well known port of the protocol, or 0
+    int defaultPort() const;
+
+    /**
+     * protocol://host:port as written, without the path, parameters and fragment.
+    */
+    std::string_view origin() const { return origin_; }
+    /**
+     * The path with . and .. segments resolved, as Url::normalize() does.
+    */
+    std::string normalizedPath() const;
+    Url url(bool normalize_url = true) const;
+
+protected:
+    std::string_view protocol_;
+    std::string_view host_;
+    int port_ = 0;
+    std::string_view path_;
+    std::string_view param_;
+    std::string_view fragment_;
+    std::string_view origin_;
+    bool good_ = false;
+
+    friend struct Url;
+};
+
 struct Url
 {
     Url() = default;
@@ -80,8 +127,10 @@ protected:
     std::string param_;
     std::string fragment_;
     bool good_ = true;
-    int default_port_;
+    int default_port_ = 0;
     mutable std::string cache_;
+
+    friend struct UrlView;
 };
 
 }
\ No newline at end of file
@@ -1,4 +1,23 @@
 #include "utils.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define TLLF_HAS_MMAP
+#endif
 
 namespace tllf::utils
 {
@@ -21,4 +40,181 @@ std::string_view trim(const std::string_view str, const std::string_view whitesp
     size_t last = str.find_last_not_of(whitespace);
     return str.substr(first, (last - first + 1));
 }
+
+namespace
+{
+// One parallelFor() call. Its chunks are claimed one at a time by the pool's workers and by the calling thread
+struct ParallelJob
+{
+    ParallelJob(const std::function<void(size_t, size_t)>& func, size_t n, size_t max_chunks)
+        : func(func), n(n), chunk((n + max_chunks - 1) / max_chunks), count((n + chunk - 1) / chunk), errors(count)
+    {
+    }
+
+    // Run chunks until every one is claimed
+    void work()
+    {
+        for(size_t i = next++; i < count; i = next++) {
+            size_t begin = i * chunk;
+            try {
+                func(begin, std::min(begin + chunk, n));
+            }
+            catch(...) {
+                errors[i] = std::current_exception();
+            }
+            if(++done == count) {
+                std::lock_guard lock(mtx);
+                finished.notify_all();
+            }
+        }
+    }
+
+    const std::function<void(size_t, size_t)>& func;
+    const size_t n;
+    const size_t chunk;
+    const size_t count;
+    std::atomic<size_t> next = 0;
+    std::atomic<size_t> done = 0;
+    std::vector<std::exception_ptr> errors;
+    std::mutex mtx;
+    std::condition_variable finished;
+};
+
+// Started on first use and shared by every call, so a call costs a wakeup rather than starting threads
+struct WorkerPool
+{
+    WorkerPool(size_t n_workers)
+    {
+        workers.reserve(n_workers);
+        for(size_t i = 0; i < n_workers; i++)
+            workers.emplace_back([this]() { run(); });
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+    }
+
+    void submit(const std::shared_ptr<ParallelJob>& job)
+    {
+        {
+            std::lock_guard lock(mtx);
+            jobs.push_back(job);
+        }
+        cv.notify_all();
+    }
+
+    void remove(const std::shared_ptr<ParallelJob>& job)
+    {
+        std::lock_guard lock(mtx);
+        std::erase(jobs, job);
+    }
+
+    void run()
+    {
+        while(true) {
+            std::shared_ptr<ParallelJob> job;
+            {
+                std::unique_lock lock(mtx);
+                cv.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if(stopping)
+                    return;
+                job = jobs.front();
+                // Every chunk is taken. Its caller may already be gone, so nobody else may look at it
+                if(job->next >= job->count) {
+                    jobs.pop_front();
+                    continue;
+                }
+            }
+            job->work();
+        }
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<ParallelJob>> jobs;
+    bool stopping = false;
+    // Last, so the threads are joined before the rest is destroyed
+    std::vector<std::jthread> workers;
+};
+}
+
+void parallelFor(size_t n, const std::function<void(size_t, size_t)>& func, size_t grain)
+{
+    if(n == 0)
+        return;
+    const size_t n_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    size_t count = std::min(n_threads, (n + grain - 1) / std::max<size_t>(grain, 1));
+    if(count <= 1) {
+        func(0, n);
+        return;
+    }
+
+    // The calling thread is one of the workers
+    static WorkerPool pool(n_threads - 1);
+    auto job = std::make_shared<ParallelJob>(func, n, count);
+    pool.submit(job);
+    // Working instead of waiting also means a call from inside func cannot deadlock
+    job->work();
+    pool.remove(job);
+    {
+        std::unique_lock lock(job->mtx);
+        job->finished.wait(lock, [&]() { return job->done == job->count; });
+    }
+    for(auto& error : job->errors) {
+        if(error)
+            std::rethrow_exception(error);
+    }
+}
+
+#ifdef TLLF_HAS_MMAP
+MappedFile::MappedFile(const std::string& path, bool sequential)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("Failed to open file: " + path);
+    struct stat st;
+    if(::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to stat file: " + path);
+    }
+    size_ = st.st_size;
+    if(size_ != 0) {
+        void* ptr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(ptr == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Failed to map file: " + path);
+        }
+        ::madvise(ptr, size_, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        ptr_ = static_cast<const char*>(ptr);
+    }
+    // The mapping stays valid after the descriptor is closed
+    ::close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if(ptr_ != nullptr)
+        ::munmap(const_cast<char*>(ptr_), size_);
+}
+#else
+MappedFile::MappedFile(const std::string& path, bool)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if(!file)
+        throw std::runtime_error("Failed to open file: " + path);
+    buffer_.resize(file.tellg());
+    file.seekg(0, std::ios::beg);
+    if(!file.read(buffer_.data(), buffer_.size()))
+        throw std::runtime_error("Failed to read file: " + path);
+    ptr_ = buffer_.data();
+    size_ = buffer_.size();
+}
+
+MappedFile::~MappedFile() = default;
+#endif
 }
\ No newline at end of file
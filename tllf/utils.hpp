@@ -1,8 +1,42 @@
 #pragma once
+#include <cstddef>
+#include <functional>
 #include <string>
+#include <string_view>
 
 namespace tllf::utils
 {
 std::string replaceAll(std::string str, const std::string& from, const std::string& to);
 std::string_view trim(const std::string_view str, const std::string_view whitespace = " \t\n");
+
+/**
+ * Split [0, n) into contiguous chunks and run them on all hardware threads. The threads are started once and
+ * shared by every call. The calling thread runs chunks too, so func may call parallelFor() itself.
+ * @param n The number of items
+ * @param func Called as func(begin, end) once per chunk
+ * @param grain Minimum number of items per chunk. Small workloads run on the calling thread
+*/
+void parallelFor(size_t n, const std::function<void(size_t, size_t)>& func, size_t grain = 1024);
+
+/**
+ * Read-only view of a whole file. Memory mapped where supported, read into a buffer elsewhere.
+*/
+struct MappedFile
+{
+    /**
+     * @param sequential Hint that the file is read front to back. Pass false for random lookups such as indexes
+    */
+    MappedFile(const std::string& path, bool sequential = true);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view data() const { return {ptr_, size_}; }
+    size_t size() const { return size_; }
+
+protected:
+    const char* ptr_ = nullptr;
+    size_t size_ = 0;
+    std::string buffer_; // Only used when mmap is not available
+};
 }
\ No newline at end of file
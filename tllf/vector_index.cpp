@@ -0,0 +1,609 @@
+#include "vector_index.hpp"
+#include "simd.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+using namespace tllf;
+
+static bool worseResult(const SearchResult& a, const SearchResult& b)
+{
+    return a.score > b.score;
+}
+
+void internal::TopK::push(uint64_t id, float score)
+{
+    if(k == 0)
+        return;
+    if(heap.size() == k) {
+        if(score <= heap.front().score)
+            return;
+        std::pop_heap(heap.begin(), heap.end(), worseResult);
+        heap.back() = {id, score};
+    }
+    else {
+        heap.push_back({id, score});
+    }
+    std::push_heap(heap.begin(), heap.end(), worseResult);
+}
+
+void internal::TopK::merge(const TopK& other)
+{
+    for(const auto& res : other.heap)
+        push(res.id, res.score);
+}
+
+std::vector<SearchResult> internal::TopK::sorted() &&
+{
+    std::sort_heap(heap.begin(), heap.end(), worseResult);
+    return std::move(heap);
+}
+
+void FlatIndex::add(uint64_t id, std::span<const float> vec)
+{
+    if(dim_ == 0)
+        dim_ = vec.size();
+    if(vec.size() != dim_)
+        throw std::runtime_error("Vector has dimension " + std::to_string(vec.size()) + " but the index uses " + std::to_string(dim_));
+    data_.append(vec);
+    ids_.push_back(id);
+    if(metric_ == Metric::Cosine)
+        simd::normalize(data_.row(data_.rows() - 1), dim_);
+}
+
+void FlatIndex::add(std::span<const uint64_t> ids, const EmbeddingMatrix& vecs)
+{
+    if(ids.size() != vecs.rows())
+        throw std::runtime_error("Got " + std::to_string(ids.size()) + " ids for " + std::to_string(vecs.rows()) + " vectors");
+    if(vecs.empty())
+        return;
+    if(dim_ == 0)
+        dim_ = vecs.dim();
+    if(vecs.dim() != dim_)
+        throw std::runtime_error("Vectors have dimension " + std::to_string(vecs.dim()) + " but the index uses " + std::to_string(dim_));
+
+    size_t first = data_.rows();
+    data_.append(vecs);
+    ids_.insert(ids_.end(), ids.begin(), ids.end());
+    if(metric_ == Metric::Cosine) {
+        for(size_t i = first; i < data_.rows(); i++)
+            simd::normalize(data_.row(i), dim_);
+    }
+}
+
+void FlatIndex::add(const EmbeddingMatrix& vecs, uint64_t first_id)
+{
+    std::vector<uint64_t> ids(vecs.rows());
+    for(size_t i = 0; i < ids.size(); i++)
+        ids[i] = first_id + i;
+    add(ids, vecs);
+}
+
+std::vector<SearchResult> FlatIndex::search(std::span<const float> query, size_t k) const
+{
+    EmbeddingMatrix queries;
+    queries.append(query);
+    return std::move(search(queries, k)[0]);
+}
+
+std::vector<std::vector<SearchResult>> FlatIndex::search(const EmbeddingMatrix& queries, size_t k) const
+{
+    const size_t nq = queries.rows();
+    // An empty index has no dimension yet and matches nothing
+    if(size() == 0)
+        return std::vector<std::vector<SearchResult>>(nq);
+    if(nq != 0 && queries.dim() != dim_)
+        throw std::runtime_error("Query has dimension " + std::to_string(queries.dim()) + " but the index uses " + std::to_string(dim_));
+
+    EmbeddingMatrix normalized;
+    const EmbeddingMatrix* q = &queries;
+    if(metric_ == Metric::Cosine) {
+        normalized = queries;
+        for(size_t i = 0; i < nq; i++)
+            simd::normalize(normalized.row(i), dim_);
+        q = &normalized;
+    }
+
+    std::vector<internal::TopK> results(nq, internal::TopK(k));
+    std::mutex mtx;
+    utils::parallelFor(size(), [&](size_t begin, size_t end) {
+        std::vector<internal::TopK> local(nq, internal::TopK(k));
+        float scores[4];
+        for(size_t row = begin; row < end; row++) {
+            const float* vec = data_.row(row);
+            size_t j = 0;
+            // Score 4 queries per pass so the stored vector is loaded once for all of them
+            for(; j + 4 <= nq; j += 4) {
+                const float* qs[4] = {q->row(j), q->row(j + 1), q->row(j + 2), q->row(j + 3)};
+                simd::dot4(vec, qs, dim_, scores);
+                for(size_t l = 0; l < 4; l++)
+                    local[j + l].push(ids_[row], scores[l]);
+            }
+            for(; j < nq; j++)
+                local[j].push(ids_[row], simd::dot(vec, q->row(j), dim_));
+        }
+
+        std::lock_guard lock(mtx);
+        for(size_t j = 0; j < nq; j++)
+            results[j].merge(local[j]);
+    }, 4096);
+
+    std::vector<std::vector<SearchResult>> res;
+    res.reserve(nq);
+    for(auto& topk : results)
+        res.push_back(std::move(topk).sorted());
+    return res;
+}
+
+static uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+static constexpr char hnsw_magic[8] = {'T', 'L', 'L', 'F', 'H', 'N', 'S', 'W'};
+static constexpr uint32_t hnsw_version = 1;
+static constexpr int hnsw_max_level = 32;
+
+struct HnswHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t metric;
+    uint64_t dim;
+    uint64_t count;
+    uint64_t M;
+    uint64_t ef_construction;
+    uint64_t ef_search;
+    uint64_t seed;
+    int64_t entry;
+    uint64_t upper_size;
+};
+
+// Every section of the file starts on a 64 byte boundary so the mapped vectors stay aligned
+static size_t alignSection(size_t n)
+{
+    return (n + 63) & ~size_t(63);
+}
+
+HnswIndex::HnswIndex(size_t dim, size_t capacity, Metric metric, HnswParams params)
+    : dim_(dim), capacity_(capacity), metric_(metric), params_(params)
+{
+    if(dim == 0)
+        throw std::runtime_error("HnswIndex needs a non-zero dimension");
+    if(params_.M < 2)
+        throw std::runtime_error("HnswIndex needs M >= 2");
+    if(params_.ef_construction == 0)
+        throw std::runtime_error("HnswIndex needs ef_construction >= 1");
+    if(capacity > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("HnswIndex supports at most 2^32 - 1 vectors");
+    owned_vectors_ = EmbeddingMatrix(capacity, dim);
+    owned_ids_.resize(capacity);
+    owned_levels_.resize(capacity);
+    owned_level0_.resize(capacity * (2 * params_.M + 1));
+    owned_upper_.resize(capacity);
+    link_mtx_ = std::make_unique<std::mutex[]>(capacity);
+
+    vectors_ = owned_vectors_.data();
+    ids_ = owned_ids_.data();
+    levels_ = owned_levels_.data();
+    level0_ = owned_level0_.data();
+}
+
+HnswIndex::HnswIndex(const std::string& path)
+{
+    file_ = std::make_unique<utils::MappedFile>(path, false);
+    auto data = file_->data();
+    HnswHeader header;
+    if(data.size() < sizeof(header))
+        throw std::runtime_error("File " + path + " is too small to be an HNSW index");
+    std::memcpy(&header, data.data(), sizeof(header));
+    if(std::memcmp(header.magic, hnsw_magic, sizeof(hnsw_magic)) != 0)
+        throw std::runtime_error("File " + path + " is not an HNSW index");
+    if(header.version != hnsw_version)
+        throw std::runtime_error("Unsupported HNSW index version " + std::to_string(header.version) + " in " + path);
+
+    if(header.metric > static_cast<uint32_t>(Metric::DotProduct))
+        throw std::runtime_error("HNSW index " + path + " has unknown metric " + std::to_string(header.metric));
+    if(header.M < 2 || header.M > std::numeric_limits<uint16_t>::max())
+        throw std::runtime_error("HNSW index " + path + " has M = " + std::to_string(header.M) + " out of range");
+    if(header.dim == 0 || header.count > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("HNSW index " + path + " has a bad dimension or vector count");
+    // Bounds the section sizes below, so computing them cannot overflow
+    if((header.count != 0 && header.dim > data.size() / sizeof(float) / header.count) || header.upper_size > data.size() / sizeof(uint32_t))
+        throw std::runtime_error("HNSW index " + path + " is truncated");
+
+    dim_ = header.dim;
+    capacity_ = header.count;
+    metric_ = static_cast<Metric>(header.metric);
+    params_ = {header.M, header.ef_construction, header.ef_search, header.seed};
+    count_ = header.count;
+    reserved_ = header.count;
+    entry_ = header.entry;
+    if(header.entry >= 0 && uint64_t(header.entry) >= header.count)
+        throw std::runtime_error("HNSW index " + path + " has entry point " + std::to_string(header.entry) + " out of " + std::to_string(header.count) + " vectors");
+
+    const size_t n = header.count;
+    const size_t sizes[] = {n * dim_ * sizeof(float), n * sizeof(uint64_t), n, n * (2 * params_.M + 1) * sizeof(uint32_t),
+        n * sizeof(uint64_t), header.upper_size * sizeof(uint32_t)};
+    const char* sections[6];
+    size_t offset = alignSection(sizeof(header));
+    for(size_t i = 0; i < 6; i++) {
+        sections[i] = data.data() + offset;
+        offset += alignSection(sizes[i]);
+    }
+    if(offset > data.size())
+        throw std::runtime_error("HNSW index " + path + " is truncated");
+
+    vectors_ = reinterpret_cast<const float*>(sections[0]);
+    ids_ = reinterpret_cast<const uint64_t*>(sections[1]);
+    levels_ = reinterpret_cast<const uint8_t*>(sections[2]);
+    level0_ = reinterpret_cast<const uint32_t*>(sections[3]);
+    upper_offsets_ = reinterpret_cast<const uint64_t*>(sections[4]);
+    upper_data_ = reinterpret_cast<const uint32_t*>(sections[5]);
+
+    // Searches trust the graph, so a corrupt one must not get that far
+    auto bad = [&](size_t node) {
+        return std::runtime_error("HNSW index " + path + " has corrupt links at node " + std::to_string(node));
+    };
+    for(size_t node = 0; node < n; node++) {
+        if(levels_[node] > hnsw_max_level || upper_offsets_[node] > header.upper_size
+            || levels_[node] * (params_.M + 1) > header.upper_size - upper_offsets_[node])
+            throw bad(node);
+        for(int level = 0; level <= levels_[node]; level++) {
+            const uint32_t* list = links(node, level);
+            if(list[0] > (level == 0 ? 2 * params_.M : params_.M))
+                throw bad(node);
+            for(uint32_t i = 1; i <= list[0]; i++) {
+                if(list[i] >= n)
+                    throw bad(node);
+            }
+        }
+    }
+    max_level_ = header.entry >= 0 ? levels_[header.entry] : -1;
+}
+
+HnswIndex::~HnswIndex() = default;
+
+const uint32_t* HnswIndex::links(uint32_t node, int level) const
+{
+    if(level == 0)
+        return level0_ + size_t(node) * (2 * params_.M + 1);
+    size_t offset = (level - 1) * (params_.M + 1);
+    if(file_)
+        return upper_data_ + upper_offsets_[node] + offset;
+    return owned_upper_[node].get() + offset;
+}
+
+uint32_t* HnswIndex::links(uint32_t node, int level)
+{
+    return const_cast<uint32_t*>(std::as_const(*this).links(node, level));
+}
+
+int HnswIndex::randomLevel(uint32_t node) const
+{
+    // Derived from the slot rather than a shared RNG so concurrent inserts need no lock and builds are repeatable
+    double u = (splitmix64(params_.seed ^ (uint64_t(node) << 1)) >> 11) * 0x1.0p-53;
+    double level = -std::log(1.0 - u) / std::log(double(params_.M));
+    return std::min<int>(level, hnsw_max_level);
+}
+
+std::unique_ptr<HnswIndex::VisitedList> HnswIndex::acquireVisited() const
+{
+    std::unique_ptr<VisitedList> list;
+    {
+        std::lock_guard lock(visited_mtx_);
+        if(!visited_pool_.empty()) {
+            list = std::move(visited_pool_.back());
+            visited_pool_.pop_back();
+        }
+    }
+    if(!list)
+        list = std::make_unique<VisitedList>();
+    if(list->marks.size() < capacity_)
+        list->marks.resize(capacity_);
+    // Bumping the tag clears the list in O(1). Only wrap-around needs a real reset
+    if(++list->tag == 0) {
+        std::fill(list->marks.begin(), list->marks.end(), 0);
+        list->tag = 1;
+    }
+    return list;
+}
+
+void HnswIndex::releaseVisited(std::unique_ptr<VisitedList> list) const
+{
+    std::lock_guard lock(visited_mtx_);
+    visited_pool_.push_back(std::move(list));
+}
+
+// Copy a node's links so they can be walked without holding its lock. Mapped indexes never change and skip the lock
+static size_t readLinks(const uint32_t* list, std::mutex* mtx, uint32_t* out)
+{
+    std::unique_lock<std::mutex> lock;
+    if(mtx)
+        lock = std::unique_lock(*mtx);
+    uint32_t n = list[0];
+    std::copy(list + 1, list + 1 + n, out);
+    return n;
+}
+
+uint32_t HnswIndex::greedyClosest(const float* query, uint32_t entry, int from_level, int to_level) const
+{
+    std::vector<uint32_t> neighbors(2 * params_.M);
+    uint32_t cur = entry;
+    float best = simd::dot(query, vector(cur), dim_);
+    for(int level = from_level; level >= to_level; level--) {
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            size_t n = readLinks(links(cur, level), file_ ? nullptr : &link_mtx_[cur], neighbors.data());
+            for(size_t i = 0; i < n; i++) {
+                float score = simd::dot(query, vector(neighbors[i]), dim_);
+                if(score > best) {
+                    best = score;
+                    cur = neighbors[i];
+                    changed = true;
+                }
+            }
+        }
+    }
+    return cur;
+}
+
+std::vector<HnswIndex::Candidate> HnswIndex::searchLayer(const float* query, uint32_t entry, size_t ef, int level, const Filter* filter) const
+{
+    auto visited = acquireVisited();
+    auto& marks = visited->marks;
+    const uint16_t tag = visited->tag;
+
+    // Candidates to expand, best on top, and the ef best accepted results, worst on top
+    std::priority_queue<Candidate> candidates;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<>> results;
+    auto accepted = [&](uint32_t node) { return !filter || !*filter || (*filter)(ids_[node]); };
+
+    float score = simd::dot(query, vector(entry), dim_);
+    candidates.emplace(score, entry);
+    if(accepted(entry))
+        results.emplace(score, entry);
+    marks[entry] = tag;
+
+    std::vector<uint32_t> neighbors(maxLinks(level));
+    while(!candidates.empty()) {
+        auto [cand_score, cand] = candidates.top();
+        if(results.size() >= ef && cand_score < results.top().first)
+            break;
+        candidates.pop();
+
+        size_t n = readLinks(links(cand, level), file_ ? nullptr : &link_mtx_[cand], neighbors.data());
+        for(size_t i = 0; i < n; i++) {
+            uint32_t node = neighbors[i];
+            if(marks[node] == tag)
+                continue;
+            marks[node] = tag;
+            float s = simd::dot(query, vector(node), dim_);
+            if(results.size() < ef || s > results.top().first) {
+                // Rejected nodes are still expanded so the filter cannot cut the graph apart
+                candidates.emplace(s, node);
+                if(accepted(node)) {
+                    results.emplace(s, node);
+                    if(results.size() > ef)
+                        results.pop();
+                }
+            }
+        }
+    }
+    releaseVisited(std::move(visited));
+
+    std::vector<Candidate> res(results.size());
+    for(size_t i = res.size(); i > 0; i--) {
+        res[i - 1] = results.top();
+        results.pop();
+    }
+    return res;
+}
+
+std::vector<uint32_t> HnswIndex::selectNeighbors(std::vector<Candidate> candidates, size_t m) const
+{
+    std::sort(candidates.begin(), candidates.end(), std::greater<>());
+    std::vector<uint32_t> selected;
+    selected.reserve(m);
+    // Keep a candidate only if it is closer to the new node than to every neighbour already kept. This spreads
+    // the links in different directions instead of clustering them
+    for(const auto& [score, node] : candidates) {
+        if(selected.size() >= m)
+            break;
+        bool keep = std::all_of(selected.begin(), selected.end(), [&, score = score, node = node](uint32_t other) {
+            return simd::dot(vector(node), vector(other), dim_) <= score;
+        });
+        if(keep)
+            selected.push_back(node);
+    }
+    return selected;
+}
+
+void HnswIndex::connect(uint32_t node, uint32_t neighbor, int level)
+{
+    std::lock_guard lock(link_mtx_[node]);
+    uint32_t* list = links(node, level);
+    const size_t max = maxLinks(level);
+    if(list[0] < max) {
+        list[1 + list[0]] = neighbor;
+        list[0]++;
+        return;
+    }
+
+    std::vector<Candidate> candidates;
+    candidates.reserve(max + 1);
+    candidates.emplace_back(simd::dot(vector(node), vector(neighbor), dim_), neighbor);
+    for(size_t i = 0; i < max; i++)
+        candidates.emplace_back(simd::dot(vector(node), vector(list[1 + i]), dim_), list[1 + i]);
+    auto selected = selectNeighbors(std::move(candidates), max);
+    std::copy(selected.begin(), selected.end(), list + 1);
+    list[0] = selected.size();
+}
+
+void HnswIndex::insert(uint32_t node, uint64_t id, std::span<const float> vec)
+{
+    float* v = owned_vectors_.row(node);
+    std::copy(vec.begin(), vec.end(), v);
+    if(metric_ == Metric::Cosine)
+        simd::normalize(v, dim_);
+    owned_ids_[node] = id;
+    const int level = randomLevel(node);
+    owned_levels_[node] = level;
+    if(level > 0)
+        owned_upper_[node] = std::make_unique<uint32_t[]>(level * (params_.M + 1));
+
+    // Only a node that becomes the new top of the graph holds the entry lock for its whole insertion
+    std::unique_lock<std::mutex> entry_lock(entry_mtx_, std::defer_lock);
+    if(level > max_level_.load(std::memory_order_acquire))
+        entry_lock.lock();
+    int64_t entry = entry_.load(std::memory_order_acquire);
+    if(entry < 0) {
+        entry_.store(node, std::memory_order_release);
+        max_level_.store(level, std::memory_order_release);
+        return;
+    }
+
+    const int top = levels_[entry];
+    uint32_t cur = entry;
+    if(level < top)
+        cur = greedyClosest(v, cur, top, level + 1);
+    for(int l = std::min(level, top); l >= 0; l--) {
+        auto candidates = searchLayer(v, cur, params_.ef_construction, l, nullptr);
+        cur = candidates.front().second;
+        auto neighbors = selectNeighbors(std::move(candidates), params_.M);
+        {
+            std::lock_guard lock(link_mtx_[node]);
+            uint32_t* list = links(node, l);
+            std::copy(neighbors.begin(), neighbors.end(), list + 1);
+            list[0] = neighbors.size();
+        }
+        for(uint32_t neighbor : neighbors)
+            connect(neighbor, node, l);
+    }
+
+    if(level > top) {
+        entry_.store(node, std::memory_order_release);
+        max_level_.store(level, std::memory_order_release);
+    }
+}
+
+void HnswIndex::add(uint64_t id, std::span<const float> vec)
+{
+    if(file_)
+        throw std::runtime_error("Memory mapped HNSW indexes are read only");
+    if(vec.size() != dim_)
+        throw std::runtime_error("Vector has dimension " + std::to_string(vec.size()) + " but the index uses " + std::to_string(dim_));
+    size_t node = reserved_.fetch_add(1);
+    if(node >= capacity_) {
+        reserved_.fetch_sub(1);
+        throw std::runtime_error("HnswIndex is full (capacity " + std::to_string(capacity_) + ")");
+    }
+    insert(node, id, vec);
+    count_.fetch_add(1, std::memory_order_release);
+}
+
+void HnswIndex::add(std::span<const uint64_t> ids, const EmbeddingMatrix& vecs)
+{
+    if(ids.size() != vecs.rows())
+        throw std::runtime_error("Got " + std::to_string(ids.size()) + " ids for " + std::to_string(vecs.rows()) + " vectors");
+    utils::parallelFor(vecs.rows(), [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+            add(ids[i], vecs[i]);
+    }, 256);
+}
+
+std::vector<SearchResult> HnswIndex::search(std::span<const float> query, size_t k, size_t ef, const Filter& filter) const
+{
+    if(query.size() != dim_)
+        throw std::runtime_error("Query has dimension " + std::to_string(query.size()) + " but the index uses " + std::to_string(dim_));
+    int64_t entry = entry_.load(std::memory_order_acquire);
+    if(entry < 0 || k == 0)
+        return {};
+
+    std::vector<float> q(query.begin(), query.end());
+    if(metric_ == Metric::Cosine)
+        simd::normalize(q.data(), dim_);
+    // The entry point's own level is used rather than max_level_ so the two are never read out of sync
+    uint32_t cur = greedyClosest(q.data(), entry, levels_[entry], 1);
+    // Never search fewer candidates than results wanted, even with ef_search set to 0
+    auto candidates = searchLayer(q.data(), cur, std::max({ef ? ef : params_.ef_search, k, size_t(1)}), 0, &filter);
+
+    std::vector<SearchResult> res;
+    res.reserve(std::min(k, candidates.size()));
+    for(size_t i = 0; i < candidates.size() && i < k; i++)
+        res.push_back({ids_[candidates[i].second], candidates[i].first});
+    return res;
+}
+
+std::vector<std::vector<SearchResult>> HnswIndex::search(const EmbeddingMatrix& queries, size_t k, size_t ef, const Filter& filter) const
+{
+    std::vector<std::vector<SearchResult>> res(queries.rows());
+    utils::parallelFor(queries.rows(), [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+            res[i] = search(queries[i], k, ef, filter);
+    }, 16);
+    return res;
+}
+
+void HnswIndex::save(const std::string& path) const
+{
+    const size_t n = size();
+    if(!file_ && n != reserved_.load())
+        throw std::runtime_error("Cannot save an HNSW index while vectors are being added");
+
+    std::vector<uint64_t> upper_offsets(n);
+    uint64_t upper_size = 0;
+    for(size_t i = 0; i < n; i++) {
+        upper_offsets[i] = upper_size;
+        upper_size += levels_[i] * (params_.M + 1);
+    }
+
+    HnswHeader header = {};
+    std::memcpy(header.magic, hnsw_magic, sizeof(hnsw_magic));
+    header.version = hnsw_version;
+    header.metric = static_cast<uint32_t>(metric_);
+    header.dim = dim_;
+    header.count = n;
+    header.M = params_.M;
+    header.ef_construction = params_.ef_construction;
+    header.ef_search = params_.ef_search;
+    header.seed = params_.seed;
+    header.entry = entry_.load();
+    header.upper_size = upper_size;
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if(!out)
+        throw std::runtime_error("Failed to open " + path + " for writing");
+    static constexpr char zeros[64] = {};
+    auto write = [&](const void* data, size_t size) {
+        out.write(static_cast<const char*>(data), size);
+        out.write(zeros, alignSection(size) - size);
+    };
+    write(&header, sizeof(header));
+    write(vectors_, n * dim_ * sizeof(float));
+    write(ids_, n * sizeof(uint64_t));
+    write(levels_, n);
+    write(level0_, n * (2 * params_.M + 1) * sizeof(uint32_t));
+    write(upper_offsets.data(), n * sizeof(uint64_t));
+    for(size_t i = 0; i < n; i++) {
+        if(levels_[i] > 0)
+            out.write(reinterpret_cast<const char*>(links(i, 1)), levels_[i] * (params_.M + 1) * sizeof(uint32_t));
+    }
+    size_t upper_bytes = upper_size * sizeof(uint32_t);
+    out.write(zeros, alignSection(upper_bytes) - upper_bytes);
+    if(!out)
+        throw std::runtime_error("Failed to write HNSW index to " + path);
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <tllf/matrix.hpp>
+
+namespace tllf
+{
+
+enum class Metric
+{
+    Cosine,     // Vectors are normalized when added. Scores are cosine similarity
+    DotProduct  // Vectors are stored as given
+};
+
+struct SearchResult
+{
+    uint64_t id;
+    float score;
+};
+
+/**
+ * Exact nearest neighbour search by brute force. The baseline retriever for RAG pipelines.
+ *
+ * Vectors are kept in one contiguous EmbeddingMatrix and scored with SIMD kernels. Large collections are split
+ * across threads and batches of queries are scored 4 at a time, so each stored vector is read once per 4 queries.
+*/
+struct FlatIndex
+{
+    FlatIndex(size_t dim = 0, Metric metric = Metric::Cosine) : dim_(dim), metric_(metric) {}
+
+    /**
+     * Add a vector. The first vector decides the dimension if it was not given.
+    */
+    void add(uint64_t id, std::span<const float> vec);
+    /**
+     * Add every row of an embedder's output.
+     * @param ids One id per row
+    */
+    void add(std::span<const uint64_t> ids, const EmbeddingMatrix& vecs);
+    /**
+     * Add every row of an embedder's output, numbered consecutively from first_id.
+    */
+    void add(const EmbeddingMatrix& vecs, uint64_t first_id);
+
+    /**
+     * @return The k best matches, best first
+    */
+    std::vector<SearchResult> search(std::span<const float> query, size_t k) const;
+    /**
+     * Search one query per row.
+    */
+    std::vector<std::vector<SearchResult>> search(const EmbeddingMatrix& queries, size_t k) const;
+
+    size_t size() const { return ids_.size(); }
+    size_t dim() const { return dim_; }
+    Metric metric() const { return metric_; }
+    const EmbeddingMatrix& vectors() const { return data_; }
+    std::span<const uint64_t> ids() const { return ids_; }
+
+protected:
+    size_t dim_;
+    Metric metric_;
+    EmbeddingMatrix data_;
+    std::vector<uint64_t> ids_;
+};
+
+struct HnswParams
+{
+    size_t M = 16;                  // Links per node on the upper layers. Layer 0 keeps 2*M
+    size_t ef_construction = 200;   // Candidate list size while inserting. Higher builds slower but better graphs
+    size_t ef_search = 64;          // Default candidate list size while searching. Raised to k when smaller
+    uint64_t seed = 100;            // Seeds the level of each node
+};
+
+namespace utils { struct MappedFile; }
+
+/**
+ * Approximate nearest neighbour search with a Hierarchical Navigable Small World graph.
+ *
+ * The index is created with a fixed capacity so storage never moves: add() may be called from many threads at
+ * once and concurrently with search(). save() writes a flat file that the path constructor memory maps, so a
+ * large index opens without being rebuilt from embeddings. Mapped indexes are read only.
+*/
+struct HnswIndex
+{
+    using Filter = std::function<bool(uint64_t id)>;
+
+    HnswIndex(size_t dim, size_t capacity, Metric metric = Metric::Cosine, HnswParams params = {});
+    /**
+     * Open an index written by save(). The file is memory mapped where possible.
+    */
+    explicit HnswIndex(const std::string& path);
+    ~HnswIndex();
+    HnswIndex(const HnswIndex&) = delete;
+    HnswIndex& operator=(const HnswIndex&) = delete;
+
+    /**
+     * Insert a vector. Thread safe.
+     * @note Throws once the capacity is reached
+    */
+    void add(uint64_t id, std::span<const float> vec);
+    /**
+     * Insert every row of vecs using all cores.
+     * @param ids One id per row
+    */
+    void add(std::span<const uint64_t> ids, const EmbeddingMatrix& vecs);
+
+    /**
+     * @param ef Candidate list size. 0 uses params().ef_search. Higher is slower but more accurate
+     * @param filter Only ids it accepts are returned. Rejected nodes are still used for navigation
+     * @return The k best matches, best first
+    */
+    std::vector<SearchResult> search(std::span<const float> query, size_t k, size_t ef = 0, const Filter& filter = {}) const;
+    std::vector<std::vector<SearchResult>> search(const EmbeddingMatrix& queries, size_t k, size_t ef = 0, const Filter& filter = {}) const;
+
+    void save(const std::string& path) const;
+
+    size_t size() const { return count_.load(std::memory_order_acquire); }
+    size_t capacity() const { return capacity_; }
+    size_t dim() const { return dim_; }
+    Metric metric() const { return metric_; }
+    const HnswParams& params() const { return params_; }
+    bool mapped() const { return file_ != nullptr; }
+
+protected:
+    struct VisitedList
+    {
+        std::vector<uint16_t> marks;
+        uint16_t tag = 0;
+    };
+    using Candidate = std::pair<float, uint32_t>; // Score, node
+
+    const float* vector(uint32_t node) const { return vectors_ + size_t(node) * dim_; }
+    const uint32_t* links(uint32_t node, int level) const;
+    uint32_t* links(uint32_t node, int level);
+    size_t maxLinks(int level) const { return level == 0 ? 2 * params_.M : params_.M; }
+    int randomLevel(uint32_t node) const;
+
+    uint32_t greedyClosest(const float* query, uint32_t entry, int from_level, int to_level) const;
+    std::vector<Candidate> searchLayer(const float* query, uint32_t entry, size_t ef, int level, const Filter* filter) const;
+    std::vector<uint32_t> selectNeighbors(std::vector<Candidate> candidates, size_t m) const;
+    void connect(uint32_t node, uint32_t neighbor, int level);
+    void insert(uint32_t node, uint64_t id, std::span<const float> vec);
+
+    std::unique_ptr<VisitedList> acquireVisited() const;
+    void releaseVisited(std::unique_ptr<VisitedList> list) const;
+
+    size_t dim_;
+    size_t capacity_;
+    Metric metric_;
+    HnswParams params_;
+
+    std::atomic<size_t> count_ = 0;
+    std::atomic<size_t> reserved_ = 0;
+    std::atomic<int64_t> entry_ = -1;
+    std::atomic<int> max_level_ = -1;
+    mutable std::mutex entry_mtx_;
+
+    // Owned storage, used while building
+    EmbeddingMatrix owned_vectors_;
+    std::vector<uint64_t> owned_ids_;
+    std::vector<uint8_t> owned_levels_;
+    std::vector<uint32_t> owned_level0_;
+    std::vector<std::unique_ptr<uint32_t[]>> owned_upper_;
+    std::unique_ptr<std::mutex[]> link_mtx_;
+
+    // Views into either the owned storage or the mapped file
+    const float* vectors_ = nullptr;
+    const uint64_t* ids_ = nullptr;
+    const uint8_t* levels_ = nullptr;
+    const uint32_t* level0_ = nullptr;
+    const uint64_t* upper_offsets_ = nullptr; // Mapped files only
+    const uint32_t* upper_data_ = nullptr;
+    std::unique_ptr<utils::MappedFile> file_;
+
+    mutable std::mutex visited_mtx_;
+    mutable std::vector<std::unique_ptr<VisitedList>> visited_pool_;
+};
+
+namespace internal
+{
+/**
+ * Keeps the k highest scoring results seen so far.
+*/
+struct TopK
+{
+    TopK(size_t k) : k(k) { heap.reserve(k + 1); }
+    void push(uint64_t id, float score);
+    void merge(const TopK& other);
+    std::vector<SearchResult> sorted() &&;
+
+    size_t k;
+    std::vector<SearchResult> heap; // Min-heap on score. The front is the worst result kept
+};
+}
+
+}